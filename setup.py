@@ -37,9 +37,10 @@ zx_emulatorbase_module = Extension(
                    ('ZX_MINOR_VERSION', '%d' % ZX_MINOR_VERSION),
                    ('ZX_PATCH_VERSION', '%d' % ZX_PATCH_VERSION)],
     extra_compile_args=['-std=c++11', '-Wall', '-fno-exceptions', '-fno-rtti',
-                        '-O3',
+                        '-O3', '-pthread',
                         '-UNDEBUG',  # TODO
                         ],
+    extra_link_args=['-pthread'],
     sources=['zx/_emulatorbase.cpp'],
     language='c++')
 
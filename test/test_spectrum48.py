@@ -83,5 +83,674 @@ class test_keyboard(unittest.TestCase):
 '''
 
 
+class test_chunked_rendering(unittest.TestCase):
+    # Pictures produced by the chunked renderer shall be the
+    # same as the ones of the tick-by-tick renderer it replaced,
+    # which drew the screen area straight from memory and
+    # switched the border colour at chunk boundaries.
+    def runTest(self):
+        import random
+        from zx._machine import Spectrum48
+        mach = Spectrum48()
+
+        rnd = random.Random(1)
+        pattern = bytes(rnd.randrange(0x100) for _ in range(0x1800))
+        attrs = bytes(rnd.randrange(0x80) for _ in range(0x300))  # No flash.
+        mach.write(0x4000, pattern + attrs)
+
+        # Change the border in the middle of the frame and then
+        # spin.
+        mach.write(0x8000, b'\xf3' +         # di
+                           bytes(7000) +     # nop
+                           b'\x3e\x05'       # ld a, 5
+                           b'\xd3\xfe'       # out (0xfe), a
+                           b'\x18\xfe')      # jr $
+        mach.pc = 0x8000
+        mach.border_color = 2
+
+        def get_chunks():
+            chunks = memoryview(bytes(mach.render_screen())).cast('I')
+            return [chunks[i * 44:(i + 1) * 44] for i in range(280)]
+
+        def get_screen_chunk(line, i):
+            addr = (0x4000 + 0x800 * (line // 64) + 0x20 * (line % 64 // 8) +
+                    0x100 * (line % 8) + i)
+            attr = mach.read8(0x5800 + line // 8 * 0x20 + i)
+            bright = 0x8 if attr & 0x40 else 0
+            ink, paper = (attr & 0x7) | bright, ((attr >> 3) & 0x7) | bright
+            n = 0
+            for bit in range(7, -1, -1):
+                n = (n << 4) | (ink if mach.read8(addr) & (1 << bit) else paper)
+            return n
+
+        def is_screen_chunk(line, i):
+            return 48 <= line < 48 + 192 and 6 <= i < 6 + 32
+
+        mach.run_frames(1, render='last')
+        lines = get_chunks()
+        borders = []
+        for line in range(280):
+            for i in range(44):
+                chunk = lines[line][i]
+                if is_screen_chunk(line, i):
+                    assert chunk == get_screen_chunk(line - 48, i - 6), (
+                        line, i)
+                else:
+                    assert chunk in (0x22222222, 0x55555555), hex(chunk)
+                    borders.append(chunk)
+
+        # The border changes exactly once and at a chunk boundary.
+        n = borders.index(0x55555555)
+        assert n > 0
+        assert borders[:n] == [0x22222222] * n
+        assert borders[n:] == [0x55555555] * (len(borders) - n)
+
+        mach.run_frames(1, render='last')
+        lines = get_chunks()
+        for line in range(280):
+            for i in range(44):
+                if is_screen_chunk(line, i):
+                    expected = get_screen_chunk(line - 48, i - 6)
+                else:
+                    expected = 0x55555555
+                assert lines[line][i] == expected, (line, i)
+
+
+class test_lazy_rendering(unittest.TestCase):
+    # Deferring rendering to the logged events shall give the
+    # same pictures as rendering on every write, both for
+    # screen writes done in the middle of frames and for border
+    # changes.
+    def runTest(self):
+        import random
+        from zx._machine import Spectrum48
+
+        rnd = random.Random(2)
+        screen = bytes(rnd.randrange(0x100) for _ in range(0x1800))
+        screen += bytes(rnd.randrange(0x80) for _ in range(0x300))
+
+        # Spans more than a frame, so that the writes hit lines
+        # both before and behind the beam.
+        code = b'\xf3'                                    # di
+        for _ in range(60):
+            addr = rnd.randrange(0x4000, 0x5b00)
+            code += bytes(rnd.randrange(100, 600))           # nop
+            code += bytes([0x3e, rnd.randrange(0x100),       # ld a, n
+                           0x32, addr & 0xff, addr >> 8,     # ld (nn), a
+                           0x3e, rnd.randrange(8),           # ld a, n
+                           0xd3, 0xfe])                      # out (0xfe), a
+        code += b'\x18\xfe'                                # jr $
+
+        def make_machine(mode):
+            mach = Spectrum48()
+            mach.render_mode = mode
+            mach.write(0x4000, screen)
+            mach.write(0x8000, code)
+            mach.pc = 0x8000
+            mach.border_color = 1
+            return mach
+
+        lazy, full = make_machine('lazy'), make_machine('full')
+        for _ in range(3):
+            lazy.run_frames(1, render='last')
+            full.run_frames(1, render='last')
+            assert bytes(lazy.render_screen()) == bytes(full.render_screen())
+            assert (bytes(lazy.get_frame_pixels()) ==
+                    bytes(full.get_frame_pixels()))
+
+
+class test_contention_delays(unittest.TestCase):
+    # The precomputed table shall give the same delays as the
+    # formula it is built from.
+    def runTest(self):
+        from zx._machine import Spectrum48
+        mach = Spectrum48()
+
+        def get_delay(tick):
+            base = 14335 + 1
+            if tick < base or tick >= base + 192 * 224:
+                return 0
+            tick_in_line = (tick - base) % 224
+            if tick_in_line >= 128:
+                return 0
+            tick_in_cycle = tick_in_line % 8
+            return 0 if tick_in_cycle == 7 else 6 - tick_in_cycle
+
+        # The fourth machine cycle of the instruction reads
+        # contended memory ten ticks after the instruction
+        # begins. Fetching the instruction is not contended.
+        mach.write(0x8000, b'\x3a\x00\x40')  # ld a, (0x4000)
+        begin_ticks = (list(range(14300, 14336 + 224 * 2)) +
+                       list(range(14336 + 224 * 191 - 10, 14336 + 224 * 193)))
+        for tick in begin_ticks:
+            mach.pc = 0x8000
+            mach.iff1 = 0
+            mach.ticks_since_int = tick
+            mach.fetches_limit = 1
+            mach.run_frames(1)
+            assert mach.pc == 0x8003
+            ticks = mach.ticks_since_int - tick
+            assert ticks == 13 + get_delay(tick + 10), (tick, ticks)
+
+
+class test_save_and_load_state(unittest.TestCase):
+    def runTest(self):
+        import random
+        from zx._machine import Spectrum48
+        mach = Spectrum48()
+
+        rnd = random.Random(1)
+        mach.write(0x4000, bytes(rnd.randrange(0x100) for _ in range(0xc000)))
+        mach.write(0x8000, b'\xf3\x18\xfe')  # di; jr $
+        mach.pc = 0x8000
+        mach.hl = 0x1234
+        mach.sp = 0xfedc
+        mach.border_color = 3
+        mach.run_frames(1, render='last')
+
+        memory = bytes(mach.read(0, 0x10000))
+        picture = bytes(mach.render_screen())
+        pc = mach.pc
+        ticks = mach.ticks_since_int
+        state = mach.save_state()
+
+        mach.write(0x4000, bytes(0x100))
+        mach.write(0xc000, b'\xff' * 0x100)
+        mach.hl = 0x4321
+        mach.sp = 0x8000
+        mach.border_color = 6
+        mach.run_frames(3, render='last')
+        assert bytes(mach.render_screen()) != picture
+
+        mach.load_state(state)
+        assert bytes(mach.read(0, 0x10000)) == memory
+        assert mach.pc == pc
+        assert mach.hl == 0x1234
+        assert mach.sp == 0xfedc
+        assert mach.border_color == 3
+        assert mach.ticks_since_int == ticks
+        assert bytes(mach.render_screen()) == picture
+
+        # The state can be loaded more than once.
+        mach.run_frames(1, render='last')
+        mach.write(0x4000, bytes(0x1b00))
+        mach.load_state(state)
+        assert bytes(mach.read(0, 0x10000)) == memory
+        assert bytes(mach.render_screen()) == picture
+
+        # Frames saved before they are rendered are completed
+        # with the loaded border colour.
+        mach.run_frames(1)
+        state = mach.save_state()
+        picture = bytes(mach.render_screen())
+        mach.border_color = 5
+        mach.run_frames(1, render='last')
+        mach.load_state(state)
+        assert bytes(mach.render_screen()) == picture
+
+        # Debugging settings and the input state are not part
+        # of saved states.
+        from zx._keyboard import KEYS
+        mach.write(0x8000, b'\x3e\xfd'       # ld a, 0xfd
+                           b'\xdb\xfe'       # in a, (0xfe)
+                           b'\x32\x00\x90'   # ld (0x9000), a
+                           b'\x18\xfe')      # jr $
+        mach.pc = 0x8000
+        mach.set_key_pressed(KEYS['A'], True)
+        mach.enable_trace(False)
+        state = mach.save_state()
+        mach.set_key_pressed(KEYS['A'], False)
+        mach.enable_trace(True)
+        mach.load_state(state)
+        mach.run_frames(1)
+        assert mach.read8(0x9000) & 0x01
+        assert mach.get_trace_records()
+
+
+class test_rewind(unittest.TestCase):
+    def runTest(self):
+        from zx._machine import Spectrum48
+        mach = Spectrum48()
+        mach.write(0x4000, bytes(0x1b00))
+        mach.write(0x8000, b'\xf3\x18\xfe')  # di; jr $
+        mach.pc = 0x8000
+
+        assert not mach.rewind()
+
+        # Record a point at the end of every frame. Keyframes
+        # are taken every five points, so most of the points
+        # are deltas.
+        mach.enable_rewind(seconds=1, frames_per_point=1,
+                           keyframe_interval=5 / 50)
+        pictures = []
+        for i in range(12):
+            mach.write(0x4000 + i * 0x100, b'\xaa' * 0x20)
+            mach.write(0x9000, bytes([i]))
+            mach.hl = 0x1000 + i
+            mach.border_color = i % 8
+            mach.run_frames(1, render='last')
+            pictures.append(bytes(mach.render_screen()))
+        assert mach.get_num_of_rewind_points() == 12
+
+        # Discard the last three points and restore the one
+        # recorded after the ninth frame.
+        assert mach.rewind_points(3)
+        assert mach.get_num_of_rewind_points() == 9
+        assert mach.read8(0x9000) == 8
+        assert mach.hl == 0x1008
+        assert mach.border_color == 0
+        assert mach.read8(0x4000 + 9 * 0x100) == 0
+        assert bytes(mach.render_screen()) == pictures[8]
+
+        # Go further back, to a delta that follows a keyframe.
+        assert mach.rewind_points(2)
+        assert mach.read8(0x9000) == 6
+        assert mach.hl == 0x1006
+        assert bytes(mach.render_screen()) == pictures[6]
+
+        mach.disable_rewind()
+        assert not mach.rewind()
+
+
+class test_z80_memory_blocks(unittest.TestCase):
+    def runTest(self):
+        import random
+        from zx._machine import Spectrum48
+        from zx._emulatorbase import uncompress_z80_block
+        from zx._error import Error
+        from zx._z80snapshot import Z80SnapshotFormat
+        mach = Spectrum48()
+
+        # Runs of all lengths, including ones that do not fit a
+        # single run, and single and repeated marker bytes
+        # followed by all sorts of bytes.
+        rnd = random.Random(1)
+        block = bytearray()
+        while len(block) < 0xc000:
+            kind = rnd.randrange(4)
+            if kind == 0:
+                block += bytes([rnd.randrange(0x100)]) * rnd.randrange(1, 600)
+            elif kind == 1:
+                block += b'\xed' * rnd.randrange(1, 4) + bytes(
+                    [rnd.choice((0x00, 0xed, rnd.randrange(0x100)))])
+            else:
+                block += bytes(rnd.randrange(0x100)
+                               for _ in range(rnd.randrange(1, 20)))
+        block = bytes(block[:0xc000])
+
+        mach.write(0x4000, block)
+        compressed = mach.compress_z80_block(0x4000, 0xc000)
+        assert len(compressed) < len(block)
+        assert uncompress_z80_block(compressed, 0xc000) == (
+            block, len(compressed))
+
+        # Consuming stops at the end of the block.
+        assert uncompress_z80_block(compressed + b'\x00\xed\xed\x00',
+                                    0xc000) == (block, len(compressed))
+
+        # Version 1 snapshots terminate the memory block with
+        # a special marker. Zero PC would mean a later version.
+        mach.pc = 0x8000
+        mach.hl = 0x1234
+        image = Z80SnapshotFormat().make_snapshot(mach)
+        assert image.endswith(b'\x00\xed\xed\x00')
+        snapshot = Z80SnapshotFormat().parse('test.z80', image)
+        assert snapshot['memory_snapshot'] == block
+
+        other = Spectrum48()
+        other.install_snapshot(snapshot)
+        assert bytes(other.read(0x4000, 0xc000)) == block
+        assert other.pc == 0x8000
+        assert other.hl == 0x1234
+
+        # Corrupted snapshots are rejected before anything is
+        # installed.
+        with self.assertRaises(Error):
+            Z80SnapshotFormat().parse('test.z80', image[:-1] + b'\x01')
+        with self.assertRaises(Error):
+            Z80SnapshotFormat().parse('test.z80', image[:-5])
+
+        # Corrupted blocks produce fewer or more bytes than
+        # expected.
+        truncated = mach.compress_z80_block(0x4000, 0x100)[:-1]
+        assert uncompress_z80_block(truncated, 0x100) is None
+        overrun = b'\x00' * 0xfe + b'\xed\xed\x05\x00'
+        assert uncompress_z80_block(overrun, 0x100) is None
+
+
+class test_watchpoints(unittest.TestCase):
+    def runTest(self):
+        from zx._machine import Spectrum48, RunEvents
+        mach = Spectrum48()
+        READ, WRITE = mach.READ_WATCH_MARK, mach.WRITE_WATCH_MARK
+
+        mach.write(0x8000, b'\xf3'           # di
+                           b'\x3a\x00\x90'   # ld a, (0x9000)
+                           b'\x32\x01\x91'   # ld (0x9101), a
+                           b'\x18\xfe')      # jr $
+
+        def run():
+            mach.pc = 0x8000
+            events, _ = mach.run_frames(1)
+            if RunEvents.WATCHPOINT_HIT not in events:
+                return None
+            return mach.pc, mach.get_watchpoint()
+
+        assert run() is None
+
+        mach.set_watchpoints(0x9000, 1, read=True, write=False)
+        assert run() == (0x8004, (0x9000, READ))
+
+        # Writes to read-watched bytes and reads of write-watched
+        # ones are not caught.
+        mach.clear_watchpoints(0x9000, 1)
+        mach.set_watchpoints(0x9000, 1, read=False, write=True)
+        mach.set_watchpoints(0x9101, 1, read=True, write=False)
+        assert run() is None
+
+        mach.clear_watchpoints(0x9101, 1)
+        mach.set_watchpoints(0x9101, 1)
+        assert run() == (0x8007, (0x9101, WRITE))
+
+        # Clearing a watchpoint keeps the other ones in the same
+        # page in effect.
+        mach.clear_watchpoints(0x9000, 0x200)
+        mach.set_watchpoints(0x9000, 2, read=True)
+        mach.clear_watchpoints(0x9001, 1)
+        assert run() == (0x8004, (0x9000, READ))
+
+        # Clearing the last one in a page lifts the watch.
+        mach.clear_watchpoints(0x9000, 1)
+        assert run() is None
+        assert not any(m & (READ | WRITE) for m in mach.get_memory_marks())
+
+        # Breakpoints and other marks are not affected.
+        mach.set_breakpoint(0x8007)
+        mach.set_watchpoints(0x9000, 1, read=True)
+        mach.clear_watchpoints(0x9000, 1)
+        mach.pc = 0x8000
+        events, _ = mach.run_frames(1)
+        assert events == RunEvents.BREAKPOINT_HIT, events
+        assert mach.pc == 0x8007
+
+
+class test_disassembly_cache(unittest.TestCase):
+    def runTest(self):
+        from zx._machine import Spectrum48
+        mach = Spectrum48()
+
+        def disassemble_afresh(code):
+            m = Spectrum48()
+            m.write(0x9000, code)
+            return m.disassemble_range(0x9000, len(code))
+
+        code = b'\x3e\x01\x32\x00\x80\x18\xfe\x00'
+        mach.write(0x9000, code)
+        instrs = mach.disassemble_range(0x9000, 8)
+        assert instrs == disassemble_afresh(code)
+        assert instrs[0][0] == 0x9000
+        for i, (addr, size, text) in enumerate(instrs):
+            assert 0 < size <= 4, size
+            assert text
+            if i + 1 < len(instrs):
+                assert instrs[i + 1][0] == addr + size
+
+        # Cached instructions are not reused once their bytes
+        # change, including the operand ones.
+        assert mach.disassemble_range(0x9000, 8) == instrs
+        code = b'\x3c\x3c\x3a\x00\x80\x00\x00\x00'
+        mach.write(0x9000, code)
+        assert mach.disassemble_range(0x9000, 8) == disassemble_afresh(code)
+        assert mach.disassemble_range(0x9000, 8) != instrs
+
+        code = code[:3] + b'\xff' + code[4:]
+        mach.write(0x9000, code)
+        assert mach.disassemble_range(0x9000, 8) == disassemble_afresh(code)
+
+
+class test_calls_while_running(unittest.TestCase):
+    # Input callbacks are called while the machine is running,
+    # so they are not allowed to change or run the machine.
+    def runTest(self):
+        from zx._machine import Spectrum48
+        mach = Spectrum48()
+        mach.write(0x8000, b'\xf3'           # di
+                           b'\xdb\x1f'       # in a, (0x1f)
+                           b'\x18\xfe')      # jr $
+
+        errors = []
+
+        def on_input(addr, n):
+            for call in (lambda: mach.run_frames(1),
+                         lambda: mach.pause_tape(True),
+                         lambda: mach.set_tape_pulses(b''),
+                         lambda: mach.load_state(state),
+                         lambda: setattr(mach, 'pc', 0)):
+                try:
+                    call()
+                except RuntimeError as e:
+                    errors.append(str(e))
+            return n
+
+        state = mach.save_state()
+        mach.set_on_input_callback(on_input)
+        mach.hook_input_ports(0x1f, 1, True)
+        mach.pc = 0x8000
+        mach.run_frames(1)
+        assert errors == ['machine is running'] * 5, errors
+
+        # The machine can be changed and run again once it returns.
+        mach.pause_tape(True)
+        mach.pc = 0x8000
+        mach.run_frames(1)
+
+class test_fast_machine(unittest.TestCase):
+    def runTest(self):
+        from zx._machine import FastSpectrum48
+        from zx._machine import RunEvents
+        mach = FastSpectrum48()
+        mach.write(0x8000, b'\xf3'           # di
+                           b'\x3c'           # inc a
+                           b'\x18\xfd')      # jr $-1
+
+        # Breakpoints are kept, as flash loading relies on them.
+        mach.set_breakpoint(0x8001)
+        mach.pc = 0x8000
+        events, _ = mach.run_frames(1)
+        assert RunEvents.BREAKPOINT_HIT in events
+        assert mach.pc == 0x8001
+
+        # Statistics are not maintained.
+        mach.clear_breakpoint(0x8001)
+        mach.run_frames(1)
+        assert mach.get_stats()['instrs'] == 0
+
+        with self.assertRaises(NotImplementedError):
+            mach.get_trace_records()
+        with self.assertRaises(NotImplementedError):
+            mach.enable_profiling()
+
+class test_playback(unittest.TestCase):
+    # RZX input recordings are played back natively chunk by
+    # chunk. Frames of a chunk are given as pairs of the numbers
+    # of instruction fetches and input samples.
+    def runTest(self):
+        import struct
+        from zx._machine import RunEvents
+        from zx._machine import Spectrum48
+
+        def get_chunk(frames):
+            return struct.pack('<%dI' % (len(frames) * 2),
+                               *(n for frame in frames for n in frame))
+
+        def start(first_instr, frames, samples, spin_quirks=False):
+            mach = Spectrum48()
+            code = first_instr
+            for i in range(8):
+                code += bytes([0xdb, 0xfe,           # in a, (0xfe)
+                               0x32, i, 0x90])       # ld (0x9000 + i), a
+            code += b'\x18\xfe'                     # jr $
+            mach.write(0x8000, code)
+            mach.write(0x9000, bytes(8))
+            mach.pc = 0x8000
+            mach.sp = 0xc000
+
+            # Keep off the interrupt at the beginning of the frame.
+            mach.ticks_since_int = 1000
+
+            mach.set_spin_playback_quirks(spin_quirks)
+            mach.set_playback_chunk(get_chunk(frames), samples)
+            events, _ = mach.run_frames(1)
+            return mach, events
+
+        # Every frame consumes its own samples. The interrupt
+        # between frames is initiated natively and the control
+        # is handed over to Python at the end of the chunk.
+        mach, events = start(b'\xfb',               # ei
+                             [(5, 2), (1, 0)], b'\x11\x22')
+        assert events == RunEvents.END_OF_PLAYBACK_CHUNK, events
+        assert not mach.is_playback_active()
+        assert mach.get_playback_error() is None
+        assert bytes(mach.read(0x9000, 3)) == b'\x11\x22\x00'
+        assert not mach.iff1
+        assert mach.sp == 0xbffe
+        assert mach.read16(mach.sp) == 0x800b
+
+        # The next chunk continues where the previous one ended.
+        mach, events = start(b'\xf3',               # di
+                             [(3, 1)], b'\x11')
+        assert events == RunEvents.END_OF_PLAYBACK_CHUNK, events
+        mach.set_playback_chunk(get_chunk([(2, 1)]), b'\x22')
+        events, _ = mach.run_frames(1)
+        assert events == RunEvents.END_OF_PLAYBACK_CHUNK, events
+        assert bytes(mach.read(0x9000, 3)) == b'\x11\x22\x00'
+        assert mach.pc == 0x800b
+
+        # Missing and excessive samples.
+        mach, events = start(b'\xf3', [(5, 1)], b'\x11')
+        assert events == RunEvents.PLAYBACK_ERROR, events
+        assert mach.get_playback_error() == 'too_few_input_samples'
+        assert not mach.is_playback_active()
+
+        mach, events = start(b'\xf3', [(1, 1), (2, 1)], b'\x11\x22')
+        assert events == RunEvents.PLAYBACK_ERROR, events
+        assert mach.get_playback_error() == 'too_many_input_samples'
+        assert mach.pc == 0x8001
+
+        # SPIN v0.5 doesn't count the last IN instruction of a
+        # frame, so with the quirks enabled the frame continues
+        # until the samples are consumed.
+        mach, events = start(b'\xf3', [(1, 1), (2, 1)], b'\x11\x22',
+                             spin_quirks=True)
+        assert events == RunEvents.END_OF_PLAYBACK_CHUNK, events
+        assert bytes(mach.read(0x9000, 2)) == b'\x11\x00'
+        assert mach.a == 0x22
+        assert mach.pc == 0x8008
+
+class test_tape_flash_loading(unittest.TestCase):
+    # Entering the ROM LD-BYTES routine in the flash-loading mode
+    # loads the next tape block directly into memory.
+    def runTest(self):
+        import struct
+        from zx._machine import Spectrum48
+        from zx._tap import TAPFileFormat
+        from zx._tzx import TZXFileFormat
+
+        def get_block(flag, data):
+            parity = flag
+            for n in data:
+                parity ^= n
+            return bytes([flag]) + data + bytes([parity])
+
+        def get_tap(blocks):
+            return b''.join(struct.pack('<H', len(block)) + block
+                            for block in blocks)
+
+        def load_tape(image, format):
+            mach = Spectrum48()
+            mach.load_parsed_tape(format().parse('test', image))
+            mach.enable_tape_flash_loading()
+            mach.pause_tape(False)
+            mach.write(0x9000, bytes(0x200))
+            return mach
+
+        CF = 0x01
+
+        # Returns whether the entry has been trapped and whether
+        # the block was loaded without errors.
+        def ld_bytes(mach, flag, addr, size, verify=False):
+            mach.write(0xbffe, b'\x34\x12')
+            mach.sp = 0xbffe
+            mach.pc = 0x0556
+            mach.af = (flag << 8) | (0 if verify else CF)
+            mach.ix = addr
+            mach.de = size
+            assert mach._handle_tape_flash_loading()
+            if mach.pc == 0x0556:
+                return None
+            assert mach.pc == 0x1234
+            assert mach.sp == 0xc000
+            return bool(mach.f & CF)
+
+        data = b'\x01\x02\x03\x04'
+        bad_parity = get_block(0xff, data)[:-1] + b'\x00'
+        mach = load_tape(get_tap([get_block(0xff, data),
+                                  get_block(0xff, data),
+                                  get_block(0xff, data),
+                                  get_block(0xff, b'\x01\x02\x05\x04'),
+                                  bad_parity,
+                                  get_block(0xff, data)]),
+                         TAPFileFormat)
+
+        assert ld_bytes(mach, 0xff, 0x9000, 4)
+        assert bytes(mach.read(0x9000, 5)) == data + b'\x00'
+        assert mach.ix == 0x9004
+        assert mach.de == 0
+
+        # Blocks with unexpected flags are skipped.
+        assert not ld_bytes(mach, 0x00, 0x9100, 4)
+        assert bytes(mach.read(0x9100, 4)) == bytes(4)
+        assert mach.ix == 0x9100
+        assert mach.de == 4
+
+        # Verifying does not change the memory and stops at the
+        # first mismatch.
+        assert ld_bytes(mach, 0xff, 0x9000, 4, verify=True)
+        assert not ld_bytes(mach, 0xff, 0x9000, 4, verify=True)
+        assert bytes(mach.read(0x9000, 4)) == data
+        assert mach.ix == 0x9002
+        assert mach.de == 2
+
+        # Blocks failing the parity check are still loaded.
+        assert not ld_bytes(mach, 0xff, 0x9100, 4)
+        assert bytes(mach.read(0x9100, 4)) == data
+
+        # The ROM is not written.
+        rom = bytes(mach.read(0x3ffe, 2))
+        assert ld_bytes(mach, 0xff, 0x3ffe, 4)
+        assert bytes(mach.read(0x3ffe, 4)) == rom + data[2:]
+
+        # Turbo blocks are left to the ROM routine to load them
+        # from pulses.
+        turbo_block = get_block(0xff, data)
+        tzx = (b'ZXTape!\x1a\x01\x14' +
+               b'\x10' + struct.pack('<HH', 1000, len(turbo_block)) +
+               turbo_block +
+               b'\x11' + struct.pack('<HHHHHHBHHB', 2168, 667, 735, 855,
+                                     1710, 3223, 8, 1000,
+                                     len(turbo_block), 0) +
+               turbo_block)
+        mach = load_tape(tzx, TZXFileFormat)
+        assert ld_bytes(mach, 0xff, 0x9000, 4)
+        pos = mach.get_tape_position()
+        assert ld_bytes(mach, 0xff, 0x9100, 4) is None
+        assert mach.get_tape_position() == pos
+        assert bytes(mach.read(0x9100, 4)) == bytes(4)
+
+        # Other breakpoints are not trapped.
+        mach.pc = 0x8000
+        assert not mach._handle_tape_flash_loading()
+
+
 if __name__ == '__main__':
     unittest.main()
@@ -0,0 +1,466 @@
+/*  ZX Spectrum Emulator.
+    https://github.com/kosarev/zx
+
+    Copyright (C) 2017-2021 Ivan Kosarev.
+    ivan@kosarev.info
+
+    Published under the MIT license.
+*/
+
+#include <chrono>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <vector>
+
+#include "../zx.h"
+
+using z80::least_u8;
+using z80::fast_u8;
+using z80::fast_u16;
+
+namespace {
+
+#if defined(__GNUC__) || defined(__clang__)
+# define LIKE_PRINTF(format, args) \
+      __attribute__((__format__(__printf__, format, args)))
+#else
+# define LIKE_PRINTF(format, args) /* nothing */
+#endif
+
+const char program_name[] = "zx-bench";
+
+[[noreturn]] LIKE_PRINTF(1, 0)
+void verror(const char *format, va_list args) {
+    std::fprintf(stderr, "%s: ", program_name);
+    std::vfprintf(stderr, format, args);
+    std::fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+[[noreturn]] LIKE_PRINTF(1, 2)
+void error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    verror(format, args);
+    va_end(args);
+}
+
+std::vector<least_u8> read_file(const char *filename) {
+    FILE *f = std::fopen(filename, "rb");
+    if(!f)
+        error("cannot open file '%s': %s", filename, std::strerror(errno));
+
+    std::vector<least_u8> image;
+    least_u8 buffer[4096];
+    for(;;) {
+        std::size_t size = std::fread(buffer, /* size= */ 1, sizeof(buffer), f);
+        image.insert(image.end(), buffer, buffer + size);
+        if(size < sizeof(buffer))
+            break;
+    }
+
+    if(ferror(f))
+        error("cannot read file '%s': %s", filename, std::strerror(errno));
+    if(std::fclose(f) != 0)
+        error("cannot close file '%s': %s", filename, std::strerror(errno));
+    return image;
+}
+
+typedef uint_fast64_t time_type;
+
+// Keys are specified as half-row and bit numbers.
+struct key {
+    unsigned halfrow;
+    unsigned bit;
+};
+
+const key key_enter = {6, 0};
+const key key_j = {6, 3};
+const key key_p = {5, 0};
+const key key_symbol_shift = {7, 1};
+const key key_space = {7, 0};
+
+// Plays TAP files with the standard ROM timings.
+class tap_player {
+public:
+    void load(const std::vector<least_u8> &image) {
+        pulse_ends.clear();
+        pulse_levels.clear();
+        end_tick = 0;
+        level = false;
+
+        std::size_t pos = 0;
+        while(pos != image.size()) {
+            if(image.size() - pos < 2)
+                error("the TAP file is truncated");
+            std::size_t size = image[pos] | (image[pos + 1] << 8);
+            pos += 2;
+            if(image.size() - pos < size)
+                error("the TAP file is truncated");
+
+            if(size) {
+                bool is_header = image[pos] < 128;
+                add_pulses(2168, is_header ? 8063 : 3223);
+                add_pulses(667, 1);
+                add_pulses(735, 1);
+                for(std::size_t i = 0; i != size; ++i) {
+                    for(unsigned bit = 0; bit != 8; ++bit)
+                        add_pulses((image[pos + i] & (0x80 >> bit)) ?
+                                       1710 : 855, 2);
+                }
+
+                // A pause of 1s. The level is kept.
+                add_pause(3500000);
+            }
+
+            pos += size;
+        }
+
+        next_pulse = 0;
+    }
+
+    bool is_end(time_type tick) const { return tick >= end_tick; }
+
+    bool get_level(time_type tick) {
+        while(next_pulse != pulse_ends.size() &&
+                  pulse_ends[next_pulse] <= tick)
+            ++next_pulse;
+        return next_pulse != pulse_ends.size() && pulse_levels[next_pulse];
+    }
+
+private:
+    void add_pulses(time_type duration, unsigned count) {
+        for(unsigned i = 0; i != count; ++i) {
+            end_tick += duration;
+            pulse_ends.push_back(end_tick);
+            pulse_levels.push_back(level);
+            level = !level;
+        }
+    }
+
+    void add_pause(time_type duration) {
+        end_tick += duration;
+        pulse_ends.push_back(end_tick);
+        pulse_levels.push_back(level);
+    }
+
+    std::vector<time_type> pulse_ends;
+    std::vector<bool> pulse_levels;
+    std::size_t next_pulse = 0;
+    time_type end_tick = 0;
+    bool level = false;
+};
+
+class bench_spectrum48 : public zx::spectrum48<bench_spectrum48> {
+public:
+    typedef zx::spectrum48<bench_spectrum48> machine;
+
+    void load_rom(const std::vector<least_u8> &rom) {
+        static const std::size_t rom_size = 16384;  // 16K
+        if(rom.size() != rom_size)
+            error("the ROM image shall be %u bytes",
+                  static_cast<unsigned>(rom_size));
+        std::copy(rom.begin(), rom.end(), std::begin(memory));
+    }
+
+    void load_program(fast_u16 addr, const least_u8 *bytes, std::size_t size) {
+        std::copy(bytes, bytes + size, std::begin(memory) + addr);
+    }
+
+    void load_tape(const std::vector<least_u8> &image) {
+        tape.load(image);
+        tape_start = get_time();
+        tape_playing = true;
+    }
+
+    bool is_end_of_tape() const {
+        return tape_playing && tape.is_end(get_time() - tape_start);
+    }
+
+    // Time in ticks since the machine started.
+    time_type get_time() const { return frames_ticks + get_ticks(); }
+
+    uint_fast64_t get_num_of_instrs() const { return num_of_instrs; }
+
+    void run_frame() {
+        // The ticks counter is normalized on entering the new frame.
+        if(get_ticks() >= ticks_per_frame)
+            frames_ticks += ticks_per_frame;
+
+        while(!(machine::run() & zx::end_of_frame)) {}
+        render_screen();
+    }
+
+    void run_frames(unsigned num_of_frames) {
+        for(unsigned i = 0; i != num_of_frames; ++i)
+            run_frame();
+    }
+
+    void stroke_keys(std::initializer_list<key> keys) {
+        const unsigned frames_per_stroke = 3;
+        for(const key &k : keys)
+            set_key_pressed(k.halfrow, k.bit, true);
+        run_frames(frames_per_stroke);
+        for(const key &k : keys)
+            set_key_pressed(k.halfrow, k.bit, false);
+        run_frames(frames_per_stroke);
+    }
+
+    // Prefixed instructions are counted once, the same way
+    // the core's statistics do.
+    void on_step() {
+        if(get_iregp_kind() == z80::iregp::hl)
+            ++num_of_instrs;
+        machine::on_step();
+    }
+
+    fast_u8 on_input(fast_u16 addr) {
+        if(tape_playing)
+            set_ear_level(tape.get_level(get_time() - tape_start));
+        return machine::on_input(addr);
+    }
+
+    zx::memory_image_type &on_get_memory() {
+        return memory;
+    }
+
+private:
+    zx::memory_image_type memory = {};
+    time_type frames_ticks = 0;
+    uint_fast64_t num_of_instrs = 0;
+    tap_player tape;
+    time_type tape_start = 0;
+    bool tape_playing = false;
+};
+
+struct bench_result {
+    const char *name;
+    unsigned num_of_frames;
+    time_type num_of_ticks;
+    uint_fast64_t num_of_instrs;
+    double seconds;
+};
+
+struct bench_options {
+    std::vector<least_u8> rom;
+    const char *tap_filename;
+    unsigned num_of_frames;
+};
+
+// Measures the execution of the specified number of frames,
+// or of frames till the end of the tape if zero.
+bench_result measure(const char *name, bench_spectrum48 &mach,
+                     unsigned num_of_frames) {
+    typedef std::chrono::steady_clock clock;
+    time_type begin_ticks = mach.get_time();
+    uint_fast64_t begin_instrs = mach.get_num_of_instrs();
+    clock::time_point begin_time = clock::now();
+
+    unsigned frame = 0;
+    while(num_of_frames ? frame != num_of_frames : !mach.is_end_of_tape()) {
+        mach.run_frame();
+        ++frame;
+    }
+
+    std::chrono::duration<double> elapsed = clock::now() - begin_time;
+
+    bench_result result;
+    result.name = name;
+    result.num_of_frames = frame;
+    result.num_of_ticks = mach.get_time() - begin_ticks;
+    result.num_of_instrs = mach.get_num_of_instrs() - begin_instrs;
+    result.seconds = elapsed.count();
+    return result;
+}
+
+std::unique_ptr<bench_spectrum48> create_machine(const bench_options &opts) {
+    std::unique_ptr<bench_spectrum48> mach(new bench_spectrum48);
+    mach->load_rom(opts.rom);
+    return mach;
+}
+
+const unsigned boot_frames = 100;
+
+// Boots the machine and starts loading the tape with LOAD "".
+void start_tape_loading(bench_spectrum48 &mach, const bench_options &opts) {
+    mach.run_frames(boot_frames);
+
+    mach.stroke_keys({key_j});
+    mach.stroke_keys({key_symbol_shift, key_p});
+    mach.stroke_keys({key_symbol_shift, key_p});
+    mach.stroke_keys({key_enter});
+
+    mach.load_tape(read_file(opts.tap_filename));
+}
+
+bench_result bench_boot(const bench_options &opts) {
+    auto mach = create_machine(opts);
+    return measure("boot", *mach, opts.num_of_frames ?
+                                      opts.num_of_frames : boot_frames);
+}
+
+// Reads and writes screen memory and the border from code in
+// contended memory.
+bench_result bench_contention(const bench_options &opts) {
+    static const least_u8 program[] = {
+        0xf3,              // di
+        0x21, 0x00, 0x40,  // ld hl, 0x4000
+        0x7e,              // loop: ld a, (hl)
+        0x77,              // ld (hl), a
+        0x23,              // inc hl
+        0xd3, 0xfe,        // out (0xfe), a
+        0x18, 0xf9,        // jr loop
+    };
+
+    auto mach = create_machine(opts);
+    const fast_u16 addr = 0x6000;
+    mach->load_program(addr, program, sizeof(program));
+    mach->set_pc(addr);
+    return measure("contention", *mach, opts.num_of_frames ?
+                                            opts.num_of_frames : 500);
+}
+
+bench_result bench_tape_load(const bench_options &opts) {
+    auto mach = create_machine(opts);
+    start_tape_loading(*mach, opts);
+    return measure("tape-load", *mach, opts.num_of_frames);
+}
+
+// Runs the test/screen_timing program once it is loaded and
+// started.
+bench_result bench_screen_timing(const bench_options &opts) {
+    auto mach = create_machine(opts);
+    start_tape_loading(*mach, opts);
+    while(!mach->is_end_of_tape())
+        mach->run_frame();
+
+    // Wait for the program to be started and then pass the
+    // "PRESS ANY KEY TO START" prompt.
+    mach->run_frames(50);
+    mach->stroke_keys({key_space});
+
+    return measure("screen-timing", *mach, opts.num_of_frames ?
+                                               opts.num_of_frames : 500);
+}
+
+struct workload {
+    const char *name;
+    bench_result (*run)(const bench_options &opts);
+};
+
+const workload workloads[] = {
+    { "boot", bench_boot },
+    { "contention", bench_contention },
+    { "tape-load", bench_tape_load },
+    { "screen-timing", bench_screen_timing },
+};
+
+double get_mhz(const bench_result &r) {
+    return static_cast<double>(r.num_of_ticks) / r.seconds / 1e6;
+}
+
+double get_frames_per_second(const bench_result &r) {
+    return r.num_of_frames / r.seconds;
+}
+
+double get_ns_per_instr(const bench_result &r) {
+    return r.num_of_instrs ?
+        r.seconds * 1e9 / static_cast<double>(r.num_of_instrs) : 0;
+}
+
+void print_results(const std::vector<bench_result> &results) {
+    std::printf("%-14s %8s %10s %10s %10s\n",
+                "workload", "frames", "MHz", "frames/s", "ns/instr");
+    for(const bench_result &r : results)
+        std::printf("%-14s %8u %10.2f %10.1f %10.2f\n",
+                    r.name, r.num_of_frames, get_mhz(r),
+                    get_frames_per_second(r), get_ns_per_instr(r));
+}
+
+void print_json_results(const std::vector<bench_result> &results) {
+    std::printf("{\n  \"workloads\": [");
+    const char *separator = "";
+    for(const bench_result &r : results) {
+        std::printf("%s\n    {\"name\": \"%s\", \"frames\": %u, "
+                    "\"ticks\": %llu, \"instructions\": %llu, "
+                    "\"seconds\": %.6f, \"mhz\": %.3f, "
+                    "\"frames_per_second\": %.3f, "
+                    "\"ns_per_instruction\": %.3f}",
+                    separator, r.name, r.num_of_frames,
+                    static_cast<unsigned long long>(r.num_of_ticks),
+                    static_cast<unsigned long long>(r.num_of_instrs),
+                    r.seconds, get_mhz(r), get_frames_per_second(r),
+                    get_ns_per_instr(r));
+        separator = ",";
+    }
+    std::printf("\n  ]\n}\n");
+}
+
+[[noreturn]] void usage() {
+    std::printf("Usage: %s [--json] [--rom <file>] [--tap <file>] "
+                "[--frames <n>] [<workload>...]\n", program_name);
+    std::printf("Workloads:");
+    for(const workload &w : workloads)
+        std::printf(" %s", w.name);
+    std::printf("\n");
+    exit(EXIT_SUCCESS);
+}
+
+}  // anonymous namespace
+
+int main(int argc, const char *argv[]) {
+    const char *rom_filename = "/usr/share/spectrum-roms/48.rom";
+    bench_options opts;
+    opts.tap_filename = "test/screen_timing/screen_timing.tap";
+    opts.num_of_frames = 0;
+    bool json = false;
+
+    std::vector<const workload*> selected;
+    for(int i = 1; i != argc; ++i) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 != argc;
+        if(std::strcmp(arg, "--json") == 0) {
+            json = true;
+        } else if(std::strcmp(arg, "--rom") == 0 && has_value) {
+            rom_filename = argv[++i];
+        } else if(std::strcmp(arg, "--tap") == 0 && has_value) {
+            opts.tap_filename = argv[++i];
+        } else if(std::strcmp(arg, "--frames") == 0 && has_value) {
+            opts.num_of_frames = static_cast<unsigned>(
+                std::strtoul(argv[++i], nullptr, 10));
+        } else if(std::strcmp(arg, "--help") == 0) {
+            usage();
+        } else {
+            const workload *found = nullptr;
+            for(const workload &w : workloads) {
+                if(std::strcmp(arg, w.name) == 0)
+                    found = &w;
+            }
+            if(!found)
+                error("unknown workload or option '%s'", arg);
+            selected.push_back(found);
+        }
+    }
+
+    if(selected.empty()) {
+        for(const workload &w : workloads)
+            selected.push_back(&w);
+    }
+
+    opts.rom = read_file(rom_filename);
+
+    std::vector<bench_result> results;
+    for(const workload *w : selected)
+        results.push_back(w->run(opts));
+
+    if(json)
+        print_json_results(results);
+    else
+        print_results(results);
+}
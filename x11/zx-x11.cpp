@@ -8,15 +8,27 @@
     Published under the MIT license.
 */
 
+#include <atomic>
+#include <chrono>
 #include <cerrno>
 #include <cstdarg>
 #include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xos.h>
 #include <X11/Xatom.h>
 #include <X11/XKBlib.h>
+#include <X11/extensions/XShm.h>
 
 #include "../zx.h"
 
@@ -65,6 +77,86 @@ void error(const char *format, ...) {
     va_end(args);
 }
 
+// Set by the error handler installed while attaching shared
+// memory segments.
+bool shm_attach_failed = false;
+
+int handle_shm_attach_error(::Display *display, ::XErrorEvent *event) {
+    static_cast<void>(display);
+    static_cast<void>(event);
+    shm_attach_failed = true;
+    return 0;
+}
+
+// Passes buffers from a producer thread to a consumer thread
+// without locking. Each side owns one of the three buffers and
+// they are swapped with the third one that holds the most recent
+// published data.
+template<typename T>
+class triple_buffer {
+public:
+    T &get_back_buffer() { return buffers[back]; }
+    const T &get_front_buffer() const { return buffers[front]; }
+
+    // Makes the back buffer the most recent one.
+    void publish() {
+        back = middle.exchange(back | fresh_bit) & index_mask;
+    }
+
+    // Takes the most recent buffer, if there is a new one.
+    bool take() {
+        if(!(middle.load() & fresh_bit))
+            return false;
+
+        front = middle.exchange(front) & index_mask;
+        return true;
+    }
+
+private:
+    static const unsigned index_mask = 0x3;
+    static const unsigned fresh_bit = 0x4;
+
+    T buffers[3];
+    unsigned back = 0;
+    unsigned front = 1;
+    std::atomic<unsigned> middle{2};
+};
+
+// A lock-free single-producer single-consumer queue.
+template<typename T, unsigned size>
+class spsc_queue {
+public:
+    bool push(const T &item) {
+        unsigned tail_index = tail.load(std::memory_order_relaxed);
+        unsigned next = (tail_index + 1) % size;
+        if(next == head.load(std::memory_order_acquire))
+            return false;
+
+        items[tail_index] = item;
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) {
+        unsigned head_index = head.load(std::memory_order_relaxed);
+        if(head_index == tail.load(std::memory_order_acquire))
+            return false;
+
+        item = items[head_index];
+        head.store((head_index + 1) % size, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T items[size];
+    std::atomic<unsigned> head{0};
+    std::atomic<unsigned> tail{0};
+};
+
+// The emulation runs in its own thread, so that stalls of the
+// X server do not delay it. Frames and key events are passed
+// between the threads through lock-free buffers. Only the
+// display thread talks to the X server.
 template<typename M>
 class x11_emulator : public M {
 public:
@@ -72,10 +164,24 @@ public:
 
     x11_emulator()
         : window_pixels(nullptr), display(nullptr), window(), image(nullptr),
-          gc(), done(false),
-          keyboard_state{0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff}
+          gc(), shm_info(), shm_completion_type(0), shm_used(false),
+          num_of_pending_shm_puts(0), scale(1), throttled(true),
+          frame_event_fd(-1), done(false),
+          whole_window_update(true), whole_image_update(true)
     {}
 
+    // Window pixels are magnified by the specified integer
+    // scale during conversion of rendered frames.
+    void set_scale(unsigned new_scale) {
+        assert(!display);
+        scale = new_scale;
+    }
+
+    // Unthrottled emulation runs as fast as possible.
+    void set_throttled(bool new_throttled) {
+        throttled = new_throttled;
+    }
+
     void create(int argc, const char *argv[]) {
         assert(!window_pixels);
         window_pixels = static_cast<window_pixels_type*>(
@@ -83,6 +189,15 @@ public:
         if(!window_pixels)
             error("not enough memory");
 
+        frames.reset(new frames_type);
+
+        frame_event_fd = ::eventfd(0, EFD_NONBLOCK);
+        if(frame_event_fd < 0)
+            error("cannot create event descriptor: %s", std::strerror(errno));
+
+        unsigned window_width = get_window_width();
+        unsigned window_height = get_window_height();
+
         assert(!display);
         display = ::XOpenDisplay(nullptr);
         if(!display)
@@ -132,15 +247,13 @@ public:
                            const_cast<char**>(argv), argc,
                            &size_hints, &wm_hints, &class_hint);
 
-        ::XSelectInput(display, window, KeyPressMask | KeyReleaseMask);
+        ::XSelectInput(display, window,
+                       ExposureMask | KeyPressMask | KeyReleaseMask);
         ::XMapWindow(display, window);
 
-        image = ::XCreateImage(
-            display, DefaultVisual(display, DefaultScreen(display)),
-            /* depth= */ 24, ZPixmap, /* offset= */ 0,
-            reinterpret_cast<char*>(window_pixels),
-            window_width, window_height,
-            /* line_pad= */ 8, /* bytes_per_line= */ 0);
+        shm_used = create_shm_image();
+        if(!shm_used)
+            create_image();
 
         gc = ::XCreateGC(display, window, 0, nullptr);
 
@@ -154,12 +267,31 @@ public:
 
     void destroy() {
         ::XFreeGC(display, gc);
+
+        if(shm_used) {
+            wait_for_shm_puts();
+            ::XShmDetach(display, &shm_info);
+            ::XSync(display, False);
+            ::shmdt(shm_info.shmaddr);
+
+            // The pixels are in the shared segment.
+            image->data = nullptr;
+        }
+
         ::XFlush(display);
 
-        // Also releases the pixels.
+        // Also releases the pixels of non-shared images.
         XDestroyImage(image);
 
         ::XCloseDisplay(display);
+
+        std::free(window_pixels);
+        window_pixels = nullptr;
+
+        frames.reset();
+
+        ::close(frame_event_fd);
+        frame_event_fd = -1;
     }
 
     unsigned translate_spectrum_key(::KeySym key) {
@@ -222,23 +354,19 @@ public:
         unsigned bit_no = (key >> 4);
         assert(bit_no >= 0 && bit_no <= 4);
 
-        least_u8 &port = keyboard_state[port_no - 8];
-        fast_u8 mask = 1u << bit_no;
-        if(pressed)
-            port = static_cast<least_u8>(port & ~mask);
-        else
-            port = static_cast<least_u8>(port | mask);
+        // Wait for the emulation thread to free space rather
+        // than lose the key.
+        key_update update = { port_no - 8, bit_no, pressed };
+        while(!key_updates.push(update) && !done)
+            std::this_thread::yield();
     }
 
-    void handle_keyboard_events() {
-        ::XEvent event;
-        if(!XCheckMaskEvent(display, KeyPressMask | KeyReleaseMask, &event))
-            return;
-
+    void handle_key_event(const ::XEvent &event) {
         bool pressed = (event.type == KeyPress);
         auto key_code = static_cast<::KeyCode>(event.xkey.keycode);
         ::KeySym key = ::XkbKeycodeToKeysym(display, key_code,
-                                            /* group= */ 0, /* level= */ 0);
+                                            /* group= */ 0,
+                                            /* level= */ 0);
 
         if(pressed && key == XK_F10) {
             done = true;
@@ -249,36 +377,70 @@ public:
             handle_spectrum_key(spectrum_key, pressed);
     }
 
-    void handle_events() {
-        // Check if the Close Button on the window caption is pressed.
-        ::XEvent event;
-        if(::XCheckTypedWindowEvent(display, window, ClientMessage, &event)) {
+    void handle_event(const ::XEvent &event) {
+        switch(event.type) {
+        case ClientMessage:
+            // Check if the Close Button on the window caption
+            // is pressed.
             if(static_cast<::Atom>(event.xclient.data.l[0]) ==
-                   wm_delete_window_atom) {
+                   wm_delete_window_atom)
                 done = true;
-                return;
-            }
+            return;
+        case Expose:
+            // Redraw the whole window when its contents are lost.
+            whole_window_update = true;
+            return;
+        case KeyPress:
+        case KeyRelease:
+            handle_key_event(event);
+            return;
         }
 
-        handle_keyboard_events();
-    }
-
-    bool process_frame() {
-        ::usleep(20000);
-
-        // Draw the previously rendered frame.
-        update_window();
+        if(shm_used && event.type == shm_completion_type) {
+            assert(num_of_pending_shm_puts);
+            --num_of_pending_shm_puts;
+        }
 
-        // Execute instructions for the next frame.
-        machine::run();
+        // Other events are dropped.
+    }
 
-        // Render the next frame.
-        render_screen();
+    // Takes all queued events, so that the queue does not stay
+    // non-empty between frames.
+    void handle_events() {
+        while(::XPending(display)) {
+            ::XEvent event;
+            ::XNextEvent(display, &event);
+            handle_event(event);
+        }
+    }
 
-        // Handle events of the windowing system.
-        handle_events();
+    // Runs the emulation thread and processes windowing
+    // events and presents frames till the user quits.
+    void process_frames() {
+        std::thread emulation_thread(&x11_emulator::run_emulation, this);
+
+        while(!done) {
+            handle_events();
+
+            if(frames->take())
+                update_image(frames->get_front_buffer());
+
+            update_window();
+
+            // Sleep till new events arrive or a new frame is
+            // published.
+            ::pollfd fds[] = {
+                { ConnectionNumber(display), POLLIN, 0 },
+                { frame_event_fd, POLLIN, 0 } };
+            if(!done && !::XPending(display)) {
+                ::poll(fds, 2, /* timeout= */ -1);
+                uint64_t n;
+                if(fds[1].revents & POLLIN)
+                    static_cast<void>(::read(frame_event_fd, &n, sizeof(n)));
+            }
+        }
 
-        return !done;
+        emulation_thread.join();
     }
 
     void load_rom(const char *filename) {
@@ -305,8 +467,86 @@ public:
     }
 
 private:
-    static const auto window_width = machine::frame_width;
-    static const auto window_height = machine::frame_height;
+    typedef std::chrono::steady_clock clock;
+
+    struct key_update {
+        unsigned halfrow;
+        unsigned bit;
+        bool pressed;
+    };
+
+    static const unsigned num_of_halfrows = 8;
+    static const unsigned num_of_halfrow_keys = 5;
+
+    // Applies at most one update per key, so that presses and
+    // releases arriving within a frame are seen by the machine.
+    // The rest are deferred to next frames.
+    void apply_key_updates() {
+        bool updated[num_of_halfrows][num_of_halfrow_keys] = {};
+        next_deferred_key_updates.clear();
+        auto apply = [&](const key_update &update) {
+            bool &key_updated = updated[update.halfrow][update.bit];
+            if(key_updated) {
+                next_deferred_key_updates.push_back(update);
+                return;
+            }
+
+            key_updated = true;
+            machine::set_key_pressed(update.halfrow, update.bit,
+                                     update.pressed);
+        };
+
+        for(const key_update &update : deferred_key_updates)
+            apply(update);
+
+        key_update update;
+        while(key_updates.pop(update))
+            apply(update);
+
+        deferred_key_updates.swap(next_deferred_key_updates);
+    }
+
+    void run_emulation() {
+        clock::time_point frame_deadline = clock::now();
+        while(!done) {
+            apply_key_updates();
+
+            // Execute instructions and render the next frame.
+            machine::run();
+            machine::render_screen();
+            machine::update_frame_pixels(frames->get_back_buffer());
+            machine::clear_dirty_lines();
+            frames->publish();
+
+            // Wake up the display thread.
+            uint64_t n = 1;
+            static_cast<void>(::write(frame_event_fd, &n, sizeof(n)));
+
+            // Wait for the time the next frame is due. The time
+            // taken by emulation and rendering counts towards
+            // the frame period.
+            if(throttled) {
+                const std::chrono::microseconds frame_period(20000);
+
+                // How far behind the schedule emulation may fall
+                // before the schedule is reset.
+                const std::chrono::microseconds max_frame_lag(100000);
+
+                auto now = clock::now();
+                if(now - frame_deadline > max_frame_lag)
+                    frame_deadline = now;  // Do not try to catch up.
+                else
+                    std::this_thread::sleep_until(frame_deadline);
+                frame_deadline += frame_period;
+            }
+        }
+    }
+
+    static const auto frame_width = machine::frame_width;
+    static const auto frame_height = machine::frame_height;
+
+    unsigned get_window_width() const { return frame_width * scale; }
+    unsigned get_window_height() const { return frame_height * scale; }
 
     typedef typename machine::pixel_type window_pixel;
     typedef typename machine::pixels_buffer_type window_pixels_type;
@@ -361,35 +601,169 @@ private:
     static const unsigned spectrum_key_break_space = 0x0f;
 
 public:
-    fast_u8 on_input(fast_u16 addr) {
-        fast_u8 n = 0xbf;  // TODO
-        if(!(addr & 1)) {
-            // Scan keyboard.
-            if(!(addr & (1u << 8))) n &= keyboard_state[0];
-            if(!(addr & (1u << 9))) n &= keyboard_state[1];
-            if(!(addr & (1u << 10))) n &= keyboard_state[2];
-            if(!(addr & (1u << 11))) n &= keyboard_state[3];
-            if(!(addr & (1u << 12))) n &= keyboard_state[4];
-            if(!(addr & (1u << 13))) n &= keyboard_state[5];
-            if(!(addr & (1u << 14))) n &= keyboard_state[6];
-            if(!(addr & (1u << 15))) n &= keyboard_state[7];
-        }
-        return n;
-    }
-
     zx::memory_image_type &on_get_memory() {
         return memory;
     }
 
 private:
+    bool create_shm_image() {
+        if(!::XShmQueryExtension(display))
+            return false;
+
+        image = ::XShmCreateImage(
+            display, DefaultVisual(display, DefaultScreen(display)),
+            /* depth= */ 24, ZPixmap, /* data= */ nullptr, &shm_info,
+            get_window_width(), get_window_height());
+        if(!image)
+            return false;
+
+        auto size = static_cast<std::size_t>(image->bytes_per_line) *
+                    static_cast<std::size_t>(image->height);
+        shm_info.shmid = ::shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+        if(shm_info.shmid < 0) {
+            XDestroyImage(image);
+            image = nullptr;
+            return false;
+        }
+
+        void *addr = ::shmat(shm_info.shmid, nullptr, 0);
+        if(addr == reinterpret_cast<void*>(-1)) {
+            ::shmctl(shm_info.shmid, IPC_RMID, nullptr);
+            XDestroyImage(image);
+            image = nullptr;
+            return false;
+        }
+
+        shm_info.shmaddr = image->data = static_cast<char*>(addr);
+        shm_info.readOnly = False;
+
+        // Attaching fails for remote displays.
+        shm_attach_failed = false;
+        auto old_handler = ::XSetErrorHandler(handle_shm_attach_error);
+        Bool attached = ::XShmAttach(display, &shm_info);
+        ::XSync(display, False);
+        ::XSetErrorHandler(old_handler);
+
+        // The segment is released once detached by both sides.
+        ::shmctl(shm_info.shmid, IPC_RMID, nullptr);
+
+        if(!attached || shm_attach_failed) {
+            ::shmdt(shm_info.shmaddr);
+            image->data = nullptr;
+            XDestroyImage(image);
+            image = nullptr;
+            return false;
+        }
+
+        shm_completion_type = ::XShmGetEventBase(display) + ShmCompletion;
+        return true;
+    }
+
+    void create_image() {
+        unsigned window_width = get_window_width();
+        unsigned window_height = get_window_height();
+        auto *pixels = static_cast<char*>(std::malloc(
+            sizeof(window_pixel) * window_width * window_height));
+        if(!pixels)
+            error("not enough memory");
+
+        image = ::XCreateImage(
+            display, DefaultVisual(display, DefaultScreen(display)),
+            /* depth= */ 24, ZPixmap, /* offset= */ 0, pixels,
+            window_width, window_height,
+            /* line_pad= */ 32, /* bytes_per_line= */ 0);
+        if(!image)
+            error("cannot create image");
+    }
+
+    // The server reads shared pixels asynchronously, so they
+    // cannot be updated till all puts are completed. Other
+    // events arriving meanwhile are handled as usual.
+    void wait_for_shm_puts() {
+        while(num_of_pending_shm_puts) {
+            ::XEvent event;
+            ::XNextEvent(display, &event);
+            handle_event(event);
+        }
+    }
+
+    void put_image_lines(unsigned line, unsigned num_of_lines) {
+        auto y = static_cast<int>(line * scale);
+        unsigned window_width = get_window_width();
+        unsigned height = num_of_lines * scale;
+        if(shm_used) {
+            ::XShmPutImage(display, window, gc, image, 0, y, 0, y,
+                           window_width, height, /* send_event= */ True);
+            ++num_of_pending_shm_puts;
+        } else {
+            ::XPutImage(display, window, gc, image, 0, y, 0, y,
+                        window_width, height);
+        }
+    }
+
     void update_window() {
-        ::XPutImage(display, window, gc, image, 0, 0, 0, 0,
-                    window_width, window_height);
+        if(whole_window_update) {
+            put_image_lines(0, frame_height);
+            whole_window_update = false;
+            std::fill(std::begin(updated_lines), std::end(updated_lines), false);
+            ::XFlush(display);
+            return;
+        }
+
+        // Only send the lines that have been changed.
+        unsigned line = 0;
+        while(line != frame_height) {
+            if(!updated_lines[line]) {
+                ++line;
+                continue;
+            }
+
+            unsigned end = line + 1;
+            while(end != frame_height && updated_lines[end])
+                ++end;
+
+            put_image_lines(line, end - line);
+            std::fill(updated_lines + line, updated_lines + end, false);
+            line = end;
+        }
+
+        ::XFlush(display);
     }
 
-    void render_screen() {
-        machine::render_screen();
-        machine::get_frame_pixels(*window_pixels);
+    // Converts a frame line to the image, magnifying it as
+    // necessary.
+    void convert_line(unsigned line) {
+        const window_pixel *src = (*window_pixels)[line];
+        auto bytes_per_line = static_cast<std::size_t>(image->bytes_per_line);
+        char *dest_line = image->data + line * scale * bytes_per_line;
+        auto *dest = reinterpret_cast<window_pixel*>(dest_line);
+        if(scale == 1) {
+            std::copy(src, src + frame_width, dest);
+            return;
+        }
+
+        for(unsigned x = 0; x != frame_width; ++x)
+            std::fill_n(dest + x * scale, scale, src[x]);
+        for(unsigned i = 1; i != scale; ++i)
+            std::memcpy(dest_line + i * bytes_per_line, dest_line,
+                        sizeof(window_pixel) * frame_width * scale);
+    }
+
+    // Frames may be skipped, so changed lines are identified
+    // by comparing the new frame with the last converted one.
+    void update_image(const window_pixels_type &frame) {
+        wait_for_shm_puts();
+        for(unsigned line = 0; line != frame_height; ++line) {
+            window_pixel *last = (*window_pixels)[line];
+            if(!whole_image_update &&
+                   std::equal(frame[line], frame[line] + frame_width, last))
+                continue;
+
+            std::copy(frame[line], frame[line] + frame_width, last);
+            convert_line(line);
+            updated_lines[line] = true;
+        }
+        whole_image_update = false;
     }
 
     window_pixels_type *window_pixels;
@@ -399,11 +773,32 @@ private:
     ::GC gc;
     ::Atom wm_delete_window_atom;
 
-    bool done;
+    ::XShmSegmentInfo shm_info;
+    int shm_completion_type;
+    bool shm_used;
+    unsigned num_of_pending_shm_puts;
+
+    unsigned scale;
+    bool throttled;
+
+    typedef triple_buffer<window_pixels_type> frames_type;
+    std::unique_ptr<frames_type> frames;
+
+    static const unsigned key_updates_queue_size = 256;
+    spsc_queue<key_update, key_updates_queue_size> key_updates;
+
+    // Only accessed by the emulation thread.
+    std::vector<key_update> deferred_key_updates;
+    std::vector<key_update> next_deferred_key_updates;
+
+    // Signalled on publishing frames.
+    int frame_event_fd;
+
+    std::atomic<bool> done;
+    bool whole_window_update;
+    bool whole_image_update;
+    bool updated_lines[frame_height] = {};
 
-    static const unsigned num_of_keyboard_ports = 8;
-    typedef least_u8 keyboard_state_type[num_of_keyboard_ports];
-    keyboard_state_type keyboard_state;
     zx::memory_image_type memory;
 };
 
@@ -428,9 +823,23 @@ int main(int argc, const char *argv[]) {
         return EXIT_SUCCESS;
     }
 
+    for(int i = 1; i != argc; ++i) {
+        const char *arg = argv[i];
+        if(std::strcmp(arg, "--unthrottled") == 0) {
+            emu.set_throttled(false);
+        } else if(std::strcmp(arg, "--scale") == 0 && i + 1 != argc) {
+            unsigned long scale = std::strtoul(argv[++i], nullptr, 10);
+            if(scale < 1 || scale > 8)
+                error("the scale shall be in range 1-8");
+            emu.set_scale(static_cast<unsigned>(scale));
+        } else {
+            error("unknown option '%s'", arg);
+        }
+    }
+
     emu.create(argc, argv);
 
-    while(emu.process_frame()) {}
+    emu.process_frames();
 
     emu.destroy();
 }
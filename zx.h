@@ -9,6 +9,9 @@
 */
 
 #include <algorithm>
+#include <iterator>
+#include <unordered_map>
+#include <vector>
 
 #include "z80/z80.h"
 
@@ -59,15 +62,26 @@ const events_mask end_of_frame      = 1u << 1;
 const events_mask ticks_limit_hit   = 1u << 2;
 const events_mask fetches_limit_hit = 1u << 3;
 const events_mask breakpoint_hit    = 1u << 4;
+const events_mask watchpoint_hit    = 1u << 8;   // Bits 5-7 are taken by
+                                                 // the Python module.
 const events_mask custom_event      = 1u << 31;
 
 typedef fast_u8 memory_marks;
 const memory_marks no_marks           = 0;
 const memory_marks breakpoint_mark    = 1u << 0;
+const memory_marks read_watch_mark    = 1u << 1;
+const memory_marks write_watch_mark   = 1u << 2;
 const memory_marks visited_instr_mark = 1u << 7;
 
+const memory_marks watch_marks = read_watch_mark | write_watch_mark;
+
 const unsigned memory_image_size = 0x10000;  // 64K bytes.
 
+// Watch marks are summarized per memory page so that accesses
+// to unwatched pages only take a single check.
+const unsigned memory_page_size = 0x100;
+const unsigned num_of_memory_pages = memory_image_size / memory_page_size;
+
 typedef least_u8 memory_image_type[memory_image_size];
 
 class disassembler : public z80::z80_disasm<disassembler> {
@@ -75,7 +89,16 @@ public:
     typedef z80::z80_disasm<disassembler> base;
 
     disassembler(fast_u16 addr, const memory_image_type &memory)
-        : addr(addr), memory(memory)
+        : disassembler(addr, memory, /* bytes_addr= */ 0, memory_image_size)
+    {}
+
+    // Disassembles instructions in a block of bytes that starts
+    // at the specified address. Bytes outside of the block are
+    // read as zeros.
+    disassembler(fast_u16 addr, const least_u8 *bytes, fast_u16 bytes_addr,
+                 unsigned num_of_bytes)
+        : addr(addr), bytes(bytes), bytes_addr(bytes_addr),
+          num_of_bytes(num_of_bytes)
     {}
 
     void on_emit(const char *out) {
@@ -83,7 +106,8 @@ public:
     }
 
     fast_u8 on_read_next_byte() {
-        fast_u8 n = memory[mask16(addr)];
+        fast_u16 offset = mask16(addr - bytes_addr);
+        fast_u8 n = offset < num_of_bytes ? bytes[offset] : 0;
         addr = inc16(addr);
         return n;
     }
@@ -92,6 +116,12 @@ public:
         return dec16(addr);
     }
 
+    // The address of the byte following the last disassembled
+    // instruction.
+    fast_u16 get_addr() const {
+        return addr;
+    }
+
     const char *on_disassemble() {
         // Skip prefixes.
         base::on_disassemble();
@@ -100,18 +130,216 @@ public:
         return output_buff;
     }
 
+    static const std::size_t max_output_buff_size = 32;
+
 private:
     fast_u16 addr;
-    const memory_image_type &memory;
+    const least_u8 *bytes;
+    fast_u16 bytes_addr;
+    unsigned num_of_bytes;
 
-    static const std::size_t max_output_buff_size = 32;
     char output_buff[max_output_buff_size];
 };
 
-template<typename D>
+struct disassembled_instr {
+    // Instructions can be longer than that due to chains of
+    // prefixes; such instructions are not cached.
+    static const unsigned max_cached_size = 8;
+
+    unsigned size;
+    least_u8 bytes[max_cached_size];
+    char text[disassembler::max_output_buff_size];
+};
+
+// Keeps disassembled instructions by their addresses. Every
+// entry remembers the bytes it was decoded from and is decoded
+// again once they change, so writes to memory need not be
+// tracked, including those done bypassing the emulated
+// processor.
+class disassembly_cache {
+public:
+    const disassembled_instr &disassemble(fast_u16 addr,
+                                          const memory_image_type &memory) {
+        if(instrs.empty())
+            instrs.resize(memory_image_size);
+
+        disassembled_instr &instr = instrs[addr];
+        if(instr.size != 0 && matches(instr, addr, memory))
+            return instr;
+
+        disassembler disasm(addr, memory);
+        const char *text = disasm.on_disassemble();
+        auto size = static_cast<unsigned>(mask16(disasm.get_addr() - addr));
+        if(size == 0)
+            size = memory_image_size;  // Wrapped around.
+
+        instr.size = 0;
+        disassembled_instr &res =
+            size <= disassembled_instr::max_cached_size ? instr : uncached_instr;
+        res.size = size;
+        for(unsigned i = 0; i != size && i != res.max_cached_size; ++i)
+            res.bytes[i] = memory[mask16(addr + i)];
+        std::snprintf(res.text, sizeof(res.text), "%s", text);
+        return res;
+    }
+
+private:
+    static bool matches(const disassembled_instr &instr, fast_u16 addr,
+                        const memory_image_type &memory) {
+        for(unsigned i = 0; i != instr.size; ++i) {
+            if(instr.bytes[i] != memory[mask16(addr + i)])
+                return false;
+        }
+        return true;
+    }
+
+    std::vector<disassembled_instr> instrs;
+    disassembled_instr uncached_instr;
+};
+
+typedef fast_u8 trace_record_kind;
+const trace_record_kind instr_trace_record        = 0;
+const trace_record_kind input_trace_record        = 1;
+const trace_record_kind int_accepted_trace_record = 2;
+const trace_record_kind int_ignored_trace_record  = 3;
+
+typedef fast_u8 trace_record_flags;
+const trace_record_flags iff1_trace_flag           = 1u << 0;
+const trace_record_flags int_disabled_trace_flag   = 1u << 1;
+const trace_record_flags new_rom_instr_trace_flag  = 1u << 2;
+
+const unsigned max_instr_size = 4;
+
+// Trace records are supposed to be formatted offline, so we
+// only store raw values here.
+struct trace_record {
+    uint_least32_t tick;
+
+    least_u16 pc;
+    least_u16 af;
+    least_u16 bc;
+    least_u16 de;
+    least_u16 hl;
+    least_u16 ix;
+    least_u16 iy;
+    least_u16 sp;
+    least_u16 wz;
+    least_u16 ir;
+
+    least_u16 port_addr;
+
+    least_u8 kind;
+    least_u8 flags;
+    least_u8 port_value;
+    least_u8 instr_bytes[max_instr_size];
+    least_u8 reserved[3];
+};
+
+// The ring buffer of most recent trace records.
+const unsigned trace_buffer_size = 4096;  // In records.
+
+struct trace_buffer_type {
+    // The total number of records ever written to the buffer.
+    uint_least32_t num_of_records;
+
+    trace_record records[trace_buffer_size];
+};
+
+// Runtime statistics. Ports are identified by the low byte of
+// their address.
+struct stats_type {
+    uint_least64_t num_of_instrs;
+    uint_least64_t num_of_memory_contention_ticks;
+    uint_least64_t num_of_port_contention_ticks;
+    uint_least64_t num_of_render_calls;
+    uint_least64_t num_of_rendered_ticks;
+    uint_least64_t num_of_accepted_ints;
+    uint_least64_t num_of_ignored_ints;
+    uint_least64_t num_of_callbacks;
+    uint_least64_t num_of_inputs[0x100];
+    uint_least64_t num_of_outputs[0x100];
+};
+
+struct call_graph_edge {
+    uint_least64_t num_of_calls;
+
+    // Ticks spent in the callee, including nested calls.
+    uint_least64_t num_of_ticks;
+};
+
+// Execution profile. Instructions are accounted to the address
+// of their first opcode byte, including prefixes. Ticks include
+// contention delays.
+struct profile_type {
+    uint_least64_t instr_counts[memory_image_size] = {};
+    uint_least64_t instr_ticks[memory_image_size] = {};
+
+    // The total number of profiled ticks.
+    uint_least64_t num_of_ticks = 0;
+
+    // Calls are recognized by CALL and RST instructions and
+    // accepted interrupts. Returns are recognized by the stack
+    // pointer raising above the return address, so that
+    // both RET instructions and stack manipulations that discard
+    // the return address are handled.
+    bool call_graph_enabled = false;
+
+    // The key is (caller_addr << 16) | callee_addr.
+    std::unordered_map<uint_least32_t, call_graph_edge> call_graph;
+
+    struct call_frame {
+        fast_u16 sp;
+        uint_least32_t edge_key;
+        uint_least64_t begin_tick;
+    };
+
+    static const std::size_t max_call_depth = 1024;
+    std::vector<call_frame> call_stack;
+};
+
+// The features compiled into spectrum48. Machines that do not
+// need some of them can derive their own feature sets from
+// this one, so that the hot paths only have the code in use.
+struct spectrum48_features {
+    // Contended memory and port accesses take extra ticks.
+    static const bool contention = true;
+
+    // Stopping on hitting the specified numbers of ticks and
+    // instruction fetches.
+    static const bool stop_limits = true;
+
+    // Trace records.
+    static const bool tracing = true;
+
+    // Breakpoints, watchpoints and marking of visited
+    // instructions.
+    static const bool marks = true;
+
+    // Execution profiles.
+    static const bool profiling = true;
+
+    // Runtime statistics. The counters stay zero when disabled.
+    static const bool stats = true;
+
+    // Frames are not rendered and port 0xFE writes only update
+    // the border colour and the beeper when disabled.
+    static const bool rendering = true;
+};
+
+// Suits fast-forwarding and conversions, where nothing needs to
+// be debugged. Marks are kept, as tape flash loading and RZX
+// playback rely on breakpoints.
+struct fast_spectrum48_features : spectrum48_features {
+    static const bool tracing = false;
+    static const bool profiling = false;
+    static const bool stats = false;
+};
+
+template<typename D, typename F = spectrum48_features>
 class spectrum48 : public z80::z80_cpu<D> {
 public:
     typedef z80::z80_cpu<D> base;
+    typedef F features;
     typedef fast_u32 ticks_type;
 
     spectrum48() {
@@ -120,24 +348,28 @@ public:
             cell = static_cast<least_u8>(rnd);
             rnd = (rnd * 0x74392cef) ^ (rnd >> 16);
         }
+
+        // Setting the palette also marks the whole frame as
+        // changed.
+        for(unsigned c = 0; c != num_of_frame_colors; ++c)
+            set_palette_color(c, translate_color(c));
+
+        contention_delays = get_contention_delays();
     }
 
     events_mask get_events() const { return events; }
 
-    void stop() { events |= machine_stopped; }
+    // Signals events and makes run() return as soon as the
+    // current instruction is executed.
+    void raise_events(events_mask new_events) {
+        events |= new_events;
+        run_horizon = 0;
+    }
+
+    void stop() { raise_events(machine_stopped); }
 
     void on_tick(unsigned t) {
         ticks_since_int += t;
-
-        // Handle stopping by hitting a specified number of ticks.
-        if(ticks_to_stop) {
-            if(ticks_to_stop > t) {
-                ticks_to_stop -= t;
-            } else {
-                ticks_to_stop = 0;
-                events |= ticks_limit_hit;
-            }
-        }
     }
 
     ticks_type get_ticks() const { return ticks_since_int; }
@@ -158,32 +390,39 @@ public:
             set_memory_byte(addr, n);
     }
 
-    void handle_contention() {
-        // TODO: We sample ~INT during the last tick of the
-        // previous instruction, so we add 1 to the contention
-        // base to compensate that.
-        const ticks_type cont_base = 14335 + 1;
-        if(ticks_since_int < cont_base)
-            return;
-
-        if(ticks_since_int >= cont_base + screen_height * ticks_per_line)
-            return;
+    // Computes the delay the ULA imposes on contended accesses
+    // at a given tick.
+    static unsigned compute_contention_delay(ticks_type tick) {
+        if(tick < contention_base || tick >= contention_end)
+            return 0;
 
         ticks_type ticks_since_new_line =
-            (ticks_since_int - cont_base) % ticks_per_line;
+            (tick - contention_base) % ticks_per_line;
         const unsigned pixels_per_tick = 2;
         if(ticks_since_new_line >= screen_width / pixels_per_tick)
-            return;
+            return 0;
 
         unsigned ticks_since_new_ula_cycle = ticks_since_new_line % 8;
-        unsigned delay = ticks_since_new_ula_cycle == 7 ?
+        return ticks_since_new_ula_cycle == 7 ?
             0 : 6 - ticks_since_new_ula_cycle;
+    }
+
+    // Returns the number of delay ticks.
+    unsigned handle_contention() {
+        if(!features::contention || ticks_since_int >= contention_end)
+            return 0;
+
+        unsigned delay = contention_delays[ticks_since_int];
         on_tick(delay);
+        return delay;
     }
 
     void handle_memory_contention(fast_u16 addr) {
-        if(addr >= 0x4000 && addr < 0x8000)
-            handle_contention();
+        if(addr >= 0x4000 && addr < 0x8000) {
+            unsigned delay = handle_contention();
+            if(features::stats)
+                stats.num_of_memory_contention_ticks += delay;
+        }
     }
 
     fast_u8 on_fetch_cycle() {
@@ -194,8 +433,12 @@ public:
     fast_u8 on_m1_fetch_cycle() {
         // Handle stopping by hitting a specified number of fetches.
         // TODO: Rename fetches_to_stop -> m1_fetches_to_stop.
-        if(fetches_to_stop && --fetches_to_stop == 0)
-            events |= fetches_limit_hit;
+        // The number of fetches cannot be derived from the
+        // number of ticks, so this is not a subject to the run
+        // horizon.
+        if(features::stop_limits && fetches_to_stop &&
+               --fetches_to_stop == 0)
+            raise_events(fetches_limit_hit);
 
         return base::on_m1_fetch_cycle();
     }
@@ -210,6 +453,9 @@ public:
 
     fast_u8 on_read_cycle(fast_u16 addr) {
         handle_memory_contention(addr);
+        if(features::marks &&
+               (watched_pages[addr / memory_page_size] & read_watch_mark))
+            check_watchpoint(addr, read_watch_mark);
         return base::on_read_cycle(addr);
     }
 
@@ -219,12 +465,38 @@ public:
         // the 2nd tick of the output cycle.
         // TODO: The "+ 1" thing is still wrong as there may
         // be contentions in the middle.
-        render_screen_to_tick(get_ticks() + 1);
+        if(!features::rendering) {
+            // Nothing to render.
+        } else if(rendering == render_mode::full) {
+            render_screen_to_tick(get_ticks() + 1);
+        } else if(rendering == render_mode::lazy &&
+                      addr >= 0x4000 && addr < screen_area_end) {
+            fast_u8 old_value = on_read(addr);
+            if(n != old_value)
+                add_frame_event(addr, old_value, n);
+        }
 
         handle_memory_contention(addr);
+        if(features::marks &&
+               (watched_pages[addr / memory_page_size] & write_watch_mark))
+            check_watchpoint(addr, write_watch_mark);
         base::on_write_cycle(addr, n);
     }
 
+    void check_watchpoint(fast_u16 addr, memory_marks kind) {
+        if(!is_marked_addr(addr, kind))
+            return;
+
+        watchpoint_addr = addr;
+        watchpoint_kind = kind;
+        raise_events(watchpoint_hit);
+    }
+
+    // The address and the watch mark of the last triggered
+    // watchpoint.
+    fast_u16 get_watchpoint_addr() const { return watchpoint_addr; }
+    zx::memory_marks get_watchpoint_kind() const { return watchpoint_kind; }
+
     void handle_contention_tick() {
         handle_memory_contention(addr_bus_value);
         on_tick(1);
@@ -245,6 +517,8 @@ public:
     }
 
     void handle_port_contention(fast_u16 addr) {
+        ticks_type begin_tick = ticks_since_int;
+
         if(addr < 0x4000 || addr >= 0x8000) {
             if((addr & 1) == 0) {
                 on_tick(1);
@@ -270,17 +544,24 @@ public:
                 on_tick(1);
             }
         }
+
+        // Port operations take 4 ticks without contention.
+        if(features::stats)
+            stats.num_of_port_contention_ticks +=
+                ticks_since_int - begin_tick - 4;
     }
 
     fast_u8 on_input_cycle(fast_u16 addr) {
+        if(features::stats)
+            ++stats.num_of_inputs[addr & 0xff];
+
         handle_port_contention(addr);
         fast_u8 n = self().on_input(addr);
 
-        if(FILE *trace = get_trace_file()) {
-            std::fprintf(trace, "read_port %04x %02x\n",
-                         static_cast<unsigned>(addr),
-                         static_cast<unsigned>(n));
-            std::fflush(trace);
+        if(features::tracing && trace_enabled) {
+            trace_record &record = add_trace_record(input_trace_record);
+            record.port_addr = static_cast<least_u16>(addr);
+            record.port_value = static_cast<least_u8>(n);
         }
 
         return n;
@@ -296,7 +577,12 @@ public:
 
     void mark_addr(fast_u16 addr, memory_marks marks) {
         addr = mask16(addr);
+        if((marks & breakpoint_mark) && !is_breakpoint_addr(addr))
+            ++num_of_breakpoints;
         memory_marks[addr] = static_cast<least_u8>(memory_marks[addr] | marks);
+
+        least_u8 &page_marks = watched_pages[addr / memory_page_size];
+        page_marks = static_cast<least_u8>(page_marks | (marks & watch_marks));
     }
 
     void mark_addrs(fast_u16 addr, fast_u16 size, memory_marks marks) {
@@ -304,28 +590,85 @@ public:
             mark_addr(addr + i, marks);
     }
 
+    void unmark_addr(fast_u16 addr, memory_marks marks) {
+        addr = mask16(addr);
+        if((marks & breakpoint_mark) && is_breakpoint_addr(addr))
+            --num_of_breakpoints;
+        memory_marks[addr] = static_cast<least_u8>(memory_marks[addr] & ~marks);
+
+        // Recompute the summary for the page.
+        if(marks & watch_marks) {
+            fast_u16 page_addr = addr & ~(memory_page_size - 1);
+            fast_u8 page_marks = no_marks;
+            for(unsigned i = 0; i != memory_page_size; ++i)
+                page_marks |= memory_marks[page_addr + i] & watch_marks;
+            watched_pages[addr / memory_page_size] =
+                static_cast<least_u8>(page_marks);
+        }
+    }
+
+    void unmark_addrs(fast_u16 addr, fast_u16 size, memory_marks marks) {
+        for(fast_u16 i = 0; i != size; ++i)
+            unmark_addr(addr + i, marks);
+    }
+
     void on_set_pc(fast_u16 pc) {
-        // Catch breakpoints.
-        if(is_breakpoint_addr(pc))
-            events |= breakpoint_hit;
+        // Catch breakpoints. Don't even look at the marks if
+        // there are no breakpoints set.
+        if(features::marks && num_of_breakpoints && is_breakpoint_addr(pc))
+            raise_events(breakpoint_hit);
 
         base::on_set_pc(pc);
     }
 
+    // Updates the keyboard matrix. Half-rows are numbered in
+    // the order of address lines 8-15 that select them.
+    void set_key_pressed(unsigned halfrow, unsigned bit, bool pressed) {
+        assert(halfrow < num_of_keyboard_halfrows && bit < 5);
+        least_u8 &state = keyboard_state[halfrow];
+        fast_u8 mask = 1u << bit;
+        if(pressed)
+            state = static_cast<least_u8>(state & ~mask);
+        else
+            state = static_cast<least_u8>(state | mask);
+    }
+
+    void set_ear_level(bool level) { ear_level = level; }
+
     fast_u8 on_input(fast_u16 addr) {
-        z80::unused(addr);
-        return 0xbf;
+        fast_u8 n = 0xbf;
+        if(!(addr & 1)) {
+            // Scan keyboard. Every low address line 8-15
+            // selects a half-row of keys.
+            for(unsigned i = 0; i != num_of_keyboard_halfrows; ++i) {
+                if(!(addr & (0x100u << i)))
+                    n &= keyboard_state[i];
+            }
+
+            if(ear_level)
+                n |= 0x40;
+        }
+        return n;
     }
 
     void on_output_cycle(fast_u16 addr, fast_u8 n) {
+        if(features::stats)
+            ++stats.num_of_outputs[addr & 0xff];
+
         if((addr & 0xff) == 0xfe) {
             // TODO: Render to (current_tick + 1) and then update
             // the border color as the new value is sampled at
             // the 2nd tick of the output cycle.
             // TODO: The "+ 1" thing is still wrong as there may
             // be contentions in the middle.
-            render_screen_to_tick(get_ticks() + 1);
-            border_color = n & 0x7;
+            if(!features::rendering) {
+                handle_port_fe_write(get_ticks() + 1, n);
+            } else if(rendering == render_mode::full) {
+                render_screen_to_tick(get_ticks() + 1);
+                handle_port_fe_write(get_ticks() + 1, n);
+            } else {
+                add_frame_event(/* addr= */ 0, /* old_value= */ 0, n);
+            }
         }
 
         handle_port_contention(addr);
@@ -363,6 +706,12 @@ public:
 
     static const unsigned memory_image_size = 0x10000;  // 64K bytes.
     typedef least_u8 memory_image_type[memory_image_size];
+    typedef least_u8 memory_marks_type[memory_image_size];
+
+    const memory_marks_type &get_memory_marks() const { return memory_marks; }
+
+    static const unsigned num_of_keyboard_halfrows = 8;
+    typedef least_u8 keyboard_state_type[num_of_keyboard_halfrows];
 
     static const ticks_type ticks_per_frame = 69888;
     static const ticks_type ticks_per_line = 224;
@@ -405,6 +754,19 @@ public:
     static const unsigned frame_height =
         top_border_height + screen_height + bottom_border_height;
 
+    // The end of the memory area the picture is rendered from.
+    // Pixel patterns and colour attributes start at 0x4000.
+    static const unsigned screen_area_end = 0x5b00;
+
+    // The range of ticks where accesses to contended memory and
+    // ports may be delayed.
+    // TODO: We sample ~INT during the last tick of the
+    // previous instruction, so we add 1 to the contention
+    // base to compensate that.
+    static const ticks_type contention_base = 14335 + 1;
+    static const ticks_type contention_end =
+        contention_base + screen_height * ticks_per_line;
+
     // We want screen, border and frame widths be multiples of chunk widths to
     // simplify the processing code and to benefit from aligned memory accesses.
     static const unsigned chunks_per_border_width =
@@ -418,9 +780,38 @@ public:
 
     const screen_chunks_type &get_screen_chunks() { return screen_chunks; }
 
+    void set_screen_chunks(const screen_chunks_type &chunks) {
+        std::copy(&chunks[0][0], &chunks[0][0] + frame_height *
+                      chunks_per_frame_line, &screen_chunks[0][0]);
+        mark_dirty_lines();
+    }
+
+    // Non-zero elements correspond to frame lines that have
+    // been changed since the dirty lines were cleared last time.
+    typedef least_u8 dirty_lines_type[frame_height];
+
+    const dirty_lines_type &get_dirty_lines() const { return dirty_lines; }
+
+    void mark_dirty_lines() {
+        std::fill(std::begin(dirty_lines), std::end(dirty_lines), 1);
+    }
+
+    void clear_dirty_lines() {
+        std::fill(std::begin(dirty_lines), std::end(dirty_lines), 0);
+    }
+
     // TODO: Name the constants.
     // TODO: private
     void start_new_frame() {
+        // Complete the audio frame.
+        update_audio_to_tick(ticks_per_frame);
+        std::copy(std::begin(frame_audio_samples),
+                  std::end(frame_audio_samples), std::begin(audio_samples));
+        buffer_audio_samples();
+        audio_tick = 0;
+        audio_sample_index = 0;
+        audio_accumulator = 0;
+
         ticks_since_int %= ticks_per_frame;
         render_tick = 0;
 
@@ -477,125 +868,184 @@ public:
         return addr;
     }
 
+    // TODO: private
+    // Converts a byte of pixel pattern into a frame chunk of
+    // eight pixels, where set bits are drawn with the ink colour
+    // and clear bits are drawn with the paper colour.
+    static frame_chunk make_pattern_chunk(fast_u8 pattern, unsigned ink_color,
+                                          unsigned paper_color) {
+        static_assert(bits_per_frame_pixel == 4,
+                      "Unsupported frame pixel format!");
+        static_assert(pixels_per_frame_chunk == 8,
+                      "Unsupported frame chunk format!");
+
+        // Spread the eight bits of the pattern to the lowest
+        // bits of the chunk nibbles, so that the most
+        // significant bit goes to the most significant nibble.
+        uint_fast32_t bits = pattern;
+        bits = (bits | (bits << 12)) & 0x000f000f;
+        bits = (bits | (bits << 6)) & 0x03030303;
+        bits = (bits | (bits << 3)) & 0x11111111;
+        uint_fast32_t ink_mask = bits * 0xf;
+
+        uint_fast32_t ink = 0x11111111 * ink_color;
+        uint_fast32_t paper = 0x11111111 * paper_color;
+        return static_cast<frame_chunk>(
+            (ink & ink_mask) | (paper & ~ink_mask & 0xffffffff));
+    }
+
     // TODO: Name the constants.
-    // TODO: Optimize.
     void render_screen_to_tick(ticks_type end_tick) {
         static_assert(bits_per_frame_pixel == 4,
                       "Unsupported frame pixel format!");
         static_assert(pixels_per_frame_chunk == 8,
                       "Unsupported frame chunk format!");
 
-        // TODO: Render the border by whole chunks when possible.
+        if(!features::rendering)
+            return;
+
+        const unsigned pixels_per_tick = 2;
+        const unsigned ticks_per_chunk =
+            pixels_per_frame_chunk / pixels_per_tick;
+        const unsigned top_hidden_lines = 64 - top_border_height;
+        const unsigned first_screen_line = 64;
+        const unsigned end_visible_line =
+            first_screen_line + screen_height + bottom_border_height;
+        const unsigned visible_ticks_per_line = frame_width / pixels_per_tick;
+
+        // Chunks within frame lines that are covered by the
+        // screen area. Screen bytes are latched at the
+        // beginning of every odd chunk from the one that
+        // precedes the screen area to the last but one screen
+        // chunk, and then get used by the next two chunks.
+        const unsigned first_screen_chunk = chunks_per_border_width;
+        const unsigned end_screen_chunk =
+            first_screen_chunk + chunks_per_screen_line;
+        const unsigned first_latching_chunk = first_screen_chunk - 1;
+        const unsigned last_latching_chunk = end_screen_chunk - 2;
+
+        if(features::stats) {
+            ++stats.num_of_render_calls;
+            if(end_tick > render_tick)
+                stats.num_of_rendered_ticks += end_tick - render_tick;
+        }
+
         while(render_tick < end_tick) {
             // The tick since the beam was at the imaginary
             // beginning (the top left corner) of the frame.
             ticks_type frame_tick = render_tick + border_width / 2 - 8 / 2;  // TODO
-
-            // Latch screen area bytes. Note that the first time
-            // we do that when the beam is outside of the screen
-            // area.
             auto frame_line = static_cast<unsigned>(frame_tick / ticks_per_line);
-            auto pixel_in_line = static_cast<unsigned>(frame_tick % ticks_per_line) * 2;
-            bool is_screen_latching_area =
-                frame_line >= 64 &&
-                frame_line < 64 + screen_height &&
-                pixel_in_line >= border_width - 8 &&
-                pixel_in_line < border_width + screen_width - 8;
-            if(is_screen_latching_area && render_tick % 8 == 0) {
-                fast_u16 pattern_addr = get_pixel_pattern_addr(
-                    frame_line, pixel_in_line + 8);
-                // TODO
-                // printf("%d -> 0x%04x\n", (int) render_tick, (unsigned) addr);
-                latched_pixel_pattern = make16(on_read(pattern_addr),
-                                               on_read(pattern_addr + 1));
-
-                fast_u16 attr_addr = get_colour_attrs_addr(
-                    frame_line, pixel_in_line + 8);
-                latched_colour_attrs = make16(on_read(attr_addr),
-                                              on_read(attr_addr + 1));
+            auto line_tick = static_cast<unsigned>(frame_tick % ticks_per_line);
+
+            // Skip invisible areas.
+            if(frame_line < top_hidden_lines) {
+                ticks_type visible_tick =
+                    render_tick + (top_hidden_lines - frame_line) * ticks_per_line -
+                    line_tick;
+                render_tick = std::min(visible_tick, end_tick);
+                continue;
+            }
+            if(frame_line >= end_visible_line) {
+                render_tick = end_tick;
+                continue;
+            }
+            if(line_tick >= visible_ticks_per_line) {
+                ticks_type next_line_tick =
+                    render_tick + (ticks_per_line - line_tick);
+                render_tick = std::min(next_line_tick, end_tick);
+                continue;
             }
 
-            // Render the screen area.
-            const unsigned top_hidden_lines = 64 - top_border_height;
-            bool is_screen_area = frame_line >= 64 &&
-                                  frame_line < 64 + screen_height &&
-                                  pixel_in_line >= border_width &&
-                                  pixel_in_line < border_width + screen_width;
-            if(is_screen_area) {
-                // TODO: Support rendering by whole chunks for
-                //       better performance.
-
-                unsigned chunk_index = pixel_in_line / pixels_per_frame_chunk;
-                unsigned pixel_in_chunk = pixel_in_line % pixels_per_frame_chunk;
-
-                unsigned screen_line = frame_line - top_hidden_lines;
-                frame_chunk *line_chunks = screen_chunks[screen_line];
-                frame_chunk *chunk = &line_chunks[chunk_index];
-
-                unsigned pixel_in_cycle = (pixel_in_line - border_width) % 16;
-                if(pixel_in_cycle == 0) {
-                    latched_pixel_pattern2 = latched_pixel_pattern;
-                    latched_colour_attrs2 = latched_colour_attrs;
+            // Render the visible part of the line by whole
+            // chunks, where possible.
+            bool is_screen_line = frame_line >= first_screen_line &&
+                                  frame_line < first_screen_line + screen_height;
+            unsigned screen_line = frame_line - top_hidden_lines;
+            frame_chunk *line_chunks = screen_chunks[screen_line];
+            least_u8 &is_dirty_line = dirty_lines[screen_line];
+            ticks_type line_end_tick = std::min(
+                render_tick + (visible_ticks_per_line - line_tick), end_tick);
+            while(render_tick < line_end_tick) {
+                unsigned chunk_index = line_tick / ticks_per_chunk;
+                unsigned tick_in_chunk = line_tick % ticks_per_chunk;
+                auto num_of_ticks = static_cast<unsigned>(std::min<ticks_type>(
+                    ticks_per_chunk - tick_in_chunk, line_end_tick - render_tick));
+                bool is_screen_chunk = is_screen_line &&
+                                       chunk_index >= first_screen_chunk &&
+                                       chunk_index < end_screen_chunk;
+
+                // Latches happen at the beginnings of chunks.
+                if(tick_in_chunk == 0) {
+                    unsigned pixel_in_line = line_tick * pixels_per_tick;
+                    if(is_screen_line &&
+                           chunk_index >= first_latching_chunk &&
+                           chunk_index <= last_latching_chunk &&
+                           (chunk_index - first_latching_chunk) % 2 == 0) {
+                        fast_u16 pattern_addr = get_pixel_pattern_addr(
+                            frame_line, pixel_in_line + 8);
+                        latched_pixel_pattern = make16(on_read(pattern_addr),
+                                                       on_read(pattern_addr + 1));
+
+                        fast_u16 attr_addr = get_colour_attrs_addr(
+                            frame_line, pixel_in_line + 8);
+                        latched_colour_attrs = make16(on_read(attr_addr),
+                                                      on_read(attr_addr + 1));
+                    }
+
+                    if(!is_screen_chunk) {
+                        latched_border_color = border_color;
+                    } else if((chunk_index - first_screen_chunk) % 2 == 0) {
+                        latched_pixel_pattern2 = latched_pixel_pattern;
+                        latched_colour_attrs2 = latched_colour_attrs;
+                    }
                 }
 
-                auto attr = static_cast<unsigned>(latched_colour_attrs2 >> ((15 - pixel_in_cycle) / 8 * 8));
-                unsigned brightness = attr >> (6 - brightness_bit) & brightness_mask;
-                unsigned ink_color = ((attr >> 0) & 0x7) | brightness;
-                unsigned paper_color = ((attr >> 3) & 0x7) | brightness;
-
-                // TODO: We can compute the whole chunk as soon
-                //       as we read the bytes. And then just
-                //       apply them here.
-                unsigned pixels_value = 0;
-                fast_u16 pattern = latched_pixel_pattern2;
-                if((attr & 0x80) != 0)
-                    pattern ^= flash_mask;
-                pixels_value |= (pattern & ((1u << 15) >> pixel_in_cycle)) != 0 ?
-                    (ink_color << 28) : (paper_color << 28);
-                pixels_value |= (pattern & ((1u << 14) >> pixel_in_cycle)) != 0 ?
-                    (ink_color << 24) : (paper_color << 24);
-                pixels_value >>= pixel_in_chunk * 4;
-
-                // printf("%d, pixel_in_cycle %d\n", (int) render_tick, (int) pixel_in_cycle);
-
-                unsigned pixels_mask = 0xff000000 >> (pixel_in_chunk * 4);
+                frame_chunk chunk_value;
+                if(is_screen_chunk) {
+                    // The even chunk of the pair takes the first
+                    // byte of the latched pattern and attributes
+                    // and the odd one takes the second byte.
+                    unsigned shift =
+                        (chunk_index - first_screen_chunk) % 2 == 0 ? 8 : 0;
+                    auto attr = static_cast<unsigned>(
+                        (latched_colour_attrs2 >> shift) & 0xff);
+                    auto pattern = static_cast<fast_u8>(
+                        (latched_pixel_pattern2 >> shift) & 0xff);
+                    if((attr & 0x80) != 0)
+                        pattern ^= static_cast<fast_u8>((flash_mask >> shift) & 0xff);
+
+                    unsigned brightness = attr >> (6 - brightness_bit) & brightness_mask;
+                    unsigned ink_color = ((attr >> 0) & 0x7) | brightness;
+                    unsigned paper_color = ((attr >> 3) & 0x7) | brightness;
+                    chunk_value = make_pattern_chunk(pattern, ink_color, paper_color);
+                } else {
+                    chunk_value = static_cast<frame_chunk>(
+                        0x11111111 * latched_border_color);
+                }
 
-                *chunk = (*chunk & ~pixels_mask) | pixels_value;
+                frame_chunk &chunk = line_chunks[chunk_index];
+                if(num_of_ticks != ticks_per_chunk) {
+                    // Only update pixels of the rendered ticks.
+                    const unsigned bits_per_tick =
+                        pixels_per_tick * bits_per_frame_pixel;
+                    uint_fast32_t mask = UINT32_C(0xffffffff) >>
+                        (tick_in_chunk * bits_per_tick);
+                    unsigned end_tick_in_chunk = tick_in_chunk + num_of_ticks;
+                    if(end_tick_in_chunk < ticks_per_chunk)
+                        mask &= ~(UINT32_C(0xffffffff) >>
+                                      (end_tick_in_chunk * bits_per_tick));
+                    chunk_value = static_cast<frame_chunk>(
+                        (chunk & ~mask) | (chunk_value & mask));
+                }
 
-                ++render_tick;
-                continue;
-            }
+                if(chunk != chunk_value) {
+                    chunk = chunk_value;
+                    is_dirty_line = 1;
+                }
 
-            // Render the border area.
-            // TODO: We can simply initialize the render tick
-            //       with the first visible tick value and stop
-            //       the rendering loop at the last visible tick.
-            //       Just don't forget about latching.
-            bool is_visible_area =
-                frame_line >= top_hidden_lines &&
-                frame_line < 64 + screen_height + bottom_border_height &&
-                pixel_in_line < frame_width;
-            if(is_visible_area) {
-                if(render_tick % 4 == 0)
-                    latched_border_color = border_color;
-
-                unsigned chunk_index = pixel_in_line / pixels_per_frame_chunk;
-                unsigned pixel_in_chunk = pixel_in_line % pixels_per_frame_chunk;
-
-                // TODO: Support rendering by whole chunks for
-                //       better performance.
-                unsigned screen_line = frame_line - top_hidden_lines;
-                frame_chunk *line_chunks = screen_chunks[screen_line];
-                frame_chunk *chunk = &line_chunks[chunk_index];
-                unsigned pixels_value = (0x11000000 * latched_border_color) >> (pixel_in_chunk * 4);
-                unsigned pixels_mask = 0xff000000 >> (pixel_in_chunk * 4);
-                *chunk = (*chunk & ~pixels_mask) | pixels_value;
-
-                ++render_tick;
-                continue;
+                render_tick += num_of_ticks;
+                line_tick += num_of_ticks;
             }
-
-            ++render_tick;
         }
     }
 
@@ -609,34 +1059,222 @@ public:
     fast_u16 latched_colour_attrs2 = 0;
     fast_u16 flash_mask = 0;
 
+    // The part of the rendering state that cannot be derived from
+    // memory and the machine state.
+    struct render_state {
+        unsigned frame_counter;
+        ticks_type render_tick;
+        unsigned latched_border_color;
+        fast_u16 latched_pixel_pattern;
+        fast_u16 latched_colour_attrs;
+        fast_u16 latched_pixel_pattern2;
+        fast_u16 latched_colour_attrs2;
+        fast_u16 flash_mask;
+    };
+
+    render_state get_render_state() const {
+        render_state state;
+        state.frame_counter = frame_counter;
+        state.render_tick = render_tick;
+        state.latched_border_color = latched_border_color;
+        state.latched_pixel_pattern = latched_pixel_pattern;
+        state.latched_colour_attrs = latched_colour_attrs;
+        state.latched_pixel_pattern2 = latched_pixel_pattern2;
+        state.latched_colour_attrs2 = latched_colour_attrs2;
+        state.flash_mask = flash_mask;
+        return state;
+    }
+
+    void set_render_state(const render_state &state) {
+        frame_counter = state.frame_counter;
+        render_tick = state.render_tick;
+        latched_border_color = state.latched_border_color;
+        latched_pixel_pattern = state.latched_pixel_pattern;
+        latched_colour_attrs = state.latched_colour_attrs;
+        latched_pixel_pattern2 = state.latched_pixel_pattern2;
+        latched_colour_attrs2 = state.latched_colour_attrs2;
+        flash_mask = state.flash_mask;
+    }
+
     void render_screen() {
+        flush_frame_events();
         render_screen_to_tick(ticks_per_frame);
     }
 
+    // Writes to port 0xFE and screen memory are recorded in
+    // the log of frame events, unless rendering is in the full
+    // mode. The log is then processed in one pass, rendering
+    // up to the tick of every event and applying it. This
+    // happens before run() returns, on rendering a frame and
+    // when the log is full.
+    void flush_frame_events() {
+        if(!num_of_frame_events)
+            return;
+
+        // Roll the screen memory back to the state preceding
+        // the logged writes.
+        for(unsigned i = num_of_frame_events; i--;) {
+            const frame_event &e = frame_events[i];
+            if(e.addr)
+                set_memory_byte(e.addr, e.old_value);
+        }
+
+        bool render = rendering != render_mode::off;
+        for(unsigned i = 0; i != num_of_frame_events; ++i) {
+            const frame_event &e = frame_events[i];
+            if(e.addr) {
+                if(render)
+                    render_screen_to_tick(e.tick);
+                set_memory_byte(e.addr, e.value);
+                continue;
+            }
+
+            if(render && (e.value & 0x7) != border_color)
+                render_screen_to_tick(e.tick);
+            handle_port_fe_write(e.tick, e.value);
+        }
+
+        num_of_frame_events = 0;
+    }
+
+    // The picture only depends on the screen memory and the
+    // border colour, so the lazy mode catches up rendering
+    // only before they change and gives the same frames as the
+    // full mode. With rendering off, frames are only rendered
+    // on explicit requests and then do not reflect changes
+    // made in the middle of the frame.
+    enum class render_mode { off, lazy, full };
+
+    render_mode get_render_mode() const { return rendering; }
+
+    void set_render_mode(render_mode mode) {
+        flush_frame_events();
+        rendering = mode;
+    }
+
+    // Beeper samples of the last completed frame. The EAR and
+    // MIC output levels are integrated over sample periods,
+    // which acts as a box filter that band-limits the signal
+    // before decimation. 882 samples per frame give about
+    // 44.1 kHz at 50 frames per second.
+    static const unsigned audio_samples_per_frame = 882;
+    typedef int_least16_t audio_sample_type;
+    typedef audio_sample_type audio_samples_type[audio_samples_per_frame];
+
+    const audio_samples_type &get_audio_samples() const {
+        return audio_samples;
+    }
+
+    // Samples of completed frames are also collected in a ring
+    // buffer till taken, so that the beeper output of several
+    // frames run in one go can be streamed. A frame is
+    // completed once the next one starts. On overflow the
+    // oldest samples are lost.
+    static const unsigned audio_buffer_size = audio_samples_per_frame * 64;
+
+    std::size_t get_num_of_buffered_audio_samples() const {
+        return num_of_buffered_audio_samples;
+    }
+
+    // Moves the buffered samples to the specified array, oldest
+    // first, and empties the buffer.
+    void take_audio_samples(audio_sample_type *samples) {
+        std::size_t begin = (audio_buffer_end + audio_buffer_size -
+                             num_of_buffered_audio_samples) %
+                            audio_buffer_size;
+        for(std::size_t i = 0; i != num_of_buffered_audio_samples; ++i)
+            samples[i] = audio_buffer[(begin + i) % audio_buffer_size];
+        num_of_buffered_audio_samples = 0;
+    }
+
     typedef uint_least32_t pixel_type;
     typedef pixel_type pixels_buffer_type[frame_height][frame_width];
     static const std::size_t pixels_buffer_size = sizeof(pixels_buffer_type);
 
-    void get_frame_pixels(pixels_buffer_type &buffer) {
+    // The number of distinct brightness:grb values.
+    static const unsigned num_of_frame_colors = 1u << bits_per_frame_pixel;
+
+    pixel_type get_palette_color(unsigned c) const {
+        assert(c < num_of_frame_colors);
+        return palette[c];
+    }
+
+    // Sets the pixel value frame pixels of the specified
+    // brightness:grb colour are converted to.
+    void set_palette_color(unsigned c, pixel_type pixel) {
+        assert(c < num_of_frame_colors);
+        palette[c] = pixel;
+        mark_dirty_lines();
+
+        // Update the pairs of pixels that involve the colour.
+        for(unsigned i = 0; i != num_of_frame_colors; ++i) {
+            pixel_pairs[(c << bits_per_frame_pixel) | i][0] = pixel;
+            pixel_pairs[(i << bits_per_frame_pixel) | c][1] = pixel;
+        }
+    }
+
+    void get_frame_line_pixels(unsigned line, pixel_type *pixels) {
         static_assert(is_multiple_of(frame_width, pixels_per_frame_chunk),
                       "Fractional number of chunks per line is not supported!");
         static_assert(bits_per_frame_pixel == 4,
                       "Unsupported frame pixel format!");
         static_assert(pixels_per_frame_chunk == 8,
                       "Unsupported frame chunk format!");
-        pixel_type *pixels = *buffer;
+        assert(line < frame_height);
         std::size_t p = 0;
-        for(const auto &screen_line : screen_chunks) {
-            for(auto chunk : screen_line) {
-                pixels[p++] = translate_color((chunk >> 28) & 0xf);
-                pixels[p++] = translate_color((chunk >> 24) & 0xf);
-                pixels[p++] = translate_color((chunk >> 20) & 0xf);
-                pixels[p++] = translate_color((chunk >> 16) & 0xf);
-                pixels[p++] = translate_color((chunk >> 12) & 0xf);
-                pixels[p++] = translate_color((chunk >>  8) & 0xf);
-                pixels[p++] = translate_color((chunk >>  4) & 0xf);
-                pixels[p++] = translate_color((chunk >>  0) & 0xf);
-            }
+        for(auto chunk : screen_chunks[line]) {
+            // Convert the chunk by pairs of pixels.
+            const pixel_type *pair = pixel_pairs[(chunk >> 24) & 0xff];
+            pixels[p++] = pair[0];
+            pixels[p++] = pair[1];
+            pair = pixel_pairs[(chunk >> 16) & 0xff];
+            pixels[p++] = pair[0];
+            pixels[p++] = pair[1];
+            pair = pixel_pairs[(chunk >> 8) & 0xff];
+            pixels[p++] = pair[0];
+            pixels[p++] = pair[1];
+            pair = pixel_pairs[(chunk >> 0) & 0xff];
+            pixels[p++] = pair[0];
+            pixels[p++] = pair[1];
+        }
+    }
+
+    void get_frame_pixels(pixels_buffer_type &buffer) {
+        for(unsigned line = 0; line != frame_height; ++line)
+            get_frame_line_pixels(line, buffer[line]);
+    }
+
+    // Only converts the dirty lines, so the buffer is supposed to
+    // retain the pixels of lines that have not been changed.
+    // Leaves the dirty lines marked.
+    void update_frame_pixels(pixels_buffer_type &buffer) {
+        for(unsigned line = 0; line != frame_height; ++line) {
+            if(dirty_lines[line])
+                get_frame_line_pixels(line, buffer[line]);
+        }
+    }
+
+    // Returns the tick up to which instructions can be executed
+    // without checking for anything, unless an event is raised.
+    ticks_type get_run_horizon() const {
+        ticks_type horizon = ticks_per_frame;
+        if(features::stop_limits && ticks_to_stop)
+            horizon = std::min(horizon, ticks_since_int + ticks_to_stop);
+        return horizon;
+    }
+
+    // Handles stopping by hitting a specified number of ticks.
+    void advance_ticks_to_stop(ticks_type begin_tick) {
+        if(!features::stop_limits || !ticks_to_stop)
+            return;
+
+        ticks_type ticks = ticks_since_int > begin_tick ?
+            ticks_since_int - begin_tick : 0;
+        if(ticks_to_stop > ticks) {
+            ticks_to_stop -= ticks;
+        } else {
+            ticks_to_stop = 0;
+            raise_events(ticks_limit_hit);
         }
     }
 
@@ -650,102 +1288,221 @@ public:
 
         // Execute instructions that fit the current frame.
         while(!events && ticks_since_int < ticks_per_frame) {
-            if(!int_suppressed) {
-                // ~INT is sampled during the last tick of the
-                // previous instruction, so we have to see
-                // whether ~INT was active during that last tick
-                // and not the current tick.
-                ticks_type previous_tick = ticks_since_int - 1;
-                if(previous_tick < ticks_per_active_int)
-                    on_handle_active_int();
+            ticks_type begin_tick = ticks_since_int;
+
+            // Instructions that start within the active ~INT
+            // period are executed one by one.
+            if(ticks_since_int <= ticks_per_active_int) {
+                if(!int_suppressed) {
+                    // ~INT is sampled during the last tick of the
+                    // previous instruction, so we have to see
+                    // whether ~INT was active during that last tick
+                    // and not the current tick.
+                    ticks_type previous_tick = ticks_since_int - 1;
+                    if(previous_tick < ticks_per_active_int)
+                        on_handle_active_int();
+                }
+
+                self().on_step();
+                advance_ticks_to_stop(begin_tick);
+                continue;
             }
 
-            on_step();
+            // Then execute instructions till the horizon. Raising
+            // an event resets the horizon, so this is the only
+            // check we need to do.
+            run_horizon = get_run_horizon();
+            while(ticks_since_int < run_horizon)
+                self().on_step();
+
+            advance_ticks_to_stop(begin_tick);
         }
 
         // Signal end-of-frame, if it's the case.
         if(ticks_since_int >= ticks_per_frame)
             events |= end_of_frame;
 
+        // Leave the machine in a consistent state.
+        flush_frame_events();
+
         return events;
     }
 
-    FILE *get_trace_file() {
-        if(!trace_enabled)
-            return nullptr;
+    trace_buffer_type &get_trace_buffer() { return trace_buffer; }
+
+    stats_type &get_stats() { return stats; }
+
+    // The profile is owned by the caller. Null disables profiling.
+    profile_type *get_profile() const { return profile; }
+    void set_profile(profile_type *new_profile) { profile = new_profile; }
 
-        static FILE *trace = nullptr;
-        if(!trace)
-            trace = std::fopen("zx_trace", "w");
+    trace_record &add_trace_record(trace_record_kind kind) {
+        trace_record &record =
+            trace_buffer.records[trace_buffer.num_of_records % trace_buffer_size];
+        ++trace_buffer.num_of_records;
 
-        return trace;
+        record.kind = static_cast<least_u8>(kind);
+        record.tick = static_cast<uint_least32_t>(ticks_since_int);
+        record.pc = static_cast<least_u16>(self().get_pc());
+
+        trace_record_flags flags = 0;
+        if(self().get_iff1())
+            flags |= iff1_trace_flag;
+        if(self().is_int_disabled())
+            flags |= int_disabled_trace_flag;
+        record.flags = static_cast<least_u8>(flags);
+
+        return record;
     }
 
     void trace_state() {
-        FILE *trace = get_trace_file();
-        if(!trace)
+        if(!features::tracing || !trace_enabled)
             return;
 
         if(self().get_iregp_kind() != z80::iregp::hl)
             return;
 
+        trace_record &record = add_trace_record(instr_trace_record);
+
         fast_u16 pc = self().get_pc();
-        bool new_rom_instr =
-            pc < 0x4000 && !is_marked_addr(pc, visited_instr_mark);
-
-        disassembler disasm(pc, self().on_get_memory());
-        std::fprintf(trace,
-            "%7u "
-            "PC:%04x AF:%04x BC:%04x DE:%04x HL:%04x IX:%04x IY:%04x "
-            "SP:%04x WZ:%04x IR:%04x iff1:%u "
-            "%02x%02x%02x%02x%02x%02x%02x%02x %s%s\n",
-            static_cast<unsigned>(ticks_since_int),
-            static_cast<unsigned>(pc),
-            static_cast<unsigned>(self().get_af()),
-            static_cast<unsigned>(self().get_bc()),
-            static_cast<unsigned>(self().get_de()),
-            static_cast<unsigned>(self().get_hl()),
-            static_cast<unsigned>(self().get_ix()),
-            static_cast<unsigned>(self().get_iy()),
-            static_cast<unsigned>(self().get_sp()),
-            static_cast<unsigned>(self().get_wz()),
-            static_cast<unsigned>(self().get_ir()),
-            static_cast<unsigned>(self().get_iff1()),
-            static_cast<unsigned>(on_read((pc + 0) & 0xffff)),
-            static_cast<unsigned>(on_read((pc + 1) & 0xffff)),
-            static_cast<unsigned>(on_read((pc + 2) & 0xffff)),
-            static_cast<unsigned>(on_read((pc + 3) & 0xffff)),
-            static_cast<unsigned>(on_read((pc + 4) & 0xffff)),
-            static_cast<unsigned>(on_read((pc + 5) & 0xffff)),
-            static_cast<unsigned>(on_read((pc + 6) & 0xffff)),
-            static_cast<unsigned>(on_read((pc + 7) & 0xffff)),
-            disasm.on_disassemble(), new_rom_instr ? " [new]" : "");
-        std::fflush(trace);
+        if(pc < 0x4000 && !is_marked_addr(pc, visited_instr_mark))
+            record.flags = static_cast<least_u8>(
+                record.flags | new_rom_instr_trace_flag);
+
+        record.af = static_cast<least_u16>(self().get_af());
+        record.bc = static_cast<least_u16>(self().get_bc());
+        record.de = static_cast<least_u16>(self().get_de());
+        record.hl = static_cast<least_u16>(self().get_hl());
+        record.ix = static_cast<least_u16>(self().get_ix());
+        record.iy = static_cast<least_u16>(self().get_iy());
+        record.sp = static_cast<least_u16>(self().get_sp());
+        record.wz = static_cast<least_u16>(self().get_wz());
+        record.ir = static_cast<least_u16>(self().get_ir());
+
+        for(unsigned i = 0; i != max_instr_size; ++i)
+            record.instr_bytes[i] = static_cast<least_u8>(on_read(mask16(pc + i)));
     }
 
     void on_step() {
+        if(features::stats && self().get_iregp_kind() == z80::iregp::hl)
+            ++stats.num_of_instrs;
+
         trace_state();
-        mark_addr(self().get_pc(), visited_instr_mark);
+
+        // Tracing relies on the marks to tell new instructions.
+        if((features::marks && visited_instrs_marking) ||
+               (features::tracing && trace_enabled))
+            mark_addr(self().get_pc(), visited_instr_mark);
+
+        if(features::profiling && profile) {
+            profile_step();
+            return;
+        }
+
         base::on_step();
     }
 
     bool on_handle_active_int() {
-        bool int_initiated = base::on_handle_active_int();
-        if(FILE *trace = get_trace_file()) {
-            if(int_initiated) {
-                std::fprintf(trace, "INT accepted\n");
-            } else {
-                std::fprintf(trace, "INT ignored (int_disabled=%u, iff1=%u)\n",
-                             self().is_int_disabled(), self().get_iff1());
-            }
-            std::fflush(trace);
-        }
+        if(!features::profiling || !profile)
+            return handle_active_int();
+
+        fast_u16 pc = self().get_pc();
+        fast_u16 sp = self().get_sp();
+        ticks_type begin_tick = ticks_since_int;
+        bool int_initiated = handle_active_int();
+        profile->num_of_ticks += ticks_since_int - begin_tick;
+        if(profile->call_graph_enabled)
+            update_call_graph(pc, sp, int_initiated);
         return int_initiated;
     }
 
 protected:
     using base::self;
 
+    bool handle_active_int() {
+        // Record the state the decision is made upon.
+        trace_record *record = nullptr;
+        if(features::tracing && trace_enabled)
+            record = &add_trace_record(int_ignored_trace_record);
+
+        bool int_initiated = base::on_handle_active_int();
+        if(record && int_initiated)
+            record->kind = int_accepted_trace_record;
+
+        if(features::stats) {
+            if(int_initiated)
+                ++stats.num_of_accepted_ints;
+            else
+                ++stats.num_of_ignored_ints;
+        }
+
+        return int_initiated;
+    }
+
+    static bool is_call_opcode(fast_u8 op) {
+        // CALL nn, CALL cc, nn and RST n.
+        return op == 0xcd || (op & 0xc7) == 0xc4 || (op & 0xc7) == 0xc7;
+    }
+
+    void profile_step() {
+        fast_u16 pc = self().get_pc();
+        fast_u16 sp = self().get_sp();
+
+        // Steps that follow prefixes continue the same instruction.
+        if(self().get_iregp_kind() == z80::iregp::hl) {
+            profiled_instr_addr = pc;
+            ++profile->instr_counts[pc];
+        }
+
+        ticks_type begin_tick = ticks_since_int;
+        base::on_step();
+        ticks_type ticks = ticks_since_int - begin_tick;
+        profile->instr_ticks[profiled_instr_addr] += ticks;
+        profile->num_of_ticks += ticks;
+
+        if(profile->call_graph_enabled)
+            update_call_graph(pc, sp, is_call_opcode(on_read(pc)));
+    }
+
+    void update_call_graph(fast_u16 caller, fast_u16 caller_sp,
+                           bool is_call) {
+        auto &stack = profile->call_stack;
+        fast_u16 sp = self().get_sp();
+        while(!stack.empty() && sp > stack.back().sp) {
+            const profile_type::call_frame &frame = stack.back();
+            profile->call_graph[frame.edge_key].num_of_ticks +=
+                profile->num_of_ticks - frame.begin_tick;
+            stack.pop_back();
+        }
+
+        // Only taken calls push the return address.
+        if(!is_call || sp != mask16(caller_sp - 2))
+            return;
+
+        uint_least32_t key = static_cast<uint_least32_t>(
+            (caller << 16) | self().get_pc());
+        ++profile->call_graph[key].num_of_calls;
+        if(stack.size() < profile_type::max_call_depth)
+            stack.push_back({sp, key, profile->num_of_ticks});
+    }
+
+    // The delays are computed once and then shared between
+    // all instances.
+    static const least_u8 *get_contention_delays() {
+        struct delays_table {
+            delays_table() {
+                for(ticks_type tick = 0; tick != contention_end; ++tick)
+                    delays[tick] = static_cast<least_u8>(
+                        compute_contention_delay(tick));
+            }
+
+            least_u8 delays[contention_end];
+        };
+
+        static const delays_table table;
+        return table.delays;
+    }
+
     pixel_type translate_color(unsigned c) {
         uint_fast32_t r = 0;
         r |= (c & red_mask)   << (16 - red_bit);
@@ -762,11 +1519,21 @@ protected:
 
     ticks_type ticks_since_int = 0;
     ticks_type ticks_to_stop = 0;    // Null means no limit.
+    ticks_type run_horizon = 0;
     ticks_type fetches_to_stop = 0;  // Null means no limit.
 
     fast_u16 addr_bus_value = 0;
     unsigned border_color = 0;
 
+    // Zero bits correspond to pressed keys.
+    keyboard_state_type keyboard_state = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    bool ear_level = false;
+
+    // Contention delays for every frame tick before the end of
+    // contended area.
+    const least_u8 *contention_delays = nullptr;
+
     // True if interrupts shall not be initiated at the beginning
     // of frames.
     bool int_suppressed = false;
@@ -778,9 +1545,111 @@ protected:
 
     bool trace_enabled = false;
 
+    // True if executed instructions shall be marked with
+    // visited_instr_mark.
+    bool visited_instrs_marking = false;
+    trace_buffer_type trace_buffer = {};
+    stats_type stats = {};
+
+    profile_type *profile = nullptr;
+    fast_u16 profiled_instr_addr = 0;
+
 private:
     screen_chunks_type screen_chunks;
-    least_u8 memory_marks[memory_image_size] = {};
+
+    // Pixel values for frame colours and for bytes of two
+    // frame pixels, where the leftmost pixel occupies the most
+    // significant bits.
+    pixel_type palette[num_of_frame_colors];
+    pixel_type pixel_pairs[num_of_frame_colors * num_of_frame_colors][2];
+
+    memory_marks_type memory_marks = {};
+    unsigned num_of_breakpoints = 0;
+    least_u8 watched_pages[num_of_memory_pages] = {};
+    fast_u16 watchpoint_addr = 0;
+    zx::memory_marks watchpoint_kind = no_marks;
+    dirty_lines_type dirty_lines = {};
+    render_mode rendering = render_mode::lazy;
+
+    // A port 0xFE write if the address is zero and a screen
+    // memory write otherwise. The tick is the one to render
+    // up to before applying the event.
+    struct frame_event {
+        uint_least32_t tick;
+        least_u16 addr;
+        least_u8 old_value;
+        least_u8 value;
+    };
+
+    void add_frame_event(fast_u16 addr, fast_u8 old_value, fast_u8 value) {
+        if(num_of_frame_events == max_num_of_frame_events)
+            flush_frame_events();
+
+        frame_event &e = frame_events[num_of_frame_events++];
+        e.tick = static_cast<uint_least32_t>(get_ticks() + 1);
+        e.addr = static_cast<least_u16>(addr);
+        e.old_value = static_cast<least_u8>(old_value);
+        e.value = static_cast<least_u8>(value);
+    }
+
+    static const unsigned max_num_of_frame_events = 0x2000;
+    frame_event frame_events[max_num_of_frame_events];
+    unsigned num_of_frame_events = 0;
+
+    void handle_port_fe_write(ticks_type tick, fast_u8 n) {
+        update_audio_to_tick(tick);
+        border_color = n & 0x7;
+
+        // EAR gives most of the beeper amplitude.
+        int level = (n & 0x10) ? 0x3000 : -0x3000;
+        level += (n & 0x08) ? 0x0400 : -0x0400;
+        beeper_level = level;
+    }
+
+    void buffer_audio_samples() {
+        for(audio_sample_type sample : frame_audio_samples) {
+            audio_buffer[audio_buffer_end] = sample;
+            audio_buffer_end = (audio_buffer_end + 1) % audio_buffer_size;
+        }
+        num_of_buffered_audio_samples = std::min<std::size_t>(
+            num_of_buffered_audio_samples + audio_samples_per_frame,
+            audio_buffer_size);
+    }
+
+    void update_audio_to_tick(ticks_type end_tick) {
+        end_tick = std::min(end_tick, ticks_per_frame);
+        while(audio_tick < end_tick) {
+            // Sample i covers ticks from i * T / N to
+            // (i + 1) * T / N.
+            unsigned i = audio_sample_index;
+            ticks_type sample_begin =
+                i * ticks_per_frame / audio_samples_per_frame;
+            ticks_type sample_end =
+                (i + 1) * ticks_per_frame / audio_samples_per_frame;
+            ticks_type tick = std::min(sample_end, end_tick);
+            audio_accumulator += beeper_level *
+                static_cast<long>(tick - audio_tick);
+            audio_tick = tick;
+
+            if(tick == sample_end) {
+                frame_audio_samples[i] = static_cast<audio_sample_type>(
+                    audio_accumulator /
+                        static_cast<long>(sample_end - sample_begin));
+                audio_accumulator = 0;
+                ++audio_sample_index;
+            }
+        }
+    }
+
+    int beeper_level = -0x3400;
+    ticks_type audio_tick = 0;
+    unsigned audio_sample_index = 0;
+    long audio_accumulator = 0;
+    audio_samples_type frame_audio_samples = {};
+    audio_samples_type audio_samples = {};
+    audio_sample_type audio_buffer[audio_buffer_size] = {};
+    std::size_t audio_buffer_end = 0;
+    std::size_t num_of_buffered_audio_samples = 0;
 };
 
 }  // namespace zx
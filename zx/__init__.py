@@ -9,6 +9,7 @@
 #   Published under the MIT license.
 
 
+from ._batch import Spectrum48Batch
 from ._emulator import Emulator
 from ._except import EmulationExit
 from ._except import EmulatorException
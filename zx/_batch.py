@@ -0,0 +1,51 @@
+# -*- coding: utf-8 -*-
+
+#   ZX Spectrum Emulator.
+#   https://github.com/kosarev/zx
+#
+#   Copyright (C) 2017-2021 Ivan Kosarev.
+#   ivan@kosarev.info
+#
+#   Published under the MIT license.
+
+from ._emulatorbase import _Spectrum48BatchBase
+from ._machine import RunEvents
+from ._rom import load_rom_image
+
+
+# Independent 48K machines stepped in lockstep, a frame at a time,
+# on a pool of native threads. Inputs and outputs are packed arrays
+# with an element per machine.
+class Spectrum48Batch(_Spectrum48BatchBase):
+    def __init__(self, num_of_machines, num_of_threads=0):
+        rom = load_rom_image('Spectrum48.rom')
+        for i in range(self.get_num_of_machines()):
+            self._get_memory_view(i)[0:len(rom)] = rom
+
+        # 8 bytes of half-rows per machine; zero bits correspond
+        # to pressed keys.
+        self.keyboard_states = self._get_keyboard_view()
+
+        # Events raised during the last frame.
+        self.events = self._get_events_view().cast('I')
+
+        # Rendered frames as 4-bit palette indexes packed in
+        # 32-bit chunks of 8 pixels.
+        self.screen_chunks = self._get_screen_chunks_view()
+
+    def __len__(self):
+        return self.get_num_of_machines()
+
+    def get_memory(self, i):
+        return self._get_memory_view(i)
+
+    def set_key_pressed(self, i, key, pressed=True):
+        index = i * 8 + key.ADDRESS_LINE - 8
+        mask = 1 << key.PORT_BIT
+        if pressed:
+            self.keyboard_states[index] &= mask ^ 0xff
+        else:
+            self.keyboard_states[index] |= mask
+
+    def get_events(self, i):
+        return RunEvents(self.events[i])
@@ -27,11 +27,6 @@ class GetEmulationTime(DeviceEvent):
     pass
 
 
-class GetTapeLevel(DeviceEvent):
-    def __init__(self, frame_tick):
-        self.frame_tick = frame_tick
-
-
 # TODO: Combine these into Get/SetState kind of events.
 class GetTapePlayerTime(DeviceEvent):
     pass
@@ -79,14 +74,24 @@ class ReadPort(DeviceEvent):
         self.addr = addr
 
 
+class RewindEmulation(DeviceEvent):
+    def __init__(self, seconds=1):
+        self.seconds = seconds
+
+
 class SaveSnapshot(DeviceEvent):
     def __init__(self, filename):
         self.filename = filename
 
 
 class ScreenUpdated(DeviceEvent):
-    def __init__(self, pixels):
+    # 'updated_lines' is a sequence of per-line flags telling
+    # which lines of the frame have changed since the previous
+    # update. None means all the lines shall be considered
+    # changed.
+    def __init__(self, pixels, updated_lines=None):
         self.pixels = pixels
+        self.updated_lines = updated_lines
 
 
 class TapeStateUpdated(DeviceEvent):
@@ -14,7 +14,6 @@ import time
 from ._data import MachineSnapshot
 from ._data import SoundFile
 from ._device import EndOfFrame
-from ._device import GetTapeLevel
 from ._device import IsTapePlayerPaused
 from ._device import IsTapePlayerStopped
 from ._device import KeyStroke
@@ -25,44 +24,56 @@ from ._device import QuantumRun
 from ._device import ReadPort
 from ._device import ScreenUpdated
 from ._error import Error
+from ._except import EmulationExit
 from ._except import EmulatorException
 from ._file import parse_file
 from ._gui import ScreenWindow
-from ._keyboard import Keyboard
 from ._keyboard import KEYS
 from ._machine import Dispatcher
 from ._machine import RunEvents
+from ._machine import FastSpectrum48
 from ._machine import Spectrum48
 from ._playback import PlaybackPlayer
 from ._rzx import RZXFile
-from ._tape import TapePlayer
 from ._time import Time
 from ._z80snapshot import Z80SnapshotFormat
 from ._zxb import ZXBasicCompilerProgram
 
 
-# TODO: Eliminate this class. Move everything to Spectrum48.
-class Emulator(Spectrum48):
+# TODO: Eliminate these classes. Move everything to Spectrum48.
+class _EmulatorMixin(object):
     _SPIN_V0P5_INFO = {'id': 'info',
                        'creator': b'SPIN 0.5            ',
                        'creator_major_version': 0,
                        'creator_minor_version': 5}
 
-    def __init__(self, speed_factor=1.0, profile=None, devices=None):
+    def __init__(self, speed_factor=1.0, profile=None, devices=None,
+                 trace_dump_size=None):
         super().__init__()
 
         # TODO: Double-underscore or make public.
         self._emulation_time = Time()
+
+        # Unlike the emulation time, does not count frames
+        # skipped by loading the cached post-reset state.
+        self._num_of_emulated_frames = 0
+
         self.__speed_factor = speed_factor
 
-        self.__events_to_signal = RunEvents.NO_EVENTS
+        # Without a window on full throttle nobody consumes the
+        # picture, so it is not rendered at all.
+        self.__rendering = True
 
         if devices is None:
-            devices = [self, TapePlayer(), Keyboard()]
+            devices = [self]
 
             # Don't even create the window on full throttle.
             if self.__speed_factor is not None:
                 devices.append(ScreenWindow())
+                self.enable_rewind()
+            else:
+                self.__rendering = False
+                self.render_mode = 'off'
 
             devices = Dispatcher(devices)
 
@@ -72,9 +83,18 @@ class Emulator(Spectrum48):
 
         self.__playback_player = None
 
-        self.__profile = profile
-        if self.__profile:
-            self.set_breakpoints(0, 0x10000)
+        if profile:
+            self.enable_profiling(call_graph=True)
+
+        # The number of most recent trace records to dump when a
+        # breakpoint is hit or an error occurs.
+        self.__trace_dump_size = trace_dump_size
+        if self.__trace_dump_size:
+            self.enable_trace()
+
+    def __dump_trace_on_stop(self):
+        if self.__trace_dump_size:
+            self.dump_trace(last=self.__trace_dump_size)
 
     # TODO: Double-underscore or make public.
     def _save_snapshot_file(self, format, filename):
@@ -130,46 +150,36 @@ class Emulator(Spectrum48):
                 self.devices.notify(KeyStroke(KEYS[id].ID, pressed=False))
                 self.run(duration=0.05, speed_factor=0)
 
-    def __on_input(self, addr):
-        # Handle playbacks.
-        if self.__playback_player:
-            sample = None
-            for sample in self.__playback_player.samples:
-                break
-
-            if sample == 'END_OF_FRAME':
-                raise Error(
-                    'Too few input samples at frame %d of %d. '
-                    'Given %d, used %d.' % (
-                        self.__playback_player.playback_frame_count,
-                        len(self.__playback_player.playback_chunk['frames']),
-                        len(self.__playback_player.samples), sample_i),
-                    id='too_few_input_samples')
-
-            # print('__on_input() returns %d' % sample)
-            return sample
-
-        # Scan keyboard.
-        n = 0xbf
+    def __on_input(self, addr, n):
+        # The keyboard, the tape and recorded input samples are
+        # handled natively, but devices may still want to
+        # contribute on hooked ports.
         n &= self.devices.notify(ReadPort(addr), 0xff)
 
-        # TODO: Use the tick when the ear value is sampled
-        #       instead of the tick of the beginning of the input
-        #       cycle.
-        if self.devices.notify(GetTapeLevel(self.ticks_since_int)):
-            n |= 0x40
-
-        END_OF_TAPE = RunEvents.END_OF_TAPE
-        if END_OF_TAPE in self.__events_to_signal and self.__is_end_of_tape():
-            self.raise_events(END_OF_TAPE)
-            self.__events_to_signal &= ~END_OF_TAPE
-
         # print('0x%04x 0x%02x' % (addr, n))
 
         return n
 
+    def __raise_playback_error(self):
+        id = self.get_playback_error()
+        frame_i, num_of_frames, sample_i, num_of_samples = (
+            self.get_playback_position())
+        DESCRIPTIONS = {
+            'too_few_input_samples': 'Too few input samples',
+            'too_many_input_samples': 'Too many input samples'}
+        raise Error(
+            '%s at frame %d of %d. Given %d, used %d.' % (
+                DESCRIPTIONS[id], frame_i, num_of_frames, num_of_samples,
+                sample_i),
+            id=id)
+
+    def __is_spin_v0p5_playback(self):
+        return (self.__playback_player is not None and
+                self.__playback_player.find_recording_info_chunk() ==
+                self._SPIN_V0P5_INFO)
+
     def __save_crash_rzx(self, player, state, chunk_i, frame_i):
-        snapshot = Z80SnapshotFormat().make(state)
+        snapshot = Z80SnapshotFormat().make_snapshot(state)
 
         crash_recording = {
             'id': 'input_recording',
@@ -203,17 +213,15 @@ class Emulator(Spectrum48):
     # TODO: Double-underscore or make public.
     def _quit_playback_mode(self):
         self.__playback_player = None
+        self.stop_playback()
 
         self.suppress_interrupts = False
         self.allow_int_after_ei = False
 
-    def __run_quantum(self, speed_factor=None):
+    def __run_quantum(self, speed_factor=None, num_of_frames=1):
         if speed_factor is None:
             speed_factor = self.__speed_factor
 
-        if self.__playback_player:
-            creator_info = self.__playback_player.find_recording_info_chunk()
-
         if True:  # TODO
             self.devices.notify(QuantumRun())
 
@@ -235,90 +243,88 @@ class Emulator(Spectrum48):
                     time.sleep((1 / 50) * speed_factor)
                 return
 
-            events = RunEvents(super().run())
+            events, num_of_frames = self.run_frames(
+                num_of_frames, render='last' if self.__rendering else False)
             # TODO: print(events)
 
-            if RunEvents.BREAKPOINT_HIT in events:
-                self.on_breakpoint()
-
-                if self.__profile:
-                    pc = self.pc
-                    self.__profile.add_instr_addr(pc)
+            if RunEvents.PLAYBACK_ERROR in events:
+                self.__dump_trace_on_stop()
+                self.__raise_playback_error()
 
+            if RunEvents.BREAKPOINT_HIT in events:
                 # SPIN v0.5 skips executing instructions
                 # of the bytes-saving ROM procedure in
                 # fast save mode.
-                if (self.__playback_player.samples and
-                        creator_info == self._SPIN_V0P5_INFO and
+                if (self.__is_spin_v0p5_playback() and
+                        self.is_playback_active() and
                         self.pc == 0x04d4):
                     sp = self.sp
                     ret_addr = self.read16(sp)
                     self.sp = sp + 2
                     self.pc = ret_addr
-
-            if RunEvents.END_OF_FRAME in events:
-                self.render_screen()
-
-                pixels = self.get_frame_pixels()
-                self.devices.notify(ScreenUpdated(pixels))
+                elif self._handle_tape_flash_loading():
+                    pass
+                else:
+                    self.__dump_trace_on_stop()
+                    self.on_breakpoint()
+
+            if RunEvents.WATCHPOINT_HIT in events:
+                self.__dump_trace_on_stop()
+                self.on_watchpoint()
+
+            if num_of_frames:
+                if self.__rendering:
+                    pixels = self.get_frame_pixels()
+                    updated_lines = self.get_updated_frame_lines()
+                    self.devices.notify(ScreenUpdated(pixels, updated_lines))
 
                 self.devices.notify(EndOfFrame())
-                self._emulation_time.advance(1 / 50)
+                self._emulation_time.advance(num_of_frames / 50)
+                self._num_of_emulated_frames += num_of_frames
 
                 if speed_factor:
-                    time.sleep((1 / 50) * speed_factor)
+                    time.sleep((num_of_frames / 50) * speed_factor)
 
-            if (self.__playback_player and
-                    RunEvents.FETCHES_LIMIT_HIT in events):
-                # Some emulators, e.g., SPIN, may store an interrupt
-                # point in the middle of a IX- or IY-prefixed
-                # instruction, so we continue until such
-                # instruction, if any, is completed.
-                if self.iregp_kind != 'hl':
-                    self.fetches_limit = 1
-                    return
-
-                # SPIN doesn't update the fetch counter if the last
-                # instruction in frame is IN.
-                if (self.__playback_player.samples and
-                        creator_info == self._SPIN_V0P5_INFO and
-                        self.__playback_player.playback_sample_i + 1 <
-                        len(self.__playback_player.playback_sample_values)):
-                    self.fetches_limit = 1
-                    return
-
-                sample = None
-                for sample in self.__playback_player.samples:
-                    break
-                if sample != 'END_OF_FRAME':
-                    raise Error(
-                        'Too many input samples at frame %d of %d. '
-                        'Given %d, used %d.' % (
-                            self.__playback_player.playback_frame_count,
-                            len(self.__playback_player.
-                                playback_chunk['frames']),
-                            len(self.__playback_player.samples),
-                            self.__playback_player.playback_sample_i + 1),
-                        id='too_many_input_samples')
-
-                sample = None
-                for sample in self.__playback_player.samples:
-                    break
-                if sample is None:
+            # Frames within a chunk of recorded input samples are
+            # switched natively.
+            if RunEvents.END_OF_PLAYBACK_CHUNK in events:
+                if not self.__playback_player.load_next_chunk():
                     self.stop()
-                    return
-
-                assert sample == 'START_OF_FRAME'
                 self.on_handle_active_int()
 
+    # Without pacing there is no need to return to Python every
+    # frame, so frames are run in batches.
+    __MAX_FRAMES_PER_QUANTUM = 50
+
+    def __get_quantum_frames(self, end_time, speed_factor):
+        if speed_factor is None:
+            speed_factor = self.__speed_factor
+        if speed_factor:
+            return 1
+
+        num_of_frames = self.__MAX_FRAMES_PER_QUANTUM
+        if end_time is not None:
+            time_left = end_time - self._emulation_time.get()
+            num_of_frames = min(num_of_frames, round(time_left * 50))
+        return max(1, num_of_frames)
+
     def run(self, duration=None, speed_factor=None):
         end_time = None
         if duration is not None:
             end_time = self._emulation_time.get() + duration
 
-        while (end_time is None or
-               self._emulation_time.get() < end_time):
-            self.__run_quantum(speed_factor=speed_factor)
+        try:
+            while (end_time is None or
+                   self._emulation_time.get() < end_time):
+                self.__run_quantum(
+                    speed_factor=speed_factor,
+                    num_of_frames=self.__get_quantum_frames(end_time,
+                                                            speed_factor))
+        except EmulationExit:
+            raise
+        except Exception:
+            self.__dump_trace_on_stop()
+            raise
 
     def __load_input_recording(self, file):
         self.__playback_player = PlaybackPlayer(self, file)
@@ -332,15 +338,30 @@ class Emulator(Spectrum48):
         # The bytes-saving ROM procedure needs special processing.
         self.set_breakpoint(0x04d4)
 
-        # Process frames in order.
-        sample = None
-        for sample in self.__playback_player.samples:
-            break
-        assert sample == 'START_OF_FRAME'
+        self.set_spin_playback_quirks(self.__is_spin_v0p5_playback())
+        self.__playback_player.load_next_chunk()
+
+    # Booting takes emulating 1.8 seconds, so the post-reset
+    # state is only computed once per process and then shared
+    # by all emulators of the same type, including those in
+    # forked processes. States of different machine types are
+    # not compatible.
+    __booted_state = None
+    __BOOT_DURATION = 1.8
 
     def __reset_and_wait(self):
+        booted_state = type(self).__booted_state
+        if booted_state is not None:
+            self.load_state(booted_state)
+            self._emulation_time.advance(self.__BOOT_DURATION)
+            return
+
         self.pc = 0x0000
-        self.run(duration=1.8, speed_factor=0)
+        self.run(duration=self.__BOOT_DURATION, speed_factor=0)
+        type(self).__booted_state = self.save_state()
+
+    def reset(self):
+        self.__reset_and_wait()
 
     def __load_zx_basic_compiler_program(self, file):
         assert isinstance(file, ZXBasicCompilerProgram)
@@ -379,7 +400,9 @@ class Emulator(Spectrum48):
         self._load_file(filename)
         self.run()
 
-    def load_tape(self, filename):
+    # With 'flash_load' set, blocks loaded with the ROM routine
+    # are copied to memory directly instead of being played.
+    def load_tape(self, filename, flash_load=False):
         tape = parse_file(filename)
         if not isinstance(tape, SoundFile):
             raise Error('%r does not seem to be a tape file.' % filename)
@@ -391,10 +414,20 @@ class Emulator(Spectrum48):
         self.__generate_key_strokes('J', 'SS+P', 'SS+P', 'ENTER')
 
         # Load and run the tape.
+        self.enable_tape_flash_loading(flash_load)
         self.__load_tape_to_player(tape)
         self.__unpause_tape()
 
-        # Wait till the end of the tape.
-        self.__events_to_signal |= RunEvents.END_OF_TAPE
+        # Wait till the end of the tape. The end-of-tape event
+        # stops the quantum as soon as the last pulse is fetched.
         while not self.__is_end_of_tape():
             self.__run_quantum(speed_factor=0)
+
+
+class Emulator(_EmulatorMixin, Spectrum48):
+    pass
+
+
+# For fast-forwarding and conversions.
+class FastEmulator(_EmulatorMixin, FastSpectrum48):
+    pass
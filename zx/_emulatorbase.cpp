@@ -10,7 +10,23 @@
 
 #include <Python.h>
 
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "../zx.h"
 
@@ -22,6 +38,9 @@ using zx::least_u8;
 using zx::least_u16;
 using zx::unreachable;
 using zx::events_mask;
+using zx::no_events;
+using zx::end_of_frame;
+using zx::fetches_limit_hit;
 
 typedef uint_least32_t least_u32;
 
@@ -41,33 +60,14 @@ private:
 
 namespace Spectrum48 {
 
-struct __attribute__((packed)) processor_state {
-    least_u16 bc;
-    least_u16 de;
-    least_u16 hl;
-    least_u16 af;
-    least_u16 ix;
-    least_u16 iy;
-
-    least_u16 alt_bc;
-    least_u16 alt_de;
-    least_u16 alt_hl;
-    least_u16 alt_af;
-
-    least_u16 pc;
-    least_u16 sp;
-    least_u16 ir;
-    least_u16 wz;
-
-    least_u8 iff1;
-    least_u8 iff2;
-    least_u8 int_mode;
-    least_u8 index_rp_kind;
-};
+// Events raised by the module in addition to those of the core.
+const events_mask end_of_tape           = 1u << 5;
+const events_mask end_of_playback_chunk = 1u << 6;
+const events_mask playback_error        = 1u << 7;
 
+// Registers are not part of the state block and are accessed
+// directly in the processor via attributes of the Python object.
 struct __attribute__((packed)) machine_state {
-    processor_state proc;
-
     least_u32 ticks_since_int = 0;
     least_u32 fetches_to_stop = 0;
     least_u32 events = 0;
@@ -75,280 +75,2678 @@ struct __attribute__((packed)) machine_state {
     least_u8 int_after_ei_allowed = false;
     least_u8 border_color = 7;
     least_u8 trace_enabled = false;
+    least_u8 visited_instrs_marking = false;
+    least_u8 keyboard_state[8] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    least_u8 ear_level = false;
+
+    zx::memory_image_type memory;
+};
+
+// Saved states and rewind points only cover the execution
+// fields at the beginning of the state block. Debugging
+// settings and the input state are left as they are.
+const std::size_t saved_machine_fields_size =
+    offsetof(machine_state, trace_enabled);
+
+// Memory blocks of .z80 snapshots are compressed by replacing
+// runs of equal bytes with ED ED <count> <byte> sequences.
+// Runs of ED bytes are always encoded, so a literal ED is never
+// followed by another ED, and a byte following a literal ED is
+// never the start of a run.
+static const fast_u8 z80_block_marker = 0xed;
+
+// Uncompresses up to the output size and returns the number of
+// input bytes consumed, or zero if the input does not produce
+// exactly the requested number of bytes.
+static std::size_t uncompress_z80_block(const least_u8 *input,
+                                        std::size_t input_size,
+                                        least_u8 *output,
+                                        std::size_t output_size) {
+    std::size_t i = 0, o = 0;
+    while(o != output_size && i != input_size) {
+        if(input_size - i >= 4 && input[i] == z80_block_marker &&
+               input[i + 1] == z80_block_marker) {
+            std::size_t count = input[i + 2];
+            if(count > output_size - o)
+                return 0;
+            std::memset(output + o, input[i + 3], count);
+            o += count;
+            i += 4;
+        } else {
+            output[o++] = input[i++];
+        }
+    }
+
+    return o == output_size ? i : 0;
+}
+
+static void compress_z80_block(const least_u8 *input, std::size_t size,
+                               std::vector<least_u8> &output) {
+    const std::size_t max_run = 0xff;
+    std::size_t i = 0;
+    while(i != size) {
+        least_u8 n = input[i];
+        std::size_t run = 1;
+        while(i + run != size && run != max_run && input[i + run] == n)
+            ++run;
+
+        if(run >= 5 || (run >= 2 && n == z80_block_marker)) {
+            output.push_back(z80_block_marker);
+            output.push_back(z80_block_marker);
+            output.push_back(static_cast<least_u8>(run));
+            output.push_back(n);
+            i += run;
+            continue;
+        }
+
+        output.push_back(n);
+        ++i;
+
+        // The byte following a single marker byte is never
+        // encoded as part of a run.
+        if(n == z80_block_marker && i != size)
+            output.push_back(input[i++]);
+    }
+}
+
+// A copy of a block of bytes stored as fixed-size pages.
+// Capturing an image reuses pages of a reference image that are
+// not changed, so images taken one after another share most of
+// their memory.
+class paged_image {
+public:
+    static const std::size_t page_size = 1024;
+
+    void capture(const least_u8 *bytes, std::size_t size,
+                 const paged_image &reference) {
+        std::size_t num_of_pages = (size + page_size - 1) / page_size;
+        pages.resize(num_of_pages);
+        for(std::size_t i = 0; i != num_of_pages; ++i) {
+            const least_u8 *page_bytes = bytes + i * page_size;
+            std::size_t n = std::min(page_size, size - i * page_size);
+            if(i < reference.pages.size() &&
+                   std::memcmp(reference.pages[i]->bytes, page_bytes, n) == 0) {
+                pages[i] = reference.pages[i];
+                continue;
+            }
+
+            std::shared_ptr<page> new_page = std::make_shared<page>();
+            std::memcpy(new_page->bytes, page_bytes, n);
+            pages[i] = new_page;
+        }
+    }
+
+    void restore(least_u8 *bytes, std::size_t size) const {
+        for(std::size_t i = 0; i != pages.size(); ++i) {
+            std::size_t n = std::min(page_size, size - i * page_size);
+            std::memcpy(bytes + i * page_size, pages[i]->bytes, n);
+        }
+    }
+
+private:
+    struct page {
+        least_u8 bytes[page_size] = {};
+    };
+
+    std::vector<std::shared_ptr<const page>> pages;
+};
+
+// Keeps a limited history of state images. Every few images are
+// kept as is as keyframes and the rest are stored as run-length
+// encoded XOR deltas against their keyframes, so restoring any
+// image only takes decoding a single delta.
+class rewind_buffer {
+public:
+    typedef std::vector<least_u8> image_type;
+
+    void configure(std::size_t max_num_of_images,
+                   unsigned images_per_keyframe) {
+        entries.clear();
+        this->max_num_of_images = max_num_of_images;
+        this->images_per_keyframe = std::max(images_per_keyframe, 1u);
+        start_new_keyframe();
+    }
+
+    std::size_t get_num_of_images() const { return entries.size(); }
+
+    void add(const image_type &image) {
+        if(!max_num_of_images)
+            return;
+
+        entry new_entry;
+        if(images_since_keyframe >= images_per_keyframe) {
+            new_entry.keyframe = std::make_shared<image_type>(image);
+            images_since_keyframe = 0;
+        } else {
+            new_entry.keyframe = entries.back().keyframe;
+            encode_delta(image, *new_entry.keyframe, new_entry.delta);
+        }
+        ++images_since_keyframe;
+
+        entries.push_back(std::move(new_entry));
+        if(entries.size() > max_num_of_images)
+            entries.pop_front();
+    }
+
+    // Retrieves the image with the specified index counting
+    // from the most recent one and discards all images
+    // recorded after it.
+    void rewind(std::size_t steps_back, image_type &image) {
+        assert(steps_back < entries.size());
+        entries.resize(entries.size() - steps_back);
+
+        const entry &e = entries.back();
+        if(e.delta.empty())
+            image = *e.keyframe;
+        else
+            decode_delta(e.delta, *e.keyframe, image);
+
+        // Make sure new images are not encoded against a
+        // keyframe the restored image may not be based on.
+        start_new_keyframe();
+    }
+
+private:
+    struct entry {
+        std::shared_ptr<const image_type> keyframe;
+        image_type delta;  // Empty for keyframes.
+    };
+
+    void start_new_keyframe() {
+        images_since_keyframe = images_per_keyframe;
+    }
+
+    static void put16(image_type &delta, std::size_t n) {
+        delta.push_back(static_cast<least_u8>(n & 0xff));
+        delta.push_back(static_cast<least_u8>(n >> 8));
+    }
+
+    static std::size_t get16(const least_u8 *p) {
+        return static_cast<std::size_t>(p[0] | (p[1] << 8));
+    }
+
+    // Deltas are sequences of a 16-bit number of matching bytes
+    // followed by a 16-bit number of literal XOR-ed bytes and
+    // the literal bytes themselves.
+    static void encode_delta(const image_type &image,
+                             const image_type &keyframe, image_type &delta) {
+        assert(image.size() == keyframe.size());
+        const std::size_t max_run = 0xffff;
+        std::size_t size = image.size();
+        std::size_t i = 0;
+        while(i != size) {
+            std::size_t matching = 0;
+            while(i + matching != size && matching != max_run &&
+                      image[i + matching] == keyframe[i + matching])
+                ++matching;
+            i += matching;
+
+            std::size_t literal = 0;
+            while(i + literal != size && literal != max_run &&
+                      image[i + literal] != keyframe[i + literal])
+                ++literal;
+
+            put16(delta, matching);
+            put16(delta, literal);
+            for(std::size_t j = 0; j != literal; ++j, ++i)
+                delta.push_back(static_cast<least_u8>(image[i] ^ keyframe[i]));
+        }
+
+        // Distinguish deltas from keyframes.
+        if(delta.empty()) {
+            put16(delta, 0);
+            put16(delta, 0);
+        }
+    }
+
+    static void decode_delta(const image_type &delta,
+                             const image_type &keyframe, image_type &image) {
+        image = keyframe;
+        std::size_t i = 0;
+        const least_u8 *p = delta.data();
+        const least_u8 *end = p + delta.size();
+        while(p != end) {
+            i += get16(p);
+            std::size_t literal = get16(p + 2);
+            p += 4;
+            for(std::size_t j = 0; j != literal; ++j, ++i)
+                image[i] = static_cast<least_u8>(image[i] ^ *p++);
+        }
+    }
+
+    std::deque<entry> entries;
+    std::size_t max_num_of_images = 0;
+    unsigned images_per_keyframe = 1;
+    unsigned images_since_keyframe = 0;
+};
+
+// Streams rendered frames to a file descriptor, reusing its
+// conversion buffers from frame to frame.
+class frame_sink {
+public:
+    // Raw RGB24 pixels, YUV 4:4:4 frames in the Y4M container or
+    // screen chunks as is, that is, 32-bit native-endian words
+    // of eight 4-bit palette indexes, the most significant
+    // nibble first.
+    enum class format { rgb, y4m, indexed };
+
+    // The descriptor is not owned by the sink.
+    void start(int new_fd, format new_format, bool new_skip_identical_frames) {
+        fd = new_fd;
+        frames_format = new_format;
+        skip_identical_frames = new_skip_identical_frames;
+        header_written = false;
+        last_chunks.clear();
+        error = 0;
+    }
+
+    void stop() { fd = -1; }
+
+    bool is_active() const { return fd >= 0; }
+
+    // The errno value of the write that stopped the sink, if
+    // any. Reading the error clears it.
+    int take_error() {
+        int e = error;
+        error = 0;
+        return e;
+    }
+
+    // Palette entries are 0xRRGGBB values.
+    void write_frame(const uint_least32_t *chunks, unsigned chunks_per_line,
+                     unsigned num_of_lines,
+                     const uint_least32_t (&palette)[16]) {
+        const std::size_t num_of_chunks =
+            std::size_t(chunks_per_line) * num_of_lines;
+        if(skip_identical_frames) {
+            if(last_chunks.size() == num_of_chunks &&
+                   std::equal(chunks, chunks + num_of_chunks,
+                              last_chunks.begin()))
+                return;
+            last_chunks.assign(chunks, chunks + num_of_chunks);
+        }
+
+        const std::size_t num_of_pixels = num_of_chunks * pixels_per_chunk;
+        ::iovec iov[5];
+        int n = 0;
+        switch(frames_format) {
+        case format::indexed:
+            add_iov(iov, n, chunks, num_of_chunks * sizeof(*chunks));
+            break;
+        case format::rgb:
+            convert_to_rgb(chunks, num_of_chunks, palette);
+            add_iov(iov, n, pixels.data(), pixels.size());
+            break;
+        case format::y4m: {
+            if(!header_written) {
+                header = "YUV4MPEG2 W" +
+                         std::to_string(chunks_per_line * pixels_per_chunk) +
+                         " H" + std::to_string(num_of_lines) +
+                         " F50:1 Ip A1:1 C444\n";
+                add_iov(iov, n, header.data(), header.size());
+            }
+            static const char frame_header[] = "FRAME\n";
+            add_iov(iov, n, frame_header, sizeof(frame_header) - 1);
+            convert_to_yuv(chunks, num_of_chunks, palette);
+            for(unsigned plane = 0; plane != 3; ++plane)
+                add_iov(iov, n, &pixels[plane * num_of_pixels], num_of_pixels);
+            break; }
+        }
+
+        if(!write_all(iov, n)) {
+            error = errno;
+            stop();
+            return;
+        }
+
+        header_written = true;
+    }
+
+private:
+    static const unsigned pixels_per_chunk = 8;
+
+    static void add_iov(::iovec *iov, int &n, const void *data,
+                        std::size_t size) {
+        iov[n].iov_base = const_cast<void*>(data);
+        iov[n].iov_len = size;
+        ++n;
+    }
+
+    template<typename F>
+    static void for_each_pixel(const uint_least32_t *chunks,
+                               std::size_t num_of_chunks, F f) {
+        std::size_t i = 0;
+        for(std::size_t c = 0; c != num_of_chunks; ++c) {
+            uint_least32_t chunk = chunks[c];
+            for(unsigned shift = 32; shift != 0; shift -= 4)
+                f(i++, (chunk >> (shift - 4)) & 0xf);
+        }
+    }
+
+    void convert_to_rgb(const uint_least32_t *chunks,
+                        std::size_t num_of_chunks,
+                        const uint_least32_t (&palette)[16]) {
+        pixels.resize(num_of_chunks * pixels_per_chunk * 3);
+        least_u8 *p = pixels.data();
+        for_each_pixel(chunks, num_of_chunks,
+                       [p, &palette](std::size_t i, uint_least32_t c) {
+            uint_least32_t rgb = palette[c];
+            p[i * 3 + 0] = static_cast<least_u8>((rgb >> 16) & 0xff);
+            p[i * 3 + 1] = static_cast<least_u8>((rgb >> 8) & 0xff);
+            p[i * 3 + 2] = static_cast<least_u8>(rgb & 0xff);
+        });
+    }
+
+    // Uses the BT.601 limited-range coefficients.
+    void convert_to_yuv(const uint_least32_t *chunks,
+                        std::size_t num_of_chunks,
+                        const uint_least32_t (&palette)[16]) {
+        least_u8 yuv[16][3];
+        for(unsigned c = 0; c != 16; ++c) {
+            int r = static_cast<int>((palette[c] >> 16) & 0xff);
+            int g = static_cast<int>((palette[c] >> 8) & 0xff);
+            int b = static_cast<int>(palette[c] & 0xff);
+            yuv[c][0] = static_cast<least_u8>(
+                ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+            yuv[c][1] = static_cast<least_u8>(
+                (-38 * r - 74 * g + 112 * b + 128 + (128 << 8)) >> 8);
+            yuv[c][2] = static_cast<least_u8>(
+                (112 * r - 94 * g - 18 * b + 128 + (128 << 8)) >> 8);
+        }
+
+        const std::size_t num_of_pixels = num_of_chunks * pixels_per_chunk;
+        pixels.resize(num_of_pixels * 3);
+        least_u8 *p = pixels.data();
+        for_each_pixel(chunks, num_of_chunks,
+                       [p, &yuv, num_of_pixels](std::size_t i,
+                                                uint_least32_t c) {
+            p[i] = yuv[c][0];
+            p[num_of_pixels + i] = yuv[c][1];
+            p[num_of_pixels * 2 + i] = yuv[c][2];
+        });
+    }
+
+    // Handles partial writes and interruptions.
+    bool write_all(::iovec *iov, int n) {
+        while(n) {
+            ssize_t written = ::writev(fd, iov, n);
+            if(written < 0) {
+                if(errno == EINTR)
+                    continue;
+                return false;
+            }
+
+            auto left = static_cast<std::size_t>(written);
+            while(n && left >= iov->iov_len) {
+                left -= iov->iov_len;
+                ++iov;
+                --n;
+            }
+            if(n) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+                iov->iov_len -= left;
+            }
+        }
+        return true;
+    }
+
+    int fd = -1;
+    format frames_format = format::rgb;
+    bool skip_identical_frames = false;
+    bool header_written = false;
+    int error = 0;
+    std::string header;
+    std::vector<least_u8> pixels;
+    std::vector<uint_least32_t> last_chunks;
+};
+
+template<typename F>
+class basic_machine_emulator
+    : public zx::spectrum48<basic_machine_emulator<F>, F> {
+public:
+    typedef zx::spectrum48<basic_machine_emulator<F>, F> base;
+    typedef typename base::ticks_type ticks_type;
+    typedef typename base::memory_image_type memory_image_type;
+    typedef typename base::keyboard_state_type keyboard_state_type;
+    typedef typename base::screen_chunks_type screen_chunks_type;
+    typedef typename base::pixels_buffer_type pixels_buffer_type;
+    typedef typename base::dirty_lines_type dirty_lines_type;
+    typedef typename base::render_state render_state;
+
+    basic_machine_emulator() {
+        retrieve_state();
+    }
+
+    machine_state &get_machine_state() {
+        return state;
+    }
+
+    enum class register_id {
+        bc, de, hl, af, ix, iy, alt_bc, alt_de, alt_hl, alt_af,
+        pc, sp, ir, wz, a, f, alt_a, alt_f, i, r,
+        iff1, iff2, int_mode, iregp_kind };
+
+    fast_u16 get_register(register_id r) {
+        switch(r) {
+        case register_id::bc: return this->get_bc();
+        case register_id::de: return this->get_de();
+        case register_id::hl: return this->get_hl();
+        case register_id::af: return this->get_af();
+        case register_id::ix: return this->get_ix();
+        case register_id::iy: return this->get_iy();
+        case register_id::alt_bc: return this->get_alt_bc();
+        case register_id::alt_de: return this->get_alt_de();
+        case register_id::alt_hl: return this->get_alt_hl();
+        case register_id::alt_af: return this->get_alt_af();
+        case register_id::pc: return this->get_pc();
+        case register_id::sp: return this->get_sp();
+        case register_id::ir: return this->get_ir();
+        case register_id::wz: return this->get_wz();
+        case register_id::a: return z80::get_high8(this->get_af());
+        case register_id::f: return z80::get_low8(this->get_af());
+        case register_id::alt_a: return z80::get_high8(this->get_alt_af());
+        case register_id::alt_f: return z80::get_low8(this->get_alt_af());
+        case register_id::i: return z80::get_high8(this->get_ir());
+        case register_id::r: return z80::get_low8(this->get_ir());
+        case register_id::iff1: return this->get_iff1() ? 1 : 0;
+        case register_id::iff2: return this->get_iff2() ? 1 : 0;
+        case register_id::int_mode: return this->get_int_mode();
+        case register_id::iregp_kind:
+            return static_cast<fast_u16>(this->get_iregp_kind());
+        }
+        unreachable("Unknown register.");
+    }
+
+    static const unsigned num_of_saved_registers = 18;
+    static constexpr register_id saved_registers[num_of_saved_registers] = {
+        register_id::bc, register_id::de, register_id::hl, register_id::af,
+        register_id::ix, register_id::iy, register_id::alt_bc,
+        register_id::alt_de, register_id::alt_hl, register_id::alt_af,
+        register_id::pc, register_id::sp, register_id::ir, register_id::wz,
+        register_id::iff1, register_id::iff2, register_id::int_mode,
+        register_id::iregp_kind };
+
+    void set_register(register_id r, fast_u16 n) {
+        switch(r) {
+        case register_id::bc: this->set_bc(n); return;
+        case register_id::de: this->set_de(n); return;
+        case register_id::hl: this->set_hl(n); return;
+        case register_id::af: this->set_af(n); return;
+        case register_id::ix: this->set_ix(n); return;
+        case register_id::iy: this->set_iy(n); return;
+        case register_id::alt_bc: this->set_alt_bc(n); return;
+        case register_id::alt_de: this->set_alt_de(n); return;
+        case register_id::alt_hl: this->set_alt_hl(n); return;
+        case register_id::alt_af: this->set_alt_af(n); return;
+        case register_id::pc: this->set_pc(n); return;
+        case register_id::sp: this->set_sp(n); return;
+        case register_id::ir: this->set_ir(n); return;
+        case register_id::wz: this->set_wz(n); return;
+        case register_id::iff1: this->set_iff1(n != 0); return;
+        case register_id::iff2: this->set_iff2(n != 0); return;
+        case register_id::int_mode: this->set_int_mode(n); return;
+        case register_id::iregp_kind:
+            this->set_iregp_kind(static_cast<z80::iregp>(n));
+            return;
+        case register_id::a:
+        case register_id::f:
+        case register_id::alt_a:
+        case register_id::alt_f:
+        case register_id::i:
+        case register_id::r:
+            break;
+        }
+        unreachable("Read-only register.");
+    }
+
+    void retrieve_state() {
+        state.ticks_since_int = this->ticks_since_int;
+        state.fetches_to_stop = this->fetches_to_stop;
+        state.events = this->events;
+        state.int_suppressed = this->int_suppressed;
+        state.int_after_ei_allowed = this->int_after_ei_allowed;
+        state.border_color = this->border_color;
+        state.trace_enabled = this->trace_enabled;
+        state.visited_instrs_marking = this->visited_instrs_marking;
+        std::copy(std::begin(this->keyboard_state),
+                  std::end(this->keyboard_state),
+                  std::begin(state.keyboard_state));
+        state.ear_level = this->ear_level;
+    }
+
+    void install_state() {
+        this->ticks_since_int = state.ticks_since_int;
+        this->fetches_to_stop = state.fetches_to_stop;
+
+        // Events may be raised by callbacks, in which case we
+        // want the execution to stop as soon as possible.
+        this->events = no_events;
+        if(state.events)
+            this->raise_events(state.events);
+        this->int_suppressed = state.int_suppressed;
+        this->int_after_ei_allowed = state.int_after_ei_allowed;
+        this->border_color = state.border_color;
+        this->trace_enabled = state.trace_enabled;
+        this->visited_instrs_marking = state.visited_instrs_marking;
+        std::copy(std::begin(state.keyboard_state),
+                  std::end(state.keyboard_state),
+                  std::begin(this->keyboard_state));
+        this->ear_level = state.ear_level;
+    }
+
+    pixels_buffer_type &get_frame_pixels() {
+        // The buffer retains pixels of the previous frame, so we
+        // only need to convert the lines that were changed.
+        base::update_frame_pixels(pixels);
+        const dirty_lines_type &dirty_lines = this->get_dirty_lines();
+        std::copy(std::begin(dirty_lines), std::end(dirty_lines),
+                  std::begin(updated_lines));
+        this->clear_dirty_lines();
+        return pixels;
+    }
+
+    const dirty_lines_type &get_updated_lines() const {
+        return updated_lines;
+    }
+
+    events_mask run() {
+        events_mask events;
+        do {
+            callback_failed = false;
+            install_state();
+            events = base::run();
+            retrieve_state();
+
+            // Tape ticks are counted from the beginning of the
+            // current frame.
+            if(events & end_of_frame) {
+                update_tape_level(base::ticks_per_frame);
+                tape_tick -= base::ticks_per_frame;
+
+                // The last pulse may also be fetched here, after
+                // the core stopped collecting events.
+                events |= this->get_events() & end_of_tape;
+
+                if(frames_per_rewind_point &&
+                       ++frames_since_rewind_point ==
+                           frames_per_rewind_point) {
+                    frames_since_rewind_point = 0;
+                    capture_state_image(rewind_image);
+                    rewind.add(rewind_image);
+                }
+
+                if(frames.is_active())
+                    write_frame_to_sink();
+            }
+
+            // Transitions between the frames of a recording
+            // are not reported unless they need attention.
+            if(playback_active && (events & fetches_limit_hit))
+                events = handle_end_of_playback_frame(events);
+        } while(!events);
+
+        return events;
+    }
+
+    // Everything needed to resume execution from a given point,
+    // except for tapes, input hooks, debugging settings and the
+    // keyboard and EAR input.
+    struct saved_state {
+        fast_u16 registers[num_of_saved_registers];
+        least_u8 machine_fields[saved_machine_fields_size];
+        render_state render;
+        paged_image memory;
+        paged_image screen_chunks;
+    };
+
+    saved_state *save_state() {
+        auto *saved = new saved_state;
+        for(unsigned i = 0; i != num_of_saved_registers; ++i)
+            saved->registers[i] = get_register(saved_registers[i]);
+
+        // The state block is up to date between runs.
+        std::memcpy(saved->machine_fields,
+                    reinterpret_cast<const char*>(&state),
+                    sizeof(saved->machine_fields));
+        saved->render = this->get_render_state();
+
+        saved->memory.capture(state.memory, sizeof(state.memory),
+                              reference_memory);
+        const screen_chunks_type &chunks = this->get_screen_chunks();
+        saved->screen_chunks.capture(
+            reinterpret_cast<const least_u8*>(&chunks), sizeof(chunks),
+            reference_screen_chunks);
+
+        reference_memory = saved->memory;
+        reference_screen_chunks = saved->screen_chunks;
+        return saved;
+    }
+
+    void load_state(const saved_state &saved) {
+        for(unsigned i = 0; i != num_of_saved_registers; ++i)
+            set_register(saved_registers[i], saved.registers[i]);
+
+        std::memcpy(reinterpret_cast<char*>(&state), saved.machine_fields,
+                    sizeof(saved.machine_fields));
+        this->set_render_state(saved.render);
+
+        saved.memory.restore(state.memory, sizeof(state.memory));
+        screen_chunks_type chunks;
+        saved.screen_chunks.restore(reinterpret_cast<least_u8*>(&chunks),
+                                    sizeof(chunks));
+        this->set_screen_chunks(chunks);
+
+        // Further saved states are likely to share pages with
+        // this one.
+        reference_memory = saved.memory;
+        reference_screen_chunks = saved.screen_chunks;
+
+        // Rendering the rest of the frame relies on the fields
+        // of the core, e.g., the border colour.
+        install_state();
+    }
+
+    // Sets up recording of rewind points at the ends of
+    // frames. Zero number of points disables rewinding.
+    void set_rewind_buffer(std::size_t max_num_of_points,
+                           unsigned frames_per_point,
+                           unsigned points_per_keyframe) {
+        rewind.configure(max_num_of_points, points_per_keyframe);
+        this->frames_per_rewind_point =
+            max_num_of_points ? std::max(frames_per_point, 1u) : 0;
+        frames_since_rewind_point = 0;
+    }
+
+    std::size_t get_num_of_rewind_points() const {
+        return rewind.get_num_of_images();
+    }
+
+    frame_sink &get_frame_sink() { return frames; }
+
+    void write_frame_to_sink() {
+        this->render_screen();
+
+        uint_least32_t palette[base::num_of_frame_colors];
+        for(unsigned c = 0; c != base::num_of_frame_colors; ++c)
+            palette[c] = this->get_palette_color(c);
+
+        const screen_chunks_type &chunks = this->get_screen_chunks();
+        frames.write_frame(&chunks[0][0], base::chunks_per_frame_line,
+                           base::frame_height, palette);
+    }
+
+    // Starts collecting a new execution profile.
+    void enable_profiling(bool call_graph) {
+        profile_data.reset(new zx::profile_type);
+        profile_data->call_graph_enabled = call_graph;
+        this->set_profile(profile_data.get());
+    }
+
+    void disable_profiling() {
+        this->set_profile(nullptr);
+        profile_data.reset();
+    }
+
+    const zx::disassembled_instr &disassemble(fast_u16 addr) {
+        return disasm_cache.disassemble(addr, this->on_get_memory());
+    }
+
+    // Discards the specified number of most recent rewind
+    // points and restores the point preceding them, or the
+    // oldest point available.
+    bool rewind_points(std::size_t num_of_points) {
+        std::size_t num_of_available_points = rewind.get_num_of_images();
+        if(!num_of_available_points)
+            return false;
+
+        rewind.rewind(std::min(num_of_points, num_of_available_points - 1),
+                      rewind_image);
+        install_state_image(rewind_image);
+        frames_since_rewind_point = 0;
+        return true;
+    }
+
+    enum class playback_error_kind {
+        none, too_few_input_samples, too_many_input_samples };
+
+    // Loads a chunk of RZX input recording. Frames are given as
+    // pairs of the number of instruction fetches and the number
+    // of input samples in the frame, and the samples of all
+    // frames follow each other. The fetch limit is set up for
+    // the first frame; the interrupts between frames are
+    // initiated natively.
+    bool set_playback_chunk(const least_u32 *frames,
+                            std::size_t num_of_frames,
+                            const least_u8 *samples,
+                            std::size_t num_of_samples) {
+        std::vector<playback_frame> new_frames(num_of_frames);
+        std::size_t samples_end = 0;
+        for(std::size_t i = 0; i != num_of_frames; ++i) {
+            samples_end += frames[i * 2 + 1];
+            new_frames[i].num_of_fetches = frames[i * 2];
+            new_frames[i].samples_end = samples_end;
+        }
+
+        if(!num_of_frames || samples_end != num_of_samples)
+            return false;
+
+        playback_frames = std::move(new_frames);
+        playback_samples.assign(samples, samples + num_of_samples);
+        playback_frame_index = 0;
+        next_playback_sample = 0;
+        playback_error_raised = playback_error_kind::none;
+        playback_active = true;
+
+        state.fetches_to_stop = playback_frames[0].num_of_fetches;
+        return true;
+    }
+
+    void stop_playback() {
+        playback_active = false;
+        playback_frames.clear();
+        playback_samples.clear();
+        spin_playback_quirks = false;
+    }
+
+    bool is_playback_active() const { return playback_active; }
+
+    // SPIN v0.5 doesn't update the fetch counter if the last
+    // instruction in frame is IN.
+    void set_spin_playback_quirks(bool enable) {
+        spin_playback_quirks = enable;
+    }
+
+    playback_error_kind get_playback_error() const {
+        return playback_error_raised;
+    }
+
+    struct playback_position {
+        std::size_t frame_index;
+        std::size_t num_of_frames;
+        std::size_t sample_index;
+        std::size_t num_of_samples;
+    };
+
+    playback_position get_playback_position() const {
+        playback_position pos = {};
+        pos.num_of_frames = playback_frames.size();
+        if(playback_frame_index < playback_frames.size()) {
+            std::size_t begin = get_playback_frame_begin();
+            pos.frame_index = playback_frame_index;
+            pos.sample_index = next_playback_sample - begin;
+            pos.num_of_samples =
+                playback_frames[playback_frame_index].samples_end - begin;
+        }
+        return pos;
+    }
+
+    enum class frame_rendering { none, last, every };
+
+    // Runs up to the specified number of frames back to back.
+    // Stops early on any event other than the end of frame or
+    // on an error raised by a callback.
+    events_mask run_frames(unsigned num_of_frames, frame_rendering rendering,
+                           unsigned &num_of_frames_run) {
+        events_mask all_events = no_events;
+        events_mask events = no_events;
+        num_of_frames_run = 0;
+        while(num_of_frames_run != num_of_frames) {
+            events = run();
+            all_events |= events;
+            if(is_callback_failed())
+                break;
+
+            if(events & end_of_frame) {
+                ++num_of_frames_run;
+                if(rendering == frame_rendering::every)
+                    this->render_screen();
+            }
+
+            if(events & ~end_of_frame)
+                break;
+        }
+
+        // The last frame is only rendered if it is complete.
+        if(rendering == frame_rendering::last && (events & end_of_frame))
+            this->render_screen();
+
+        return all_events;
+    }
+
+    bool on_handle_active_int() {
+        install_state();
+        bool int_initiated = base::on_handle_active_int();
+        retrieve_state();
+        return int_initiated;
+    }
+
+    PyObject *set_on_input_callback(PyObject *callback) {
+        PyObject *old_callback = on_input_callback;
+        on_input_callback = callback;
+        return old_callback;
+    }
+
+    // Tape pulses are 32-bit values where the lower 31 bits
+    // specify the duration in ticks and the most significant
+    // bit is the EAR level during the pulse.
+    static const least_u32 tape_pulse_level_mask = 0x80000000;
+    static const least_u32 tape_pulse_ticks_mask = 0x7fffffff;
+
+    void set_tape_pulses(const least_u32 *pulses, std::size_t num_of_pulses) {
+        tape_pulses.assign(pulses, pulses + num_of_pulses);
+        next_tape_pulse = 0;
+        tape_pulse_ticks = 0;
+        tape_level = false;
+        tape_paused = true;
+    }
+
+    bool is_tape_paused() const { return tape_paused; }
+    void pause_tape(bool pause) { tape_paused = pause; }
+
+    // The tape is considered stopped as soon as its last pulse
+    // is fetched.
+    bool is_end_of_tape() const {
+        return next_tape_pulse == tape_pulses.size();
+    }
+
+    uint_least64_t get_tape_ticks() const { return tape_ticks; }
+
+    // Tape positions are indexes of pulses to be fetched next.
+    std::size_t get_tape_position() const { return next_tape_pulse; }
+
+    // Makes the tape continue with the specified pulse from the
+    // current tick, e.g., once the blocks before it are loaded
+    // bypassing the pulse emulation.
+    void seek_tape(std::size_t pos) {
+        next_tape_pulse = std::min(pos, tape_pulses.size());
+        tape_pulse_ticks = 0;
+        tape_tick = state.ticks_since_int;
+    }
+
+    // Makes reading from ports with the specified values of the
+    // low address byte call the input callback.
+    void hook_input_ports(fast_u8 port, unsigned num_of_ports, bool hook) {
+        for(unsigned i = 0; i != num_of_ports; ++i)
+            input_hooks[(port + i) & 0xff] = hook;
+    }
+
+public:
+    memory_image_type &on_get_memory() {
+        return state.memory;
+    }
+
+    fast_u8 on_input(fast_u16 addr) {
+        if(playback_active)
+            return get_playback_sample();
+
+        // Only call Python for hooked ports; the keyboard and
+        // the EAR input are handled natively.
+        // TODO: Use the tick when the ear value is sampled
+        //       instead of the tick of the beginning of the input
+        //       cycle.
+        if(!tape_pulses.empty())
+            this->set_ear_level(update_tape_level(this->get_ticks()));
+
+        fast_u8 default_value = base::on_input(addr);
+        if(!on_input_callback || !input_hooks[addr & 0xff])
+            return default_value;
+
+        // Native execution may run with the GIL released, in
+        // which case we have to take it back for the call.
+        PyThreadState *thread_state = released_thread_state;
+        if(thread_state)
+            acquire_gil();
+
+        // Bring the border colour and the screen memory up to
+        // date, so the callback sees them and its writes are not
+        // overridden by replaying the log of frame events.
+        this->flush_frame_events();
+        retrieve_state();
+        fast_u8 n = call_on_input_callback(addr, default_value);
+        install_state();
+
+        // Stop after the state is installed, as installing
+        // resets the events.
+        if(callback_failed)
+            this->stop();
+
+        if(thread_state)
+            release_gil();
+        return n;
+    }
+
+    // Lets other Python threads run while the machine is
+    // executing. Callbacks take the GIL back as necessary.
+    void release_gil() {
+        assert(!released_thread_state);
+        released_thread_state = PyEval_SaveThread();
+    }
+
+    void acquire_gil() {
+        assert(released_thread_state);
+        PyEval_RestoreThread(released_thread_state);
+        released_thread_state = nullptr;
+    }
+
+    bool is_running() const { return running; }
+    void set_running(bool new_running) { running = new_running; }
+
+    // Tells whether a callback raised a Python exception. Unlike
+    // PyErr_Occurred(), this is safe to call without the GIL.
+    bool is_callback_failed() const { return callback_failed; }
+
+private:
+    struct playback_frame {
+        least_u32 num_of_fetches;
+        std::size_t samples_end;
+    };
+
+    std::size_t get_playback_frame_begin() const {
+        return playback_frame_index == 0 ?
+            0 : playback_frames[playback_frame_index - 1].samples_end;
+    }
+
+    void raise_playback_error(playback_error_kind kind) {
+        playback_error_raised = kind;
+        playback_active = false;
+        this->raise_events(playback_error);
+    }
+
+    fast_u8 get_playback_sample() {
+        if(next_playback_sample ==
+               playback_frames[playback_frame_index].samples_end) {
+            raise_playback_error(playback_error_kind::too_few_input_samples);
+            return 0xff;
+        }
+
+        return playback_samples[next_playback_sample++];
+    }
+
+    events_mask handle_end_of_playback_frame(events_mask events) {
+        events &= ~fetches_limit_hit;
+
+        // Some emulators, e.g., SPIN, may store an interrupt
+        // point in the middle of an IX- or IY-prefixed
+        // instruction, so we continue until such instruction,
+        // if any, is completed.
+        if(this->get_iregp_kind() != z80::iregp::hl) {
+            state.fetches_to_stop = 1;
+            return events;
+        }
+
+        if(next_playback_sample !=
+               playback_frames[playback_frame_index].samples_end) {
+            if(spin_playback_quirks) {
+                state.fetches_to_stop = 1;
+                return events;
+            }
+
+            raise_playback_error(playback_error_kind::too_many_input_samples);
+            return events | playback_error;
+        }
+
+        if(++playback_frame_index == playback_frames.size()) {
+            playback_active = false;
+            return events | end_of_playback_chunk;
+        }
+
+        state.fetches_to_stop = playback_frames[playback_frame_index].
+            num_of_fetches;
+        on_handle_active_int();
+        return events;
+    }
+
+    // Flat copies of the machine state as stored by the rewind
+    // buffer.
+    void capture_state_image(rewind_buffer::image_type &image) {
+        const screen_chunks_type &chunks = this->get_screen_chunks();
+        render_state render = this->get_render_state();
+        image.clear();
+
+        for(register_id r : saved_registers) {
+            fast_u16 n = get_register(r);
+            image.push_back(static_cast<least_u8>(n & 0xff));
+            image.push_back(static_cast<least_u8>(n >> 8));
+        }
+
+        append_bytes(image, &state, saved_machine_fields_size);
+        append_bytes(image, &render, sizeof(render));
+        append_bytes(image, state.memory, sizeof(state.memory));
+        append_bytes(image, &chunks, sizeof(chunks));
+    }
+
+    void install_state_image(const rewind_buffer::image_type &image) {
+        const least_u8 *p = image.data();
+        for(register_id r : saved_registers) {
+            set_register(r, zx::make16(p[1], p[0]));
+            p += 2;
+        }
+
+        extract_bytes(p, &state, saved_machine_fields_size);
+
+        render_state render;
+        extract_bytes(p, &render, sizeof(render));
+        this->set_render_state(render);
+
+        extract_bytes(p, state.memory, sizeof(state.memory));
+
+        screen_chunks_type chunks;
+        extract_bytes(p, &chunks, sizeof(chunks));
+        this->set_screen_chunks(chunks);
+
+        assert(p == image.data() + image.size());
+        install_state();
+    }
+
+    static void append_bytes(rewind_buffer::image_type &image,
+                             const void *bytes, std::size_t size) {
+        const least_u8 *p = static_cast<const least_u8*>(bytes);
+        image.insert(image.end(), p, p + size);
+    }
+
+    static void extract_bytes(const least_u8 *&p, void *bytes,
+                              std::size_t size) {
+        std::memcpy(bytes, p, size);
+        p += size;
+    }
+
+    fast_u8 call_on_input_callback(fast_u16 addr, fast_u8 default_value) {
+        if(F::stats)
+            ++this->stats.num_of_callbacks;
+
+        PyObject *arg = Py_BuildValue("(ii)", addr, default_value);
+        decref_guard arg_guard(arg);
+
+        PyObject *result = PyObject_CallObject(on_input_callback, arg);
+        decref_guard result_guard(result);
+
+        if(!result) {
+            callback_failed = true;
+            return default_value;
+        }
+
+        if(!PyLong_Check(result)) {
+            PyErr_SetString(PyExc_TypeError, "returning value must be integer");
+            callback_failed = true;
+            return default_value;
+        }
+
+        return z80::mask8(PyLong_AsUnsignedLong(result));
+    }
+
+    // Plays the tape up to the specified frame tick.
+    bool update_tape_level(ticks_type tick) {
+        while(tape_tick < tick) {
+            if(tape_paused) {
+                tape_tick = tick;
+                break;
+            }
+
+            // See if we already have a non-zero-length pulse.
+            if(tape_pulse_ticks) {
+                ticks_type ticks = std::min(tape_pulse_ticks,
+                                            tick - tape_tick);
+                tape_pulse_ticks -= ticks;
+                tape_tick += ticks;
+                tape_ticks += ticks;
+                continue;
+            }
+
+            // Do nothing, if there are no more pulses available.
+            if(is_end_of_tape()) {
+                tape_level = false;
+                tape_tick = tick;
+                break;
+            }
+
+            least_u32 pulse = tape_pulses[next_tape_pulse++];
+            tape_level = (pulse & tape_pulse_level_mask) != 0;
+            tape_pulse_ticks = pulse & tape_pulse_ticks_mask;
+
+            // Stop right at the last pulse rather than at the end
+            // of the run.
+            if(is_end_of_tape())
+                this->raise_events(end_of_tape);
+        }
+
+        return tape_level;
+    }
+
+    machine_state state;
+    pixels_buffer_type pixels;
+    dirty_lines_type updated_lines = {};
+    PyObject *on_input_callback = nullptr;
+    bool input_hooks[0x100] = {};
+    rewind_buffer rewind;
+    rewind_buffer::image_type rewind_image;
+    unsigned frames_per_rewind_point = 0;
+    unsigned frames_since_rewind_point = 0;
+    std::unique_ptr<zx::profile_type> profile_data;
+    zx::disassembly_cache disasm_cache;
+    frame_sink frames;
+
+    paged_image reference_memory;
+    paged_image reference_screen_chunks;
+    PyThreadState *released_thread_state = nullptr;
+    bool running = false;
+    bool callback_failed = false;
+
+    std::vector<playback_frame> playback_frames;
+    std::vector<least_u8> playback_samples;
+    std::size_t playback_frame_index = 0;
+    std::size_t next_playback_sample = 0;
+    playback_error_kind playback_error_raised = playback_error_kind::none;
+    bool playback_active = false;
+    bool spin_playback_quirks = false;
+
+    std::vector<least_u32> tape_pulses;
+    std::size_t next_tape_pulse = 0;
+    ticks_type tape_pulse_ticks = 0;
+    ticks_type tape_tick = 0;
+    uint_least64_t tape_ticks = 0;
+    bool tape_level = false;
+    bool tape_paused = true;
+};
+
+// The full machine, for debugging.
+typedef basic_machine_emulator<zx::spectrum48_features> machine_emulator;
+
+// The machine without tracing, profiling and statistics, for
+// running machines that need none of them, such as those of
+// batches and those fast-forwarding or converting files.
+// Methods relying on the missing features raise
+// NotImplementedError.
+typedef basic_machine_emulator<zx::fast_spectrum48_features>
+    fast_machine_emulator;
+
+template<typename F>
+constexpr typename basic_machine_emulator<F>::register_id
+    basic_machine_emulator<F>::saved_registers[];
+const std::size_t paged_image::page_size;
+
+// The Python type wrapping emulators of type E.
+template<typename E>
+struct emulator_type {
+    static const char name[];
+    static const char doc[];
+    static const char saved_state_capsule_name[];
+    static PyGetSetDef getsets[];
+    static PyMethodDef methods[];
+    static PyTypeObject type_object;
+};
+
+template<>
+const char emulator_type<machine_emulator>::name[] =
+    "zx._emulatorbase._Spectrum48Base";
+template<>
+const char emulator_type<machine_emulator>::doc[] =
+    "ZX Spectrum 48K Emulator";
+template<>
+const char emulator_type<machine_emulator>::saved_state_capsule_name[] =
+    "zx._emulatorbase.saved_state";
+
+template<>
+const char emulator_type<fast_machine_emulator>::name[] =
+    "zx._emulatorbase._Spectrum48Fast";
+template<>
+const char emulator_type<fast_machine_emulator>::doc[] =
+    "ZX Spectrum 48K Emulator without tracing, profiling and "
+    "statistics";
+template<>
+const char emulator_type<fast_machine_emulator>::saved_state_capsule_name[] =
+    "zx._emulatorbase.fast_saved_state";
+
+template<typename E>
+struct object_instance {
+    PyObject_HEAD
+    E emulator;
+};
+
+template<typename E>
+static inline object_instance<E> *cast_object(PyObject *p) {
+    return reinterpret_cast<object_instance<E>*>(p);
+}
+
+template<typename E>
+static inline E &cast_emulator(PyObject *p) {
+    return cast_object<E>(p)->emulator;
+}
+
+// Raises NotImplementedError for features not compiled into
+// the emulator.
+static bool check_feature(bool enabled, const char *feature) {
+    if(!enabled) {
+        PyErr_Format(PyExc_NotImplementedError,
+                     "%s are not supported by this machine", feature);
+        return false;
+    }
+    return true;
+}
+
+// Once the GIL is released, other threads and input callbacks
+// may attempt to run or modify the same machine. Methods that
+// change the state of the core are rejected till it returns.
+template<typename E>
+static bool check_not_running(const E &emulator) {
+    if(emulator.is_running()) {
+        PyErr_SetString(PyExc_RuntimeError, "machine is running");
+        return false;
+    }
+    return true;
+}
+
+template<typename E>
+PyObject *get_state_view(PyObject *self, PyObject *args) {
+    auto &state = cast_emulator<E>(self).get_machine_state();
+    return PyMemoryView_FromMemory(reinterpret_cast<char*>(&state),
+                                   sizeof(state), PyBUF_WRITE);
+}
+
+template<typename E>
+PyObject *get_trace_view(PyObject *self, PyObject *args) {
+    if(!check_feature(E::features::tracing, "trace records"))
+        return nullptr;
+
+    auto &trace = cast_emulator<E>(self).get_trace_buffer();
+    return PyMemoryView_FromMemory(reinterpret_cast<char*>(&trace),
+                                   sizeof(trace), PyBUF_WRITE);
+}
+
+template<typename E>
+PyObject *get_stats_view(PyObject *self, PyObject *args) {
+    auto &stats = cast_emulator<E>(self).get_stats();
+    return PyMemoryView_FromMemory(reinterpret_cast<char*>(&stats),
+                                   sizeof(stats), PyBUF_WRITE);
+}
+
+template<typename E>
+PyObject *get_audio_samples_view(PyObject *self, PyObject *args) {
+    const auto &samples = cast_emulator<E>(self).get_audio_samples();
+    return PyMemoryView_FromMemory(
+        reinterpret_cast<char*>(const_cast<typename E::audio_sample_type*>(
+            samples)),
+        sizeof(samples), PyBUF_READ);
+}
+
+template<typename E>
+static PyObject *take_audio_samples(PyObject *self, PyObject *args) {
+    auto &emulator = cast_emulator<E>(self);
+    if(!check_not_running(emulator))
+        return nullptr;
+
+    std::size_t num_of_samples = emulator.get_num_of_buffered_audio_samples();
+    PyObject *bytes = PyBytes_FromStringAndSize(
+        nullptr, static_cast<Py_ssize_t>(
+            num_of_samples * sizeof(typename E::audio_sample_type)));
+    if(!bytes)
+        return nullptr;
+
+    emulator.take_audio_samples(
+        reinterpret_cast<typename E::audio_sample_type*>(
+            PyBytes_AS_STRING(bytes)));
+    return bytes;
+}
+
+template<typename E>
+PyObject *render_screen(PyObject *self, PyObject *args) {
+    auto &emulator = cast_emulator<E>(self);
+    if(!check_not_running(emulator))
+        return nullptr;
+
+    emulator.render_screen();
+
+    const auto &screen_chunks = emulator.get_screen_chunks();
+    return PyMemoryView_FromMemory(
+        const_cast<char*>(reinterpret_cast<const char*>(&screen_chunks)),
+        sizeof(screen_chunks), PyBUF_READ);
+}
+
+template<typename E>
+static PyObject *get_frame_pixels(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    auto &pixels = cast_emulator<E>(self).get_frame_pixels();
+    return PyMemoryView_FromMemory(reinterpret_cast<char*>(pixels),
+                                   sizeof(pixels), PyBUF_READ);
+}
+
+template<typename E>
+static PyObject *get_updated_frame_lines(PyObject *self, PyObject *args) {
+    const auto &lines = cast_emulator<E>(self).get_updated_lines();
+    return PyMemoryView_FromMemory(
+        const_cast<char*>(reinterpret_cast<const char*>(&lines)),
+        sizeof(lines), PyBUF_READ);
+}
+
+template<typename E>
+static PyObject *set_palette_color(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    unsigned color, pixel;
+    if(!PyArg_ParseTuple(args, "II", &color, &pixel))
+        return nullptr;
+
+    if(color >= E::num_of_frame_colors) {
+        PyErr_SetString(PyExc_ValueError, "colour index is out of range");
+        return nullptr;
+    }
+
+    cast_emulator<E>(self).set_palette_color(color, pixel);
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *get_memory_marks(PyObject *self, PyObject *args) {
+    const auto &marks = cast_emulator<E>(self).get_memory_marks();
+    return PyMemoryView_FromMemory(
+        const_cast<char*>(reinterpret_cast<const char*>(&marks)),
+        sizeof(marks), PyBUF_READ);
+}
+
+static bool check_memory_block(unsigned addr, unsigned size) {
+    if(addr > zx::memory_image_size || size > zx::memory_image_size - addr) {
+        PyErr_SetString(PyExc_ValueError,
+                        "memory block is out of the address space");
+        return false;
+    }
+    return true;
+}
+
+template<typename E>
+static PyObject *compress_z80_block_from_memory(PyObject *self,
+                                                PyObject *args) {
+    unsigned addr, size;
+    if(!PyArg_ParseTuple(args, "II", &addr, &size))
+        return nullptr;
+
+    if(!check_memory_block(addr, size))
+        return nullptr;
+
+    const auto &memory = cast_emulator<E>(self).on_get_memory();
+    std::vector<least_u8> compressed;
+    compress_z80_block(&memory[addr], size, compressed);
+    return PyBytes_FromStringAndSize(
+        reinterpret_cast<const char*>(compressed.data()),
+        static_cast<Py_ssize_t>(compressed.size()));
+}
+
+template<typename E>
+static PyObject *mark_addrs(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    if(!check_feature(E::features::marks, "memory marks"))
+        return nullptr;
+
+    unsigned addr, size, marks;
+    if(!PyArg_ParseTuple(args, "III", &addr, &size, &marks))
+        return nullptr;
+
+    cast_emulator<E>(self).mark_addrs(addr, size, marks);
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *unmark_addrs(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    if(!check_feature(E::features::marks, "memory marks"))
+        return nullptr;
+
+    unsigned addr, size, marks;
+    if(!PyArg_ParseTuple(args, "III", &addr, &size, &marks))
+        return nullptr;
+
+    cast_emulator<E>(self).unmark_addrs(addr, size, marks);
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *get_watchpoint(PyObject *self, PyObject *args) {
+    if(!check_feature(E::features::marks, "watchpoints"))
+        return nullptr;
+
+    const auto &emulator = cast_emulator<E>(self);
+    return Py_BuildValue("(II)",
+                         static_cast<unsigned>(emulator.get_watchpoint_addr()),
+                         static_cast<unsigned>(emulator.get_watchpoint_kind()));
+}
+
+template<typename E>
+static PyObject *set_tape_pulses(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    Py_buffer buffer;
+    if(!PyArg_ParseTuple(args, "y*", &buffer))
+        return nullptr;
+
+    if(buffer.len % sizeof(least_u32) != 0) {
+        PyBuffer_Release(&buffer);
+        PyErr_SetString(PyExc_ValueError,
+                        "tape pulses shall be 32-bit values");
+        return nullptr;
+    }
+
+    cast_emulator<E>(self).set_tape_pulses(
+        static_cast<const least_u32*>(buffer.buf),
+        static_cast<std::size_t>(buffer.len) / sizeof(least_u32));
+    PyBuffer_Release(&buffer);
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *pause_tape(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    int pause;
+    if(!PyArg_ParseTuple(args, "p", &pause))
+        return nullptr;
+
+    cast_emulator<E>(self).pause_tape(pause);
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *is_tape_paused(PyObject *self, PyObject *args) {
+    return PyBool_FromLong(cast_emulator<E>(self).is_tape_paused());
+}
+
+template<typename E>
+static PyObject *is_end_of_tape(PyObject *self, PyObject *args) {
+    return PyBool_FromLong(cast_emulator<E>(self).is_end_of_tape());
+}
+
+template<typename E>
+static PyObject *get_tape_ticks(PyObject *self, PyObject *args) {
+    return PyLong_FromUnsignedLongLong(cast_emulator<E>(self).get_tape_ticks());
+}
+
+template<typename E>
+static PyObject *get_tape_position(PyObject *self, PyObject *args) {
+    return PyLong_FromSize_t(cast_emulator<E>(self).get_tape_position());
+}
+
+template<typename E>
+static PyObject *seek_tape(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    Py_ssize_t pos;
+    if(!PyArg_ParseTuple(args, "n", &pos))
+        return nullptr;
+
+    if(pos < 0) {
+        PyErr_SetString(PyExc_ValueError, "tape position cannot be negative");
+        return nullptr;
+    }
+
+    cast_emulator<E>(self).seek_tape(static_cast<std::size_t>(pos));
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *hook_input_ports(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    unsigned port, num_of_ports;
+    int hook;
+    if(!PyArg_ParseTuple(args, "IIp", &port, &num_of_ports, &hook))
+        return nullptr;
+
+    cast_emulator<E>(self).hook_input_ports(static_cast<fast_u8>(port & 0xff),
+                                         num_of_ports, hook);
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *set_on_input_callback(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    PyObject *new_callback;
+    if(!PyArg_ParseTuple(args, "O:set_callback", &new_callback))
+        return nullptr;
+
+    if(!PyCallable_Check(new_callback)) {
+        PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+        return nullptr;
+    }
+
+    auto &emulator = cast_emulator<E>(self);
+    PyObject *old_callback = emulator.set_on_input_callback(new_callback);
+    Py_XINCREF(new_callback);
+    Py_XDECREF(old_callback);
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+class gil_release_guard {
+public:
+    gil_release_guard(E &emulator)
+        : emulator(emulator) {
+        emulator.set_running(true);
+        emulator.release_gil();
+    }
+
+    ~gil_release_guard() {
+        emulator.acquire_gil();
+        emulator.set_running(false);
+    }
+
+private:
+    E &emulator;
+};
+
+template<typename E>
+static void delete_saved_state(PyObject *capsule) {
+    delete static_cast<typename E::saved_state*>(
+        PyCapsule_GetPointer(capsule, emulator_type<E>::saved_state_capsule_name));
+}
+
+template<typename E>
+static PyObject *save_state(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    auto *saved = cast_emulator<E>(self).save_state();
+    PyObject *capsule = PyCapsule_New(saved, emulator_type<E>::saved_state_capsule_name,
+                                      delete_saved_state<E>);
+    if(!capsule)
+        delete saved;
+    return capsule;
+}
+
+template<typename E>
+static PyObject *load_state(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    PyObject *capsule;
+    if(!PyArg_ParseTuple(args, "O", &capsule))
+        return nullptr;
+
+    auto *saved = static_cast<typename E::saved_state*>(
+        PyCapsule_GetPointer(capsule, emulator_type<E>::saved_state_capsule_name));
+    if(!saved)
+        return nullptr;
+
+    cast_emulator<E>(self).load_state(*saved);
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *set_playback_chunk(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    Py_buffer frames, samples;
+    if(!PyArg_ParseTuple(args, "y*y*", &frames, &samples))
+        return nullptr;
+
+    bool loaded = false;
+    if(frames.len % (sizeof(least_u32) * 2) == 0) {
+        loaded = cast_emulator<E>(self).set_playback_chunk(
+            static_cast<const least_u32*>(frames.buf),
+            static_cast<std::size_t>(frames.len) / (sizeof(least_u32) * 2),
+            static_cast<const least_u8*>(samples.buf),
+            static_cast<std::size_t>(samples.len));
+    }
+
+    PyBuffer_Release(&frames);
+    PyBuffer_Release(&samples);
+
+    if(!loaded) {
+        PyErr_SetString(PyExc_ValueError,
+                        "playback frames shall be non-empty sequence of "
+                        "pairs of 32-bit values matching the samples");
+        return nullptr;
+    }
+
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *stop_playback(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    cast_emulator<E>(self).stop_playback();
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *is_playback_active(PyObject *self, PyObject *args) {
+    return PyBool_FromLong(cast_emulator<E>(self).is_playback_active());
+}
+
+template<typename E>
+static PyObject *set_spin_playback_quirks(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    int enable;
+    if(!PyArg_ParseTuple(args, "p", &enable))
+        return nullptr;
+
+    cast_emulator<E>(self).set_spin_playback_quirks(enable);
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *get_playback_error(PyObject *self, PyObject *args) {
+    using kind = typename E::playback_error_kind;
+    switch(cast_emulator<E>(self).get_playback_error()) {
+    case kind::none:
+        Py_RETURN_NONE;
+    case kind::too_few_input_samples:
+        return PyUnicode_FromString("too_few_input_samples");
+    case kind::too_many_input_samples:
+        return PyUnicode_FromString("too_many_input_samples");
+    }
+    unreachable("Unknown playback error.");
+}
+
+template<typename E>
+static PyObject *get_playback_position(PyObject *self, PyObject *args) {
+    auto pos = cast_emulator<E>(self).get_playback_position();
+    return Py_BuildValue("(nnnn)",
+                         static_cast<Py_ssize_t>(pos.frame_index),
+                         static_cast<Py_ssize_t>(pos.num_of_frames),
+                         static_cast<Py_ssize_t>(pos.sample_index),
+                         static_cast<Py_ssize_t>(pos.num_of_samples));
+}
+
+template<typename E>
+static PyObject *set_rewind_buffer(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    Py_ssize_t max_num_of_points;
+    unsigned frames_per_point, points_per_keyframe;
+    if(!PyArg_ParseTuple(args, "nII", &max_num_of_points, &frames_per_point,
+                         &points_per_keyframe))
+        return nullptr;
+
+    if(max_num_of_points < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "number of rewind points cannot be negative");
+        return nullptr;
+    }
+
+    cast_emulator<E>(self).set_rewind_buffer(
+        static_cast<std::size_t>(max_num_of_points), frames_per_point,
+        points_per_keyframe);
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *get_num_of_rewind_points(PyObject *self, PyObject *args) {
+    return PyLong_FromSize_t(cast_emulator<E>(self).get_num_of_rewind_points());
+}
+
+template<typename E>
+static PyObject *rewind_points(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    Py_ssize_t num_of_points;
+    if(!PyArg_ParseTuple(args, "n", &num_of_points))
+        return nullptr;
+
+    if(num_of_points < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "number of rewind points cannot be negative");
+        return nullptr;
+    }
+
+    bool rewound = cast_emulator<E>(self).rewind_points(
+        static_cast<std::size_t>(num_of_points));
+    return PyBool_FromLong(rewound);
+}
+
+template<typename E>
+static PyObject *enable_profiling(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    if(!check_feature(E::features::profiling, "profiles"))
+        return nullptr;
+
+    int call_graph;
+    if(!PyArg_ParseTuple(args, "p", &call_graph))
+        return nullptr;
+
+    cast_emulator<E>(self).enable_profiling(call_graph != 0);
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *disable_profiling(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    cast_emulator<E>(self).disable_profiling();
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *get_profile_counters_view(
+        PyObject *self, uint_least64_t (zx::profile_type::*counters)[
+                                zx::memory_image_size]) {
+    zx::profile_type *profile = cast_emulator<E>(self).get_profile();
+    if(!profile)
+        Py_RETURN_NONE;
+
+    return PyMemoryView_FromMemory(
+        reinterpret_cast<char*>(&(profile->*counters)),
+        sizeof(profile->*counters), PyBUF_READ);
+}
+
+template<typename E>
+static PyObject *get_profile_instr_counts_view(PyObject *self,
+                                               PyObject *args) {
+    return get_profile_counters_view<E>(self, &zx::profile_type::instr_counts);
+}
+
+template<typename E>
+static PyObject *get_profile_instr_ticks_view(PyObject *self,
+                                              PyObject *args) {
+    return get_profile_counters_view<E>(self, &zx::profile_type::instr_ticks);
+}
+
+template<typename E>
+static PyObject *get_profile_call_graph(PyObject *self, PyObject *args) {
+    zx::profile_type *profile = cast_emulator<E>(self).get_profile();
+    if(!profile)
+        Py_RETURN_NONE;
+
+    // Account the calls that have not returned yet.
+    std::unordered_map<uint_least32_t, zx::call_graph_edge> edges =
+        profile->call_graph;
+    for(const zx::profile_type::call_frame &frame : profile->call_stack)
+        edges[frame.edge_key].num_of_ticks +=
+            profile->num_of_ticks - frame.begin_tick;
+
+    PyObject *list = PyList_New(0);
+    if(!list)
+        return nullptr;
+
+    for(const auto &edge : edges) {
+        PyObject *item = Py_BuildValue(
+            "(IIKK)", static_cast<unsigned>(edge.first >> 16),
+            static_cast<unsigned>(edge.first & 0xffff),
+            static_cast<unsigned long long>(edge.second.num_of_calls),
+            static_cast<unsigned long long>(edge.second.num_of_ticks));
+        if(!item || PyList_Append(list, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return nullptr;
+        }
+        Py_DECREF(item);
+    }
+
+    return list;
+}
+
+// Appends an (address, size, text) tuple to a list of
+// disassembled instructions.
+static bool append_instr(PyObject *list, fast_u16 addr,
+                         const zx::disassembled_instr &instr) {
+    PyObject *item = Py_BuildValue("(IIs)", static_cast<unsigned>(addr),
+                                   instr.size, instr.text);
+    if(!item || PyList_Append(list, item) < 0) {
+        Py_XDECREF(item);
+        return false;
+    }
+    Py_DECREF(item);
+    return true;
+}
+
+template<typename E>
+static PyObject *disassemble_range(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    unsigned addr, size;
+    if(!PyArg_ParseTuple(args, "II", &addr, &size))
+        return nullptr;
+
+    if(!check_memory_block(addr, size))
+        return nullptr;
+
+    PyObject *list = PyList_New(0);
+    if(!list)
+        return nullptr;
+
+    auto &emulator = cast_emulator<E>(self);
+    for(unsigned offset = 0; offset < size;) {
+        fast_u16 instr_addr = z80::mask16(addr + offset);
+        const zx::disassembled_instr &instr =
+            emulator.disassemble(instr_addr);
+        if(!append_instr(list, instr_addr, instr)) {
+            Py_DECREF(list);
+            return nullptr;
+        }
+        offset += instr.size;
+    }
+
+    return list;
+}
+
+template<typename E>
+static PyObject *disassemble_visited_instrs(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    if(!check_feature(E::features::marks, "visited instruction marks"))
+        return nullptr;
+
+    PyObject *list = PyList_New(0);
+    if(!list)
+        return nullptr;
+
+    auto &emulator = cast_emulator<E>(self);
+    const auto &marks = emulator.get_memory_marks();
+    for(unsigned addr = 0; addr != zx::memory_image_size; ++addr) {
+        if(!(marks[addr] & zx::visited_instr_mark))
+            continue;
+
+        fast_u16 instr_addr = static_cast<fast_u16>(addr);
+        if(!append_instr(list, instr_addr, emulator.disassemble(instr_addr))) {
+            Py_DECREF(list);
+            return nullptr;
+        }
+    }
+
+    return list;
+}
+
+template<typename E>
+static PyObject *set_frame_sink(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    int fd;
+    unsigned format;
+    int skip_identical_frames;
+    if(!PyArg_ParseTuple(args, "iIp", &fd, &format, &skip_identical_frames))
+        return nullptr;
+
+    if(format > static_cast<unsigned>(frame_sink::format::indexed)) {
+        PyErr_SetString(PyExc_ValueError, "unknown frame format");
+        return nullptr;
+    }
+
+    // Y4M streams are played at a fixed frame rate, so dropping
+    // frames would speed up the video.
+    if(skip_identical_frames &&
+           format == static_cast<unsigned>(frame_sink::format::y4m)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "identical frames cannot be skipped in y4m streams");
+        return nullptr;
+    }
+
+    auto &sink = cast_emulator<E>(self).get_frame_sink();
+    if(fd < 0)
+        sink.stop();
+    else
+        sink.start(fd, static_cast<frame_sink::format>(format),
+                   skip_identical_frames != 0);
+    Py_RETURN_NONE;
+}
 
-    zx::memory_image_type memory;
-};
+// Raises OSError if streaming of frames failed.
+template<typename E>
+static bool check_frame_sink_error(E &emulator) {
+    int error = emulator.get_frame_sink().take_error();
+    if(!error)
+        return true;
 
-class machine_emulator : public zx::spectrum48<machine_emulator> {
-public:
-    typedef zx::spectrum48<machine_emulator> base;
+    errno = error;
+    PyErr_SetFromErrno(PyExc_OSError);
+    return false;
+}
 
-    machine_emulator() {
-        retrieve_state();
-    }
+template<typename E>
+PyObject *run(PyObject *self, PyObject *args) {
+    auto &emulator = cast_emulator<E>(self);
+    if(!check_not_running(emulator))
+        return nullptr;
 
-    machine_state &get_machine_state() {
-        return state;
+    events_mask events;
+    {
+        gil_release_guard<E> guard(emulator);
+        events = emulator.run();
     }
+    if(PyErr_Occurred() || !check_frame_sink_error(emulator))
+        return nullptr;
+    return Py_BuildValue("i", events);
+}
 
-    void retrieve_state() {
-        state.proc = get_processor_state();
+template<typename E>
+PyObject *run_frames(PyObject *self, PyObject *args) {
+    unsigned num_of_frames, rendering;
+    if(!PyArg_ParseTuple(args, "II", &num_of_frames, &rendering))
+        return nullptr;
 
-        state.ticks_since_int = ticks_since_int;
-        state.fetches_to_stop = fetches_to_stop;
-        state.events = events;
-        state.int_suppressed = int_suppressed;
-        state.int_after_ei_allowed = int_after_ei_allowed;
-        state.border_color = border_color;
-        state.trace_enabled = trace_enabled;
+    if(rendering > static_cast<unsigned>(
+            E::frame_rendering::every)) {
+        PyErr_SetString(PyExc_ValueError, "unknown rendering mode");
+        return nullptr;
     }
 
-    void install_state() {
-        set_processor_state(state.proc);
+    unsigned num_of_frames_run;
+    auto &emulator = cast_emulator<E>(self);
+    if(!check_not_running(emulator))
+        return nullptr;
 
-        ticks_since_int = state.ticks_since_int;
-        fetches_to_stop = state.fetches_to_stop;
-        events = state.events;
-        int_suppressed = state.int_suppressed;
-        int_after_ei_allowed = state.int_after_ei_allowed;
-        border_color = state.border_color;
-        trace_enabled = state.trace_enabled;
+    events_mask events;
+    {
+        gil_release_guard<E> guard(emulator);
+        events = emulator.run_frames(
+            num_of_frames,
+            static_cast<typename E::frame_rendering>(rendering),
+            num_of_frames_run);
     }
+    if(PyErr_Occurred() || !check_frame_sink_error(emulator))
+        return nullptr;
+    return Py_BuildValue("(iI)", events, num_of_frames_run);
+}
 
-    pixels_buffer_type &get_frame_pixels() {
-        base::get_frame_pixels(pixels);
-        return pixels;
+template<typename E>
+static PyObject *set_render_mode(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    unsigned mode;
+    if(!PyArg_ParseTuple(args, "I", &mode))
+        return nullptr;
+
+    if(mode > static_cast<unsigned>(E::render_mode::full)) {
+        PyErr_SetString(PyExc_ValueError, "unknown render mode");
+        return nullptr;
     }
 
-    events_mask run() {
-        install_state();
-        events_mask events = base::run();
-        retrieve_state();
-        return events;
+    cast_emulator<E>(self).set_render_mode(
+        static_cast<typename E::render_mode>(mode));
+    Py_RETURN_NONE;
+}
+
+template<typename E>
+static PyObject *get_render_mode(PyObject *self, PyObject *args) {
+    return PyLong_FromUnsignedLong(
+        static_cast<unsigned>(cast_emulator<E>(self).get_render_mode()));
+}
+
+template<typename E>
+PyObject *on_handle_active_int(PyObject *self, PyObject *args) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return nullptr;
+
+    bool int_initiated = cast_emulator<E>(self).on_handle_active_int();
+    return PyBool_FromLong(int_initiated);
+}
+
+static const char *const iregp_kind_names[] = { "hl", "ix", "iy" };
+
+template<typename E>
+static typename E::register_id get_register_id(void *closure) {
+    return static_cast<typename E::register_id>(
+        reinterpret_cast<std::intptr_t>(closure));
+}
+
+template<typename E>
+PyObject *get_register(PyObject *self, void *closure) {
+    auto r = get_register_id<E>(closure);
+    fast_u16 n = cast_emulator<E>(self).get_register(r);
+
+    switch(r) {
+    case E::register_id::iff1:
+    case E::register_id::iff2:
+        return PyBool_FromLong(n);
+    case E::register_id::iregp_kind:
+        return PyUnicode_FromString(iregp_kind_names[n]);
+    default:
+        return PyLong_FromUnsignedLong(n);
     }
+}
 
-    bool on_handle_active_int() {
-        install_state();
-        bool int_initiated = base::on_handle_active_int();
-        retrieve_state();
-        return int_initiated;
+template<typename E>
+int set_register(PyObject *self, PyObject *value, void *closure) {
+    if(!check_not_running(cast_emulator<E>(self)))
+        return -1;
+
+    if(!value) {
+        PyErr_SetString(PyExc_TypeError, "cannot delete registers");
+        return -1;
     }
 
-    PyObject *set_on_input_callback(PyObject *callback) {
-        PyObject *old_callback = on_input_callback;
-        on_input_callback = callback;
-        return old_callback;
+    auto r = get_register_id<E>(closure);
+    fast_u16 n;
+    if(r == E::register_id::iregp_kind) {
+        const char *kind = PyUnicode_Check(value) ?
+            PyUnicode_AsUTF8(value) : nullptr;
+        fast_u16 i = 0;
+        while(kind && i != 3 && std::strcmp(kind, iregp_kind_names[i]) != 0)
+            ++i;
+        if(!kind || i == 3) {
+            PyErr_SetString(PyExc_ValueError,
+                            "index register kind shall be 'hl', 'ix' or 'iy'");
+            return -1;
+        }
+        n = i;
+    } else {
+        // Booleans are integers, so they are handled as well.
+        if(PyLong_Check(value)) {
+            n = z80::mask16(PyLong_AsUnsignedLongMask(value));
+        } else {
+            PyErr_SetString(PyExc_TypeError, "register value must be integer");
+            return -1;
+        }
     }
 
-protected:
-    Spectrum48::processor_state get_processor_state() {
-        Spectrum48::processor_state state;
+    cast_emulator<E>(self).set_register(r, n);
+    return 0;
+}
+
+#define REGISTER_ATTR(name, setter, doc) \
+    {const_cast<char*>(#name), get_register<E>, setter, const_cast<char*>(doc), \
+     reinterpret_cast<void*>(static_cast<std::intptr_t>( \
+         E::register_id::name))}
+
+template<typename E>
+PyGetSetDef emulator_type<E>::getsets[] = {
+    REGISTER_ATTR(bc, set_register<E>, "BC register pair."),
+    REGISTER_ATTR(de, set_register<E>, "DE register pair."),
+    REGISTER_ATTR(hl, set_register<E>, "HL register pair."),
+    REGISTER_ATTR(af, set_register<E>, "AF register pair."),
+    REGISTER_ATTR(ix, set_register<E>, "IX register."),
+    REGISTER_ATTR(iy, set_register<E>, "IY register."),
+    REGISTER_ATTR(alt_bc, set_register<E>, "Alternative BC register pair."),
+    REGISTER_ATTR(alt_de, set_register<E>, "Alternative DE register pair."),
+    REGISTER_ATTR(alt_hl, set_register<E>, "Alternative HL register pair."),
+    REGISTER_ATTR(alt_af, set_register<E>, "Alternative AF register pair."),
+    REGISTER_ATTR(pc, set_register<E>, "Program counter."),
+    REGISTER_ATTR(sp, set_register<E>, "Stack pointer."),
+    REGISTER_ATTR(ir, set_register<E>, "IR register pair."),
+    REGISTER_ATTR(wz, set_register<E>, "Internal WZ register, aka MEMPTR."),
+    REGISTER_ATTR(a, nullptr, "A register."),
+    REGISTER_ATTR(f, nullptr, "F register."),
+    REGISTER_ATTR(alt_a, nullptr, "Alternative A register."),
+    REGISTER_ATTR(alt_f, nullptr, "Alternative F register."),
+    REGISTER_ATTR(i, nullptr, "I register."),
+    REGISTER_ATTR(r, nullptr, "R register."),
+    REGISTER_ATTR(iff1, set_register<E>, "IFF1 interrupt flip-flop."),
+    REGISTER_ATTR(iff2, set_register<E>, "IFF2 interrupt flip-flop."),
+    REGISTER_ATTR(int_mode, set_register<E>, "Interrupt mode."),
+    REGISTER_ATTR(iregp_kind, set_register<E>,
+                  "Index register the current instruction uses: 'hl', "
+                  "'ix' or 'iy'."),
+    { nullptr }  // Sentinel.
+};
 
-        state.bc = get_bc();
-        state.de = get_de();
-        state.hl = get_hl();
-        state.af = get_af();
-        state.ix = get_ix();
-        state.iy = get_iy();
+#undef REGISTER_ATTR
+
+template<typename E>
+PyMethodDef emulator_type<E>::methods[] = {
+    {"_get_state_view", get_state_view<E>, METH_NOARGS,
+     "Return a MemoryView object that exposes the internal state of the "
+     "emulated machine."},
+    {"_get_trace_view", get_trace_view<E>, METH_NOARGS,
+     "Return a MemoryView object that exposes the ring buffer of trace "
+     "records."},
+    {"_get_audio_samples_view", get_audio_samples_view<E>, METH_NOARGS,
+     "Return a MemoryView object that exposes 16-bit signed beeper "
+     "samples of the last completed frame."},
+    {"_take_audio_samples", take_audio_samples<E>, METH_NOARGS,
+     "Return a bytes object of 16-bit signed beeper samples of the "
+     "frames completed since the last call, oldest first."},
+    {"_get_stats_view", get_stats_view<E>, METH_NOARGS,
+     "Return a MemoryView object that exposes the 64-bit statistics "
+     "counters of the emulated machine."},
+    {"render_screen", render_screen<E>, METH_NOARGS,
+     "Render current screen frame and return a MemoryView object that exposes "
+     "a buffer that contains rendered data."},
+    {"get_frame_pixels", get_frame_pixels<E>, METH_NOARGS,
+     "Convert rendered frame into an internally allocated array of RGB24 pixels "
+     "and return a MemoryView object that exposes that array."},
+    {"get_updated_frame_lines", get_updated_frame_lines<E>, METH_NOARGS,
+     "Return a MemoryView object that exposes an array of flags, one per "
+     "frame line, where non-zero elements correspond to lines updated by "
+     "the last call to get_frame_pixels()."},
+    {"set_palette_color", set_palette_color<E>, METH_VARARGS,
+     "Set the RGB24 value that frame pixels of the specified brightness:grb "
+     "colour are converted to."},
+    {"compress_z80_block", compress_z80_block_from_memory<E>, METH_VARARGS,
+     "Return the memory block at the specified address compressed "
+     "the way memory blocks of .z80 snapshots are."},
+    {"mark_addrs", mark_addrs<E>, METH_VARARGS,
+     "Mark a range of memory bytes as ones that require custom "
+     "processing on reading, writing or executing them."},
+    {"unmark_addrs", unmark_addrs<E>, METH_VARARGS,
+     "Remove the specified marks from a range of memory bytes."},
+    {"get_watchpoint", get_watchpoint<E>, METH_NOARGS,
+     "Return the address and the watch mark of the last triggered "
+     "watchpoint."},
+    {"get_memory_marks", get_memory_marks<E>, METH_NOARGS,
+     "Return a MemoryView object that exposes marks of memory bytes."},
+    {"set_on_input_callback", set_on_input_callback<E>, METH_VARARGS,
+     "Set a callback function handling reading from ports. The callback "
+     "is given the port address and the value the machine would read "
+     "on its own."},
+    {"hook_input_ports", hook_input_ports<E>, METH_VARARGS,
+     "Make reading from ports with the specified range of low address "
+     "byte values call the input callback."},
+    {"set_tape_pulses", set_tape_pulses<E>, METH_VARARGS,
+     "Load a tape as a bytes-like object of 32-bit pulses, where the "
+     "lower 31 bits give the duration in ticks and the most "
+     "significant bit gives the EAR level. The tape is paused."},
+    {"pause_tape", pause_tape<E>, METH_VARARGS,
+     "Pause or unpause the tape."},
+    {"is_tape_paused", is_tape_paused<E>, METH_NOARGS,
+     "Return whether the tape is paused."},
+    {"is_end_of_tape", is_end_of_tape<E>, METH_NOARGS,
+     "Return whether all the tape pulses have been fetched."},
+    {"get_tape_ticks", get_tape_ticks<E>, METH_NOARGS,
+     "Return the number of ticks the tape has been played for."},
+    {"get_tape_position", get_tape_position<E>, METH_NOARGS,
+     "Return the index of the next tape pulse to play."},
+    {"seek_tape", seek_tape<E>, METH_VARARGS,
+     "Continue playing the tape from the pulse with the specified "
+     "index."},
+    {"save_state", save_state<E>, METH_NOARGS,
+     "Capture the state of the machine into an opaque object. Unchanged "
+     "memory pages are shared with previously saved and loaded states."},
+    {"load_state", load_state<E>, METH_VARARGS,
+     "Restore a state captured with save_state()."},
+    {"set_playback_chunk", set_playback_chunk<E>, METH_VARARGS,
+     "Load a chunk of input recording as a bytes-like object of pairs "
+     "of 32-bit numbers of fetches and input samples per frame and a "
+     "bytes-like object of the samples."},
+    {"stop_playback", stop_playback<E>, METH_NOARGS,
+     "Discard the loaded input recording."},
+    {"is_playback_active", is_playback_active<E>, METH_NOARGS,
+     "Return whether input samples are served from a recording."},
+    {"set_spin_playback_quirks", set_spin_playback_quirks<E>, METH_VARARGS,
+     "Enable or disable handling of recordings made with SPIN v0.5."},
+    {"get_playback_error", get_playback_error<E>, METH_NOARGS,
+     "Return the identifier of the last playback error or None."},
+    {"get_playback_position", get_playback_position<E>, METH_NOARGS,
+     "Return the index of the current frame, the number of frames in "
+     "the chunk, the number of samples used in the frame and the "
+     "number of samples in the frame."},
+    {"set_rewind_buffer", set_rewind_buffer<E>, METH_VARARGS,
+     "Record up to the specified number of rewind points, one every "
+     "given number of frames, keeping every given number of points as "
+     "a full state and the rest as deltas. Zero number of points "
+     "disables rewinding."},
+    {"get_num_of_rewind_points", get_num_of_rewind_points<E>, METH_NOARGS,
+     "Return the number of recorded rewind points."},
+    {"rewind_points", rewind_points<E>, METH_VARARGS,
+     "Discard the specified number of most recent rewind points and "
+     "restore the one preceding them, or the oldest one. Return False "
+     "if there are no points to restore."},
+    {"_enable_profiling", enable_profiling<E>, METH_VARARGS,
+     "Start collecting a new execution profile, optionally with a "
+     "call graph."},
+    {"disable_profiling", disable_profiling<E>, METH_NOARGS,
+     "Stop profiling and discard the collected profile."},
+    {"_get_profile_instr_counts_view", get_profile_instr_counts_view<E>,
+     METH_NOARGS,
+     "Return a MemoryView object that exposes 64-bit execution counts "
+     "for every instruction address, or None if profiling is disabled."},
+    {"_get_profile_instr_ticks_view", get_profile_instr_ticks_view<E>,
+     METH_NOARGS,
+     "Return a MemoryView object that exposes 64-bit numbers of ticks, "
+     "including contention delays, spent at every instruction address, "
+     "or None if profiling is disabled."},
+    {"get_profile_call_graph", get_profile_call_graph<E>, METH_NOARGS,
+     "Return a list of (caller, callee, number of calls, ticks in callee) "
+     "tuples, or None if profiling is disabled."},
+    {"disassemble_range", disassemble_range<E>, METH_VARARGS,
+     "Disassemble instructions starting at the specified address "
+     "and covering the specified number of bytes. Return a list of "
+     "(address, size, text) tuples. Decoded instructions are cached "
+     "until their bytes change."},
+    {"disassemble_visited_instrs", disassemble_visited_instrs<E>,
+     METH_NOARGS,
+     "Disassemble every instruction marked as visited and return a "
+     "list of (address, size, text) tuples."},
+    {"set_frame_sink", set_frame_sink<E>, METH_VARARGS,
+     "Stream every completed frame to the specified file descriptor as "
+     "raw RGB24 pixels (0), Y4M (1) or screen chunks of 4-bit palette "
+     "indexes (2), optionally skipping frames identical to the last "
+     "written one. A negative descriptor stops streaming."},
+    {"run", run<E>, METH_NOARGS,
+     "Run emulator until one or several events are signaled."},
+    {"set_render_mode", set_render_mode<E>, METH_VARARGS,
+     "Set whether rendering is off (0), only caught up before changes "
+     "to the screen memory and the border (1), or caught up on every "
+     "memory and border write (2)."},
+    {"get_render_mode", get_render_mode<E>, METH_NOARGS,
+     "Return the current render mode."},
+    {"run_frames", run_frames<E>, METH_VARARGS,
+     "Run the specified number of frames, stopping early on events other "
+     "than the end of frame, and return the raised events and the number "
+     "of complete frames. The second argument tells whether to render "
+     "no frames (0), the last frame (1) or every frame (2)."},
+    {"on_handle_active_int", on_handle_active_int<E>, METH_NOARGS,
+     "Attempts to initiate a masked interrupt."},
+    { nullptr }  // Sentinel.
+};
 
-        state.alt_bc = get_alt_bc();
-        state.alt_de = get_alt_de();
-        state.alt_hl = get_alt_hl();
-        state.alt_af = get_alt_af();
+template<typename E>
+PyObject *object_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    if(!PyArg_ParseTuple(args, ":__new__"))
+        return nullptr;
 
-        state.pc = get_pc();
-        state.sp = get_sp();
-        state.ir = get_ir();
-        state.wz = get_wz();
+    auto *self = cast_object<E>(type->tp_alloc(type, /* nitems= */ 0));
+    if(!self)
+      return nullptr;
 
-        state.iff1 = get_iff1() ? 1 : 0;
-        state.iff2 = get_iff2() ? 1 : 0;
-        state.int_mode = get_int_mode();
-        state.index_rp_kind = static_cast<least_u8>(get_iregp_kind());
+    auto &emulator = self->emulator;
+    ::new(&emulator) E();
+    return &self->ob_base;
+}
 
-        return state;
-    }
+template<typename E>
+void object_dealloc(PyObject *self) {
+    auto &object = *cast_object<E>(self);
+    object.emulator.~E();
+    Py_TYPE(self)->tp_free(self);
+}
 
-    void set_processor_state(const Spectrum48::processor_state &state) {
-        set_bc(state.bc);
-        set_de(state.de);
-        set_hl(state.hl);
-        set_af(state.af);
-        set_ix(state.ix);
-        set_iy(state.iy);
+template<typename E>
+PyTypeObject emulator_type<E>::type_object = {
+    PyVarObject_HEAD_INIT(&PyType_Type, 0)
+    name,                       // tp_name
+    sizeof(object_instance<E>),    // tp_basicsize
+    0,                          // tp_itemsize
+    object_dealloc<E>,          // tp_dealloc
+    0,                          // tp_print
+    0,                          // tp_getattr
+    0,                          // tp_setattr
+    0,                          // tp_reserved
+    0,                          // tp_repr
+    0,                          // tp_as_number
+    0,                          // tp_as_sequence
+    0,                          // tp_as_mapping
+    0,                          // tp_hash
+    0,                          // tp_call
+    0,                          // tp_str
+    0,                          // tp_getattro
+    0,                          // tp_setattro
+    0,                          // tp_as_buffer
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+                                // tp_flags
+    doc,                        // tp_doc
+    0,                          // tp_traverse
+    0,                          // tp_clear
+    0,                          // tp_richcompare
+    0,                          // tp_weaklistoffset
+    0,                          // tp_iter
+    0,                          // tp_iternext
+    methods,                    // tp_methods
+    nullptr,                    // tp_members
+    getsets,                    // tp_getset
+    0,                          // tp_base
+    0,                          // tp_dict
+    0,                          // tp_descr_get
+    0,                          // tp_descr_set
+    0,                          // tp_dictoffset
+    0,                          // tp_init
+    0,                          // tp_alloc
+    object_new<E>,              // tp_new
+    0,                          // tp_free
+    0,                          // tp_is_gc
+    0,                          // tp_bases
+    0,                          // tp_mro
+    0,                          // tp_cache
+    0,                          // tp_subclasses
+    0,                          // tp_weaklist
+    0,                          // tp_del
+    0,                          // tp_version_tag
+    0,                          // tp_finalize
+};
 
-        set_alt_bc(state.alt_bc);
-        set_alt_de(state.alt_de);
-        set_alt_hl(state.alt_hl);
-        set_alt_af(state.alt_af);
+}  // namespace Spectrum48
 
-        set_pc(state.pc);
-        set_sp(state.sp);
-        set_ir(state.ir);
-        set_wz(state.wz);
+namespace Spectrum48Batch {
 
-        set_iff1(state.iff1);
-        set_iff2(state.iff2);
-        set_int_mode(state.int_mode);
-        set_iregp_kind(static_cast<z80::iregp>(state.index_rp_kind));
-    }
+typedef Spectrum48::fast_machine_emulator machine_emulator;
 
+// Runs tasks on a fixed set of threads. The calling thread
+// takes part in the work too. Idle threads take the next
+// unprocessed task, so the load balances itself.
+class thread_pool {
 public:
-    memory_image_type &on_get_memory() {
-        return state.memory;
+    explicit thread_pool(unsigned num_of_threads) {
+        for(unsigned i = 1; i < num_of_threads; ++i)
+            threads.emplace_back([this] { work(); });
     }
 
-    fast_u8 on_input(fast_u16 addr) {
-        const fast_u8 default_value = 0xbf;
-        if(!on_input_callback)
-            return default_value;
-
-        PyObject *arg = Py_BuildValue("(i)", addr);
-        decref_guard arg_guard(arg);
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        start_cond.notify_all();
+        for(auto &thread : threads)
+            thread.join();
+    }
 
-        retrieve_state();
-        PyObject *result = PyObject_CallObject(on_input_callback, arg);
-        decref_guard result_guard(result);
-        install_state();
+    // Calls the task for every index in [0, num_of_tasks) and
+    // waits for all of them to complete.
+    void run(std::size_t num_of_tasks,
+             const std::function<void(std::size_t)> &task) {
+        std::unique_lock<std::mutex> lock(mutex);
+        current_task = &task;
+        this->num_of_tasks = num_of_tasks;
+        next_task = 0;
+        num_of_busy_threads = threads.size();
+        ++generation;
+        lock.unlock();
+        start_cond.notify_all();
+
+        do_tasks();
+
+        lock.lock();
+        finish_cond.wait(lock, [this] { return num_of_busy_threads == 0; });
+        current_task = nullptr;
+    }
 
-        if(!result) {
-            stop();
-            return default_value;
+private:
+    void do_tasks() {
+        for(;;) {
+            std::size_t i = next_task.fetch_add(1);
+            if(i >= num_of_tasks)
+                break;
+            (*current_task)(i);
         }
+    }
 
-        if(!PyLong_Check(result)) {
-            PyErr_SetString(PyExc_TypeError, "returning value must be integer");
-            stop();
-            return default_value;
+    void work() {
+        unsigned long seen_generation = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;) {
+            start_cond.wait(lock, [&] {
+                return done || generation != seen_generation; });
+            if(done)
+                return;
+
+            seen_generation = generation;
+            lock.unlock();
+            do_tasks();
+            lock.lock();
+
+            if(--num_of_busy_threads == 0)
+                finish_cond.notify_one();
         }
+    }
 
-        return z80::mask8(PyLong_AsUnsignedLong(result));
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_cond;
+    std::condition_variable finish_cond;
+    const std::function<void(std::size_t)> *current_task = nullptr;
+    std::size_t num_of_tasks = 0;
+    std::atomic<std::size_t> next_task{0};
+    std::size_t num_of_busy_threads = 0;
+    unsigned long generation = 0;
+    bool done = false;
+};
+
+// Independent machines that are stepped in lockstep, a frame at
+// a time. Inputs and outputs are kept in packed arrays, one
+// element per machine.
+class machine_batch {
+public:
+    typedef machine_emulator::keyboard_state_type keyboard_state_type;
+    typedef machine_emulator::screen_chunks_type screen_chunks_type;
+
+    machine_batch(std::size_t num_of_machines, unsigned num_of_threads)
+        : machines(num_of_machines), keyboard_states(num_of_machines),
+          events(num_of_machines), screen_chunks(num_of_machines),
+          pool(num_of_threads)
+    {
+        for(auto &keyboard_state : keyboard_states)
+            std::fill(std::begin(keyboard_state.rows),
+                      std::end(keyboard_state.rows), 0xff);
     }
 
+    std::size_t get_num_of_machines() const { return machines.size(); }
+
+    machine_emulator &get_machine(std::size_t i) { return machines[i]; }
+
+    // Steps every machine by a frame. Must be called without
+    // the GIL held, so machines shall have no callbacks set.
+    void run_frame() {
+        pool.run(machines.size(), [this](std::size_t i) { run_frame(i); });
+    }
+
+    // The arrays are wrapped in structures so they can be
+    // elements of vectors.
+    struct keyboard_slot { keyboard_state_type rows; };
+    struct screen_slot { screen_chunks_type chunks; };
+
+    std::vector<keyboard_slot> &get_keyboard_states() {
+        return keyboard_states;
+    }
+
+    std::vector<least_u32> &get_events() { return events; }
+
+    std::vector<screen_slot> &get_screen_chunks() { return screen_chunks; }
+
+    // Set while the machines run with the GIL released.
+    bool is_running() const { return running; }
+    void set_running(bool new_running) { running = new_running; }
+
 private:
-    machine_state state;
-    pixels_buffer_type pixels;
-    PyObject *on_input_callback = nullptr;
+    void run_frame(std::size_t i) {
+        machine_emulator &machine = machines[i];
+        const keyboard_state_type &keys = keyboard_states[i].rows;
+        auto &state = machine.get_machine_state();
+        std::copy(std::begin(keys), std::end(keys),
+                  std::begin(state.keyboard_state));
+
+        unsigned num_of_frames_run;
+        events[i] = machine.run_frames(
+            1, machine_emulator::frame_rendering::last, num_of_frames_run);
+
+        const screen_chunks_type &chunks = machine.get_screen_chunks();
+        std::memcpy(screen_chunks[i].chunks, chunks, sizeof(chunks));
+    }
+
+    std::vector<machine_emulator> machines;
+    std::vector<keyboard_slot> keyboard_states;
+    std::vector<least_u32> events;
+    std::vector<screen_slot> screen_chunks;
+    thread_pool pool;
+    bool running = false;
 };
 
 struct object_instance {
     PyObject_HEAD
-    machine_emulator emulator;
+    machine_batch *batch;
 };
 
 static inline object_instance *cast_object(PyObject *p) {
     return reinterpret_cast<object_instance*>(p);
 }
 
-static inline machine_emulator &cast_emulator(PyObject *p) {
-    return cast_object(p)->emulator;
+static inline machine_batch &cast_batch(PyObject *p) {
+    return *cast_object(p)->batch;
 }
 
-PyObject *get_state_view(PyObject *self, PyObject *args) {
-    auto &state = cast_emulator(self).get_machine_state();
-    return PyMemoryView_FromMemory(reinterpret_cast<char*>(&state),
-                                   sizeof(state), PyBUF_WRITE);
+template<typename T>
+static PyObject *get_vector_view(std::vector<T> &v, int flags) {
+    return PyMemoryView_FromMemory(reinterpret_cast<char*>(v.data()),
+                                   static_cast<Py_ssize_t>(v.size() * sizeof(T)),
+                                   flags);
 }
 
-PyObject *render_screen(PyObject *self, PyObject *args) {
-    auto &emulator = cast_emulator(self);
-    emulator.render_screen();
+static bool parse_machine_index(PyObject *self, PyObject *args,
+                                std::size_t &index) {
+    Py_ssize_t i;
+    if(!PyArg_ParseTuple(args, "n", &i))
+        return false;
 
-    const auto &screen_chunks = emulator.get_screen_chunks();
-    return PyMemoryView_FromMemory(
-        const_cast<char*>(reinterpret_cast<const char*>(&screen_chunks)),
-        sizeof(screen_chunks), PyBUF_READ);
+    if(i < 0 || static_cast<std::size_t>(i) >= cast_batch(self).
+                                                   get_num_of_machines()) {
+        PyErr_SetString(PyExc_IndexError, "machine index is out of range");
+        return false;
+    }
+
+    index = static_cast<std::size_t>(i);
+    return true;
 }
 
-static PyObject *get_frame_pixels(PyObject *self, PyObject *args) {
-    auto &pixels = cast_emulator(self).get_frame_pixels();
-    return PyMemoryView_FromMemory(reinterpret_cast<char*>(pixels),
-                                   sizeof(pixels), PyBUF_READ);
+static PyObject *get_num_of_machines(PyObject *self, PyObject *args) {
+    return PyLong_FromSize_t(cast_batch(self).get_num_of_machines());
 }
 
-static PyObject *mark_addrs(PyObject *self, PyObject *args) {
-    unsigned addr, size, marks;
-    if(!PyArg_ParseTuple(args, "III", &addr, &size, &marks))
+// Other threads may attempt to run or modify the batch while
+// its machines run with the GIL released.
+static bool check_not_running(const machine_batch &batch) {
+    if(batch.is_running()) {
+        PyErr_SetString(PyExc_RuntimeError, "batch is running");
+        return false;
+    }
+    return true;
+}
+
+static PyObject *get_memory_view(PyObject *self, PyObject *args) {
+    std::size_t i;
+    if(!parse_machine_index(self, args, i))
         return nullptr;
 
-    cast_emulator(self).mark_addrs(addr, size, marks);
-    Py_RETURN_NONE;
+    auto &memory = cast_batch(self).get_machine(i).on_get_memory();
+    return PyMemoryView_FromMemory(reinterpret_cast<char*>(memory),
+                                   sizeof(memory), PyBUF_WRITE);
 }
 
-static PyObject *set_on_input_callback(PyObject *self, PyObject *args) {
-    PyObject *new_callback;
-    if(!PyArg_ParseTuple(args, "O:set_callback", &new_callback))
+static PyObject *get_pc(PyObject *self, PyObject *args) {
+    std::size_t i;
+    if(!parse_machine_index(self, args, i))
         return nullptr;
 
-    if(!PyCallable_Check(new_callback)) {
-        PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+    return PyLong_FromUnsignedLong(cast_batch(self).get_machine(i).get_register(
+        machine_emulator::register_id::pc));
+}
+
+static PyObject *set_pc(PyObject *self, PyObject *args) {
+    Py_ssize_t i;
+    unsigned pc;
+    if(!PyArg_ParseTuple(args, "nI", &i, &pc))
+        return nullptr;
+
+    auto &batch = cast_batch(self);
+    if(!check_not_running(batch))
+        return nullptr;
+
+    if(i < 0 || static_cast<std::size_t>(i) >= batch.get_num_of_machines()) {
+        PyErr_SetString(PyExc_IndexError, "machine index is out of range");
         return nullptr;
     }
 
-    auto &emulator = cast_emulator(self);
-    PyObject *old_callback = emulator.set_on_input_callback(new_callback);
-    Py_XINCREF(new_callback);
-    Py_XDECREF(old_callback);
+    batch.get_machine(static_cast<std::size_t>(i)).set_register(
+        machine_emulator::register_id::pc, z80::mask16(pc));
     Py_RETURN_NONE;
 }
 
-PyObject *run(PyObject *self, PyObject *args) {
-    auto &emulator = cast_emulator(self);
-    events_mask events = emulator.run();
-    if(PyErr_Occurred())
-        return nullptr;
-    return Py_BuildValue("i", events);
+static PyObject *get_keyboard_view(PyObject *self, PyObject *args) {
+    return get_vector_view(cast_batch(self).get_keyboard_states(),
+                           PyBUF_WRITE);
 }
 
-PyObject *on_handle_active_int(PyObject *self, PyObject *args) {
-    bool int_initiated = cast_emulator(self).on_handle_active_int();
-    return PyBool_FromLong(int_initiated);
+static PyObject *get_events_view(PyObject *self, PyObject *args) {
+    return get_vector_view(cast_batch(self).get_events(), PyBUF_READ);
+}
+
+static PyObject *get_screen_chunks_view(PyObject *self, PyObject *args) {
+    return get_vector_view(cast_batch(self).get_screen_chunks(), PyBUF_READ);
+}
+
+static PyObject *run_frame(PyObject *self, PyObject *args) {
+    auto &batch = cast_batch(self);
+    if(!check_not_running(batch))
+        return nullptr;
+
+    batch.set_running(true);
+    Py_BEGIN_ALLOW_THREADS
+    batch.run_frame();
+    Py_END_ALLOW_THREADS
+    batch.set_running(false);
+    Py_RETURN_NONE;
 }
 
 PyMethodDef methods[] = {
-    {"_get_state_view", get_state_view, METH_NOARGS,
-     "Return a MemoryView object that exposes the internal state of the "
-     "emulated machine."},
-    {"render_screen", render_screen, METH_NOARGS,
-     "Render current screen frame and return a MemoryView object that exposes "
-     "a buffer that contains rendered data."},
-    {"get_frame_pixels", get_frame_pixels, METH_NOARGS,
-     "Convert rendered frame into an internally allocated array of RGB24 pixels "
-     "and return a MemoryView object that exposes that array."},
-    {"mark_addrs", mark_addrs, METH_VARARGS,
-     "Mark a range of memory bytes as ones that require custom "
-     "processing on reading, writing or executing them."},
-    {"set_on_input_callback", set_on_input_callback, METH_VARARGS,
-     "Set a callback function handling reading from ports."},
-    {"run", run, METH_NOARGS,
-     "Run emulator until one or several events are signaled."},
-    {"on_handle_active_int", on_handle_active_int, METH_NOARGS,
-     "Attempts to initiate a masked interrupt."},
+    {"get_num_of_machines", get_num_of_machines, METH_NOARGS,
+     "Return the number of machines in the batch."},
+    {"_get_memory_view", get_memory_view, METH_VARARGS,
+     "Return a MemoryView object that exposes the memory of the "
+     "specified machine."},
+    {"get_pc", get_pc, METH_VARARGS,
+     "Return the program counter of the specified machine."},
+    {"set_pc", set_pc, METH_VARARGS,
+     "Set the program counter of the specified machine."},
+    {"_get_keyboard_view", get_keyboard_view, METH_NOARGS,
+     "Return a writable MemoryView object that exposes keyboard "
+     "half-rows of all the machines, 8 bytes per machine, where zero "
+     "bits correspond to pressed keys."},
+    {"_get_events_view", get_events_view, METH_NOARGS,
+     "Return a MemoryView object that exposes 32-bit masks of events "
+     "raised during the last frame, one per machine."},
+    {"_get_screen_chunks_view", get_screen_chunks_view, METH_NOARGS,
+     "Return a MemoryView object that exposes the rendered screen "
+     "chunks of all the machines."},
+    {"run_frame", run_frame, METH_NOARGS,
+     "Run every machine in the batch for a frame."},
     { nullptr }  // Sentinel.
 };
 
 PyObject *object_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
-    if(!PyArg_ParseTuple(args, ":_Spectrum48Base.__new__"))
+    Py_ssize_t num_of_machines;
+    unsigned num_of_threads = 0;
+    if(!PyArg_ParseTuple(args, "n|I:_Spectrum48BatchBase.__new__",
+                         &num_of_machines, &num_of_threads))
         return nullptr;
 
+    if(num_of_machines < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "number of machines cannot be negative");
+        return nullptr;
+    }
+
+    // Default to one thread per core.
+    if(!num_of_threads)
+        num_of_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
     auto *self = cast_object(type->tp_alloc(type, /* nitems= */ 0));
     if(!self)
       return nullptr;
 
-    auto &emulator = self->emulator;
-    ::new(&emulator) machine_emulator();
+    self->batch = new machine_batch(static_cast<std::size_t>(num_of_machines),
+                                    num_of_threads);
     return &self->ob_base;
 }
 
 void object_dealloc(PyObject *self) {
     auto &object = *cast_object(self);
-    object.emulator.~spectrum48();
+    delete object.batch;
     Py_TYPE(self)->tp_free(self);
 }
 
 static PyTypeObject type_object = {
     PyVarObject_HEAD_INIT(&PyType_Type, 0)
-    "zx._emulatorbase._Spectrum48Base",
+    "zx._emulatorbase._Spectrum48BatchBase",
                                 // tp_name
     sizeof(object_instance),    // tp_basicsize
     0,                          // tp_itemsize
@@ -369,7 +2767,8 @@ static PyTypeObject type_object = {
     0,                          // tp_as_buffer
     Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
                                 // tp_flags
-    "ZX Spectrum 48K Emulator", // tp_doc
+    "Batch of ZX Spectrum 48K Emulators",
+                                // tp_doc
     0,                          // tp_traverse
     0,                          // tp_clear
     0,                          // tp_richcompare
@@ -399,7 +2798,58 @@ static PyTypeObject type_object = {
     0,                          // tp_finalize
 };
 
-}  // namespace Spectrum48
+}  // namespace Spectrum48Batch
+
+static PyObject *disassemble(PyObject *self, PyObject *args) {
+    Py_buffer buffer;
+    unsigned addr;
+    if(!PyArg_ParseTuple(args, "y*I", &buffer, &addr))
+        return nullptr;
+
+    zx::disassembler disasm(
+        static_cast<fast_u16>(addr), static_cast<const least_u8*>(buffer.buf),
+        static_cast<fast_u16>(addr), static_cast<unsigned>(buffer.len));
+    PyObject *text = PyUnicode_FromString(disasm.on_disassemble());
+    PyBuffer_Release(&buffer);
+    return text;
+}
+
+static PyObject *uncompress_z80_block_image(PyObject *self, PyObject *args) {
+    Py_buffer buffer;
+    unsigned size;
+    if(!PyArg_ParseTuple(args, "y*I", &buffer, &size))
+        return nullptr;
+
+    // Decode into a buffer of its own, so nothing is changed
+    // unless the whole block is valid.
+    std::vector<least_u8> output(size);
+    std::size_t consumed = Spectrum48::uncompress_z80_block(
+        static_cast<const least_u8*>(buffer.buf),
+        static_cast<std::size_t>(buffer.len), output.data(), size);
+    PyBuffer_Release(&buffer);
+
+    if(!consumed && size)
+        Py_RETURN_NONE;
+
+    PyObject *bytes = PyBytes_FromStringAndSize(
+        reinterpret_cast<const char*>(output.data()),
+        static_cast<Py_ssize_t>(output.size()));
+    if(!bytes)
+        return nullptr;
+    return Py_BuildValue("(Nn)", bytes, static_cast<Py_ssize_t>(consumed));
+}
+
+static PyMethodDef module_methods[] = {
+    {"disassemble", disassemble, METH_VARARGS,
+     "Disassemble the instruction in a bytes-like object that is supposed "
+     "to be located at the specified address."},
+    {"uncompress_z80_block", uncompress_z80_block_image, METH_VARARGS,
+     "Uncompress a .z80 snapshot memory block in a bytes-like object "
+     "to the specified size. Return the uncompressed bytes and the "
+     "number of compressed bytes consumed or None if the block is "
+     "corrupted."},
+    { nullptr }  // Sentinel.
+};
 
 static PyModuleDef module = {
     PyModuleDef_HEAD_INIT,      // m_base
@@ -407,7 +2857,7 @@ static PyModuleDef module = {
     "ZX Spectrum Emulation Module",
                                 // m_doc
     -1,                         // m_size
-    nullptr,                    // m_methods
+    module_methods,             // m_methods
     nullptr,                    // m_slots
     nullptr,                    // m_traverse
     nullptr,                    // m_clear
@@ -416,17 +2866,40 @@ static PyModuleDef module = {
 
 }  // anonymous namespace
 
+// Adds a type to the module. The module steals the added
+// reference on success.
+static bool add_type(PyObject *m, const char *name, PyTypeObject &type) {
+    if(PyType_Ready(&type) < 0)
+        return false;
+
+    Py_INCREF(&type);
+    if(PyModule_AddObject(m, name, &type.ob_base.ob_base) < 0) {
+        Py_DECREF(&type);
+        return false;
+    }
+
+    return true;
+}
+
 extern "C" PyMODINIT_FUNC PyInit__emulatorbase(void) {
     PyObject *m = PyModule_Create(&module);
     if(!m)
         return nullptr;
 
-    if(PyType_Ready(&Spectrum48::type_object) < 0)
+    using Spectrum48::emulator_type;
+    using Spectrum48::machine_emulator;
+    using Spectrum48::fast_machine_emulator;
+
+    PyTypeObject &type_object = emulator_type<machine_emulator>::type_object;
+    PyTypeObject &fast_type_object =
+        emulator_type<fast_machine_emulator>::type_object;
+    PyTypeObject &batch_type_object = Spectrum48Batch::type_object;
+    if(!add_type(m, "_Spectrum48Base", type_object) ||
+           !add_type(m, "_Spectrum48Fast", fast_type_object) ||
+           !add_type(m, "_Spectrum48BatchBase", batch_type_object)) {
+        Py_DECREF(m);
         return nullptr;
-    Py_INCREF(&Spectrum48::type_object);
+    }
 
-    // TODO: Check the returning value.
-    PyModule_AddObject(m, "_Spectrum48Base",
-                       &Spectrum48::type_object.ob_base.ob_base);
     return m;
 }
@@ -20,6 +20,7 @@ from ._device import KeyStroke
 from ._device import LoadFile
 from ._device import PauseStateUpdated
 from ._device import QuantumRun
+from ._device import RewindEmulation
 from ._device import SaveSnapshot
 from ._device import ScreenUpdated
 from ._device import TapeStateUpdated
@@ -128,6 +129,9 @@ class Notification(object):
         self._timestamp = None
         self._draw = None
 
+    def is_shown(self):
+        return self._timestamp is not None
+
     def draw(self, window_size, screen_size, context):
         if not self._timestamp:
             return
@@ -164,6 +168,22 @@ class Screencast(object):
         self._counter += 1
 
 
+# Turns a sequence of per-line flags into (begin, end) ranges of
+# consecutive marked lines.
+def _get_line_ranges(line_flags):
+    begin = None
+    for i, flag in enumerate(line_flags):
+        if flag:
+            if begin is None:
+                begin = i
+        elif begin is not None:
+            yield begin, i
+            begin = None
+
+    if begin is not None:
+        yield begin, len(line_flags)
+
+
 class _KeyEvent(object):
     def __init__(self, id, pressed):
         self.id = id
@@ -208,6 +228,7 @@ class ScreenWindow(Device):
             'F1': self._show_help,
             'F2': self._save_snapshot,
             'F3': self._choose_and_load_file,
+            'F5': self.__rewind,
             'F6': self.__toggle_tape_pause,
             'F11': self._toggle_fullscreen,
             'PAUSE': self.__toggle_pause,
@@ -265,15 +286,24 @@ class ScreenWindow(Device):
         self._window.connect('window-state-event',
                              self.__on_window_state_event)
 
-    def _on_draw_area(self, widget, context):
-        window_size = self._window.get_size()
-        window_width, window_height = window_size
+    # Returns the position and size of the scaled frame in the
+    # window.
+    def _get_frame_area(self):
+        window_width, window_height = self._window.get_size()
         width = min(window_width,
                     div_ceil(window_height * self.frame_width,
                              self.frame_height))
         height = min(window_height,
                      div_ceil(window_width * self.frame_height,
                               self.frame_width))
+        x = (window_width - width) // 2
+        y = (window_height - height) // 2
+        return x, y, width, height
+
+    def _on_draw_area(self, widget, context):
+        window_size = self._window.get_size()
+        window_width, window_height = window_size
+        x, y, width, height = self._get_frame_area()
 
         # Draw the background.
         context.save()
@@ -283,8 +313,7 @@ class ScreenWindow(Device):
 
         # Draw the emulated screen.
         context.save()
-        context.translate((window_width - width) // 2,
-                          (window_height - height) // 2)
+        context.translate(x, y)
         context.scale(width / self.frame_width, height / self.frame_height)
         context.set_source(self.pattern)
         context.paint()
@@ -296,14 +325,29 @@ class ScreenWindow(Device):
         self._screencast.on_draw(context.get_group_target())
 
     def _on_updated_screen(self, event, devices):
-        self.frame_data[:] = event.pixels
-        self.area.queue_draw()
+        if event.updated_lines is None:
+            self.frame_data[:] = event.pixels
+            self.area.queue_draw()
+            return
+
+        # Only copy and redraw the lines that have changed.
+        x, y, width, height = self._get_frame_area()
+        line_size = len(event.pixels) // self.frame_height
+        for begin, end in _get_line_ranges(event.updated_lines):
+            top = y + begin * height // self.frame_height
+            bottom = y + div_ceil(end * height, self.frame_height)
+            self.area.queue_draw_area(x, top, width, bottom - top)
+
+            begin *= line_size
+            end *= line_size
+            self.frame_data[begin:end] = event.pixels[begin:end]
 
     def _show_help(self, devices):
         KEYS_HELP = [
             ('F1', 'Show help.'),
             ('F2', 'Save snapshot.'),
             ('F3', 'Load snapshot or tape file.'),
+            ('F5', 'Rewind emulation by a second.'),
             ('F6', 'Pause/resume tape.'),
             ('F10', 'Quit.'),
             ('F11', 'Fullscreen/windowed mode.'),
@@ -424,6 +468,7 @@ class ScreenWindow(Device):
             self._notification.set(draw_pause_notification, time)
         else:
             self._notification.clear()
+            self.area.queue_draw()
 
     def _on_updated_tape_state(self, event, devices):
         tape_paused = devices.notify(IsTapePlayerPaused())
@@ -433,7 +478,10 @@ class ScreenWindow(Device):
         self._notification.set(draw, tape_time)
 
     def _on_quantum_run(self, event, devices):
-        self.area.queue_draw()
+        # Screen updates redraw the changed lines themselves, so
+        # only notifications need to be redrawn here as they fade.
+        if SCREENCAST or self._notification.is_shown():
+            self.area.queue_draw()
 
         while Gtk.events_pending():
             Gtk.main_iteration()
@@ -444,6 +492,9 @@ class ScreenWindow(Device):
     def __toggle_pause(self, devices):
         devices.notify(ToggleEmulationPause())
 
+    def __rewind(self, devices):
+        devices.notify(RewindEmulation())
+
     def __toggle_tape_pause(self, devices):
         devices.notify(ToggleTapePause())
 
@@ -8,9 +8,6 @@
 #
 #   Published under the MIT license.
 
-from ._device import Device
-from ._device import KeyStroke
-from ._device import ReadPort
 from ._utils import tupilize
 
 
@@ -46,48 +43,3 @@ for index, ids in enumerate(_KEY_IDS):
     for i in ids:
         KEYS[i] = info
 
-
-class Keyboard(Device):
-    _state = [0xff] * 8
-
-    def read_port(self, addr):
-        n = 0xff
-        addr ^= 0xffff
-
-        if addr & (1 << 8):
-            n &= self._state[0]
-        if addr & (1 << 9):
-            n &= self._state[1]
-        if addr & (1 << 10):
-            n &= self._state[2]
-        if addr & (1 << 11):
-            n &= self._state[3]
-        if addr & (1 << 12):
-            n &= self._state[4]
-        if addr & (1 << 13):
-            n &= self._state[5]
-        if addr & (1 << 14):
-            n &= self._state[6]
-        if addr & (1 << 15):
-            n &= self._state[7]
-
-        return n
-
-    def handle_key_stroke(self, key_info, pressed):
-        # print(key_info.id)
-        addr_line = key_info.ADDRESS_LINE
-        mask = 1 << key_info.PORT_BIT
-
-        if pressed:
-            self._state[addr_line - 8] &= mask ^ 0xff
-        else:
-            self._state[addr_line - 8] |= mask
-
-    def on_event(self, event, devices, result):
-        if isinstance(event, KeyStroke):
-            key = KEYS.get(event.id, None)
-            if key:
-                self.handle_key_stroke(key, event.pressed)
-        elif isinstance(event, ReadPort):
-            result &= self.read_port(event.addr)
-        return result
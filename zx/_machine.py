@@ -14,16 +14,31 @@ from ._data import MachineSnapshot
 from ._data import ProcessorSnapshot
 from ._device import GetEmulationPauseState
 from ._device import GetEmulationTime
+from ._device import GetTapePlayerTime
+from ._device import IsTapePlayerPaused
+from ._device import IsTapePlayerStopped
 from ._device import KeyStroke
 from ._device import LoadFile
+from ._device import LoadTape
 from ._device import PauseStateUpdated
+from ._device import PauseUnpauseTape
+from ._device import RewindEmulation
 from ._device import SaveSnapshot
+from ._device import TapeStateUpdated
 from ._device import ToggleEmulationPause
 from ._device import ToggleTapePause
 from ._emulatorbase import _Spectrum48Base
+from ._emulatorbase import _Spectrum48Fast
 from ._except import EmulationExit
+from ._except import EmulatorException
 from ._keyboard import KEYS
 from ._rom import load_rom_image
+from ._tape import get_tape_block_bounds
+from ._tape import get_tape_pulses
+from ._tape import pack_tape_pulses
+from ._time import Time
+from ._trace import format_trace_record
+from ._trace import get_trace_records
 from ._utils import make16
 from ._z80snapshot import Z80SnapshotFormat
 
@@ -34,6 +49,9 @@ class RunEvents(enum.IntFlag):
     FETCHES_LIMIT_HIT = 1 << 3
     BREAKPOINT_HIT = 1 << 4
     END_OF_TAPE = 1 << 5
+    END_OF_PLAYBACK_CHUNK = 1 << 6
+    PLAYBACK_ERROR = 1 << 7
+    WATCHPOINT_HIT = 1 << 8
 
 
 class _ImageParser(object):
@@ -289,13 +307,12 @@ class MemoryState(object):
         return _make16(*self.read(addr, 2))
 
 
-class MachineState(Z80State, MemoryState):
+# Processor registers are not part of the machine state image;
+# Spectrum48 accesses them directly in the emulated processor.
+class MachineState(MemoryState):
     def __init__(self, image):
         p = _ImageParser(image)
 
-        self.z80_image = p.parse_block(32)
-        Z80State.__init__(self, self.z80_image)
-
         self.__ticks_since_int = p.parse32()
         self.__fetches_to_stop = p.parse32()
         self.__events = p.parse32()
@@ -303,6 +320,9 @@ class MachineState(Z80State, MemoryState):
         self.__int_after_ei_allowed = p.parse8()
         self.__border_color = p.parse8()
         self.__trace_enabled = p.parse8()
+        self.__visited_instrs_marking = p.parse8()
+        self.__keyboard_state = p.parse_block(8)
+        self.__ear_level = p.parse8()
 
         self.memory_image = p.parse_block(0x10000)
         MemoryState.__init__(self, self.memory_image)
@@ -361,10 +381,45 @@ class MachineState(Z80State, MemoryState):
     def border_color(self, value):
         self.__border_color[0] = value
 
-    ''' TODO
+    @property
+    def ear_level(self):
+        return bool(self.__ear_level[0])
+
+    @ear_level.setter
+    def ear_level(self, level):
+        self.__ear_level[0] = int(level)
+
+    # Updates the keyboard matrix the machine scans on its own.
+    def set_key_pressed(self, key, pressed=True):
+        halfrow = key.ADDRESS_LINE - 8
+        mask = 1 << key.PORT_BIT
+        if pressed:
+            self.__keyboard_state[halfrow] &= mask ^ 0xff
+        else:
+            self.__keyboard_state[halfrow] |= mask
+
     def enable_trace(self, enable=True):
-        self.set('trace_enabled', int(enable))
-    '''
+        self.__trace_enabled[0] = int(enable)
+
+    # Makes the machine mark executed instructions with
+    # VISITED_INSTR_MARK.
+    def enable_visited_instrs_marking(self, enable=True):
+        self.__visited_instrs_marking[0] = int(enable)
+
+    # Starts collecting a new profile of executed instructions.
+    def enable_profiling(self, call_graph=False):
+        self._enable_profiling(call_graph)
+
+    # Per-address counters of the profile started with
+    # enable_profiling(). The arrays remain valid till profiling
+    # is disabled or restarted.
+    def get_profile_instr_counts(self):
+        view = self._get_profile_instr_counts_view()
+        return None if view is None else view.cast('Q')
+
+    def get_profile_instr_ticks(self):
+        view = self._get_profile_instr_ticks_view()
+        return None if view is None else view.cast('Q')
 
     def install_snapshot(self, snapshot):
         assert isinstance(snapshot, MachineSnapshot)
@@ -402,18 +457,45 @@ class Dispatcher(object):
             device.destroy()
 
 
-class Spectrum48(_Spectrum48Base, MachineState):
+# The machine logic shared by the native machine types. Goes
+# before the native type in the list of bases, so that super()
+# calls reach the native methods.
+class _Spectrum48Mixin(object):
     # Memory marks.
     __NO_MARKS = 0
     __BREAKPOINT_MARK = 1 << 0
+    READ_WATCH_MARK = 1 << 1
+    WRITE_WATCH_MARK = 1 << 2
+    VISITED_INSTR_MARK = 1 << 7
+
+    __TICKS_PER_FRAME = 69888
+
+    # The entry point of the ROM LD-BYTES routine.
+    __LD_BYTES_ADDR = 0x0556
+
+    __RENDERING_MODES = {False: 0, 'last': 1, 'every': 2}
+    __RENDER_MODES = {'off': 0, 'lazy': 1, 'full': 2}
+    __FRAME_FORMATS = {'rgb': 0, 'y4m': 1, 'indexed': 2}
+
+    # The layout of the native statistics block.
+    __STATS_FIELDS = ('instrs', 'memory_contention_ticks',
+                      'port_contention_ticks', 'render_calls',
+                      'rendered_ticks', 'accepted_ints', 'ignored_ints',
+                      'callbacks')
+    __NUM_OF_PORTS = 0x100
 
     def __init__(self):
         MachineState.__init__(self, self._get_state_view())
+        self.__stats = self._get_stats_view().cast('Q')
 
         # Install ROM.
         self.write(0x0000, load_rom_image('Spectrum48.rom'))
 
         self.__paused = False
+        self.__frames_per_rewind_point = 0
+
+        self.__tape_blocks = []
+        self.__tape_flash_loading = False
 
     def destroy(self):
         devices = self.devices
@@ -440,27 +522,256 @@ class Spectrum48(_Spectrum48Base, MachineState):
         self.__paused = value
         self.devices.notify(PauseStateUpdated())
 
+    # 'off' disables rendering as frames are executed, so that
+    # it is only done on explicit requests. 'lazy', the default,
+    # and 'full' produce the same pictures, with 'lazy' skipping
+    # the work on writes that cannot change them.
+    @property
+    def render_mode(self):
+        mode = super().get_render_mode()
+        for id, n in self.__RENDER_MODES.items():
+            if n == mode:
+                return id
+
+    @render_mode.setter
+    def render_mode(self, mode):
+        self.set_render_mode(self.__RENDER_MODES[mode])
+
+    # Runs up to the specified number of frames in a single
+    # native call. 'render' may be False, 'last' or 'every'.
+    # Returns the raised events and the number of complete
+    # frames.
+    def run_frames(self, num_of_frames, render=False):
+        events, num_of_frames_run = super().run_frames(
+            num_of_frames, self.__RENDERING_MODES[render])
+        return RunEvents(events), num_of_frames_run
+
+    # Records the state at the ends of frames for up to the
+    # specified number of seconds back. Keyframes are stored
+    # every 'keyframe_interval' seconds and the rest of the
+    # points are kept as deltas against them.
+    def enable_rewind(self, seconds=60, frames_per_point=5,
+                      keyframe_interval=5):
+        frames_per_second = 50
+        num_of_points = int(seconds * frames_per_second / frames_per_point)
+        points_per_keyframe = max(1, int(
+            keyframe_interval * frames_per_second / frames_per_point))
+        self.set_rewind_buffer(num_of_points, frames_per_point,
+                               points_per_keyframe)
+        self.__frames_per_rewind_point = frames_per_point
+
+    def disable_rewind(self):
+        self.set_rewind_buffer(0, 0, 0)
+        self.__frames_per_rewind_point = 0
+
+    # Steps back by about the specified number of seconds.
+    # Returns False if rewinding is not enabled or there is no
+    # recorded history yet.
+    def rewind(self, seconds=1):
+        if not self.__frames_per_rewind_point:
+            return False
+
+        num_of_points = max(1, round(
+            seconds * 50 / self.__frames_per_rewind_point))
+        return self.rewind_points(num_of_points)
+
     def set_breakpoints(self, addr, size):
         self.mark_addrs(addr, size, self.__BREAKPOINT_MARK)
 
     def set_breakpoint(self, addr):
         self.set_breakpoints(addr, 1)
 
+    def clear_breakpoints(self, addr, size):
+        self.unmark_addrs(addr, size, self.__BREAKPOINT_MARK)
+
+    def clear_breakpoint(self, addr):
+        self.clear_breakpoints(addr, 1)
+
+    # Make reading or writing the specified memory bytes raise
+    # WATCHPOINT_HIT once the accessing instruction is executed.
+    def set_watchpoints(self, addr, size, read=False, write=True):
+        marks = ((self.READ_WATCH_MARK if read else 0) |
+                 (self.WRITE_WATCH_MARK if write else 0))
+        self.mark_addrs(addr, size, marks)
+
+    def clear_watchpoints(self, addr, size):
+        self.unmark_addrs(addr, size,
+                          self.READ_WATCH_MARK | self.WRITE_WATCH_MARK)
+
+    def get_trace_records(self, last=None):
+        return get_trace_records(self._get_trace_view(), last)
+
+    # Returns a dictionary of statistics counters. The 'inputs'
+    # and 'outputs' entries map low bytes of port addresses to
+    # numbers of operations.
+    def get_stats(self):
+        stats = dict(zip(self.__STATS_FIELDS, self.__stats))
+        n = len(self.__STATS_FIELDS)
+        for kind in ('inputs', 'outputs'):
+            counts = self.__stats[n:n + self.__NUM_OF_PORTS]
+            stats[kind] = {port: count for port, count in enumerate(counts)
+                           if count}
+            n += self.__NUM_OF_PORTS
+        return stats
+
+    # Streams every completed frame to a file object or a file
+    # descriptor without involving Python. The 'rgb' format
+    # gives raw RGB24 pixels, 'y4m' gives YUV 4:4:4 video and
+    # 'indexed' gives screen chunks of 4-bit palette indexes.
+    # Skipping identical frames is not supported for 'y4m'.
+    def stream_frames(self, file, format='y4m', skip_identical=False):
+        if isinstance(file, int):
+            fd = file
+        else:
+            file.flush()
+            fd = file.fileno()
+        self.set_frame_sink(fd, self.__FRAME_FORMATS[format], skip_identical)
+
+    def stop_streaming_frames(self):
+        self.set_frame_sink(-1, 0, False)
+
+    # Returns 16-bit signed beeper samples of the last
+    # completed frame, about 44.1 kHz.
+    def get_audio_samples(self):
+        return self._get_audio_samples_view().cast('h')
+
+    # Returns beeper samples of all frames completed since the
+    # last call, so the beeper output can be streamed however
+    # many frames are run at a time. Up to 64 frames of samples
+    # are kept.
+    def take_audio_samples(self):
+        return memoryview(self._take_audio_samples()).cast('h')
+
+    def reset_stats(self):
+        for i in range(len(self.__stats)):
+            self.__stats[i] = 0
+
+    def dump_trace(self, filename='zx_trace', last=None):
+        with open(filename, 'wt') as f:
+            for record in self.get_trace_records(last):
+                print(format_trace_record(record), file=f)
+
+    # Tapes are played natively and sampled on reading from
+    # the EAR input.
+    def load_parsed_tape(self, file):
+        blocks = file.get_blocks()
+        self.set_tape_pulses(pack_tape_pulses(get_tape_pulses(blocks)))
+        self.__tape_blocks = get_tape_block_bounds(blocks)
+
+    # In the flash-loading mode entering the ROM LD-BYTES routine
+    # loads the next tape block directly into memory instead of
+    # playing its pulses. Blocks the ROM is not known to be able
+    # to load are left to the pulse emulation, so custom loaders
+    # keep working.
+    def enable_tape_flash_loading(self, enable=True):
+        if enable:
+            self.set_breakpoint(self.__LD_BYTES_ADDR)
+        elif self.__tape_flash_loading:
+            self.clear_breakpoint(self.__LD_BYTES_ADDR)
+        self.__tape_flash_loading = enable
+
+    # Called on breakpoints. Returns whether the breakpoint is
+    # handled as a flash-loading trap. Entries to LD-BYTES for
+    # blocks that cannot be flash-loaded are handled by letting
+    # the ROM routine load them from pulses.
+    def _handle_tape_flash_loading(self):
+        if (not self.__tape_flash_loading or
+                self.pc != self.__LD_BYTES_ADDR):
+            return False
+
+        if not self.is_tape_paused():
+            pos = self.get_tape_position()
+            for data, begin, end in self.__tape_blocks:
+                if end > pos:
+                    if data is not None:
+                        self.__flash_load_tape_block(data)
+                        self.seek_tape(end)
+                    break
+
+        return True
+
+    # Mimics LD-BYTES. On entry A holds the expected flag byte,
+    # IX and DE hold the address and size of the block and the
+    # carry flag tells loading from verifying. On return the
+    # carry flag is set if there were no errors.
+    def __flash_load_tape_block(self, data):
+        CF = 0x01
+        loading = bool(self.f & CF)
+        addr = self.ix
+        size = self.de
+
+        succeeded = False
+        if data and data[0] == self.a:
+            parity = data[0]
+            i = 0
+            while i < size and 1 + i < len(data):
+                n = data[1 + i]
+                if loading:
+                    # The ROM is not writable.
+                    if addr >= 0x4000:
+                        self.memory_image[addr] = n
+                elif self.read8(addr) != n:
+                    break
+                parity ^= n
+                addr = (addr + 1) & 0xffff
+                i += 1
+
+            if i == size and 1 + i < len(data):
+                parity ^= data[1 + i]
+                succeeded = parity == 0
+
+            self.ix = addr
+            self.de = size - i
+
+        self.af = (self.af & ~CF) | (CF if succeeded else 0)
+
+        # Return from the routine.
+        sp = self.sp
+        self.pc = self.read16(sp)
+        self.sp = (sp + 2) & 0xffff
+
+    def get_tape_time(self):
+        time = Time()
+        time.advance(self.get_tape_ticks() / (self.__TICKS_PER_FRAME * 50))
+        return time
+
     def on_breakpoint(self):
         raise EmulatorException('Breakpoint triggered.')
 
+    def on_watchpoint(self):
+        addr, kind = self.get_watchpoint()
+        access = 'Read from' if kind == self.READ_WATCH_MARK else 'Write to'
+        raise EmulatorException('%s 0x%04x triggered a watchpoint at '
+                                'pc 0x%04x.' % (access, addr, self.pc))
+
     def on_event(self, event, devices, result):
         if isinstance(event, GetEmulationPauseState):
             return self.paused
         elif isinstance(event, GetEmulationTime):
             return self._emulation_time
+        elif isinstance(event, GetTapePlayerTime):
+            return self.get_tape_time()
+        elif isinstance(event, IsTapePlayerPaused):
+            return self.is_tape_paused()
+        elif isinstance(event, IsTapePlayerStopped):
+            return self.is_end_of_tape()
         elif isinstance(event, KeyStroke):
             key = KEYS.get(event.id, None)
             if key:
+                self.set_key_pressed(key, event.pressed)
                 self.paused = False
                 self._quit_playback_mode()
         elif isinstance(event, LoadFile):
             self._load_file(event.filename)
+        elif isinstance(event, LoadTape):
+            self.load_parsed_tape(event.file)
+        elif isinstance(event, PauseUnpauseTape):
+            self.pause_tape(event.pause)
+
+            # TODO: Only notify if the state is actually changed.
+            devices.notify(TapeStateUpdated())
+        elif isinstance(event, RewindEmulation):
+            self.rewind(event.seconds)
         elif isinstance(event, SaveSnapshot):
             self._save_snapshot_file(Z80SnapshotFormat, event.filename)
         elif isinstance(event, ToggleEmulationPause):
@@ -468,3 +779,12 @@ class Spectrum48(_Spectrum48Base, MachineState):
         elif isinstance(event, ToggleTapePause):
             self._toggle_tape_pause()
         return result
+
+
+class Spectrum48(_Spectrum48Mixin, _Spectrum48Base, MachineState):
+    pass
+
+
+# Has no tracing, profiling and statistics.
+class FastSpectrum48(_Spectrum48Mixin, _Spectrum48Fast, MachineState):
+    pass
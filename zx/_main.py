@@ -11,12 +11,17 @@
 
 
 import collections
+import json
+import multiprocessing
 import os
+import signal
 import sys
+import traceback
 from ._data import ArchiveFileFormat
 from ._data import SnapshotFormat
 from ._data import SoundFileFormat
 from ._emulator import Emulator
+from ._emulator import FastEmulator
 from ._error import Error
 from ._error import USER_ERRORS
 from ._error import verbalize_error
@@ -25,19 +30,35 @@ from ._file import detect_file_format
 from ._file import parse_file
 from ._rzx import make_rzx
 from ._rzx import RZXFile
+from ._time import get_elapsed_time
+from ._time import get_timestamp
 
 
 # Stores information about the running code.
 class Profile(object):
-    _annots = dict()
+    def __init__(self):
+        self._annots = dict()
+        self._call_graph = []
 
-    def add_instr_addr(self, addr):
-        self._annots[addr] = 'instr'
+    # Reads out the native profile of the machine.
+    def collect(self, machine):
+        counts = machine.get_profile_instr_counts()
+        ticks = machine.get_profile_instr_ticks()
+        for addr in range(len(counts)):
+            if counts[addr]:
+                self._annots[addr] = 'instr count=%d ticks=%d' % (
+                    counts[addr], ticks[addr])
+
+        self._call_graph = sorted(machine.get_profile_call_graph())
 
     def __iter__(self):
         for addr in sorted(self._annots):
             yield addr, self._annots[addr]
 
+        for caller, callee, num_of_calls, num_of_ticks in self._call_graph:
+            yield caller, 'call 0x%04x count=%d ticks=%d' % (
+                callee, num_of_calls, num_of_ticks)
+
 
 def pop_argument(args, error):
     if not args:
@@ -71,7 +92,14 @@ def profile(args):
     profile = Profile()
     with Emulator(profile=profile) as app:
         app._load_file(file_to_run)
-        app.run()
+
+        # Running ends with closing the window, which raises
+        # EmulationExit. Collect the profile anyway.
+        try:
+            app.run()
+        except EmulationExit:
+            pass
+        profile.collect(app)
 
     # TODO: Amend profile data by reading them out first instead
     # of overwriting.
@@ -105,54 +133,148 @@ def usage():
     sys.exit()
 
 
-def test_file(filename):
-    print('%r' % filename)
+class _TestTimeout(Exception):
+    pass
 
-    def move(dest_dir):
-        os.makedirs(dest_dir, exist_ok=True)
 
-        # Make sure the destination filename is unique.
-        dest_filename = filename
-        while True:
-            dest_path = os.path.join(dest_dir, dest_filename)
-            if not os.path.exists(dest_path):
-                break
+def _on_test_timeout(signum, frame):
+    raise _TestTimeout()
 
-            dest_filename, ext = os.path.splitext(dest_filename)
-            dest_filename = dest_filename.rsplit('--', maxsplit=1)
-            if len(dest_filename) == 1:
-                dest_filename = dest_filename[0] + '--2'
-            else:
-                dest_filename = (dest_filename[0] + '--' +
-                                 str(int(dest_filename[1]) + 1))
 
-            dest_filename = dest_filename + ext
+# Runs a single file and returns a dict describing the result.
+# Executed in worker processes, so must not touch the file
+# itself.
+def _run_test_file(task):
+    filename, timeout = task
 
-        os.rename(filename, dest_path)
-        print('%r moved to %r' % (filename, dest_dir))
+    use_timer = timeout and hasattr(signal, 'setitimer')
+    if use_timer:
+        signal.signal(signal.SIGALRM, _on_test_timeout)
+        signal.setitimer(signal.ITIMER_REAL, timeout)
 
+    result = {'filename': filename}
+    timestamp = get_timestamp()
     with Emulator(speed_factor=None) as app:
         try:
             app._run_file(filename)
-            move('passed')
+            result['result'] = 'passed'
+        except _TestTimeout:
+            result['result'] = 'timeout'
         except Error as e:
-            move(e.id)
+            result['result'] = e.id
         except Exception as e:
             # TODO: Refine.
-            return False
+            result['result'] = 'exception'
+            result['message'] = traceback.format_exc()
+        finally:
+            if use_timer:
+                signal.setitimer(signal.ITIMER_REAL, 0)
+
+        elapsed_time = get_elapsed_time(timestamp)
+        num_of_frames = app._num_of_emulated_frames
+
+    result['frames'] = num_of_frames
+    result['seconds'] = elapsed_time
+    result['frames_per_second'] = (num_of_frames / elapsed_time
+                                   if elapsed_time else None)
+    return result
+
+
+def _move_test_file(filename, dest_dir):
+    os.makedirs(dest_dir, exist_ok=True)
+
+    # Make sure the destination filename is unique.
+    dest_filename = filename
+    while True:
+        dest_path = os.path.join(dest_dir, dest_filename)
+        if not os.path.exists(dest_path):
+            break
+
+        dest_filename, ext = os.path.splitext(dest_filename)
+        dest_filename = dest_filename.rsplit('--', maxsplit=1)
+        if len(dest_filename) == 1:
+            dest_filename = dest_filename[0] + '--2'
+        else:
+            dest_filename = (dest_filename[0] + '--' +
+                             str(int(dest_filename[1]) + 1))
+
+        dest_filename = dest_filename + ext
 
-    return True
+    os.rename(filename, dest_path)
+    print('%r moved to %r' % (filename, dest_dir))
 
 
+# Files are run in a pool of worker processes and then moved to
+# directories named after their results. Files that raise
+# unexpected exceptions are left in place.
 def test(args):
-    for filename in args:
-        if not test_file(filename):
-            break
+    num_of_jobs = os.cpu_count() or 1
+    timeout = None
+    summary_filename = None
+
+    filenames = []
+    while args:
+        arg = args.pop(0)
+        if arg in ['-j', '--jobs']:
+            num_of_jobs = int(pop_argument(args, 'The number of jobs is '
+                                                 'not specified.'))
+        elif arg == '--timeout':
+            timeout = float(pop_argument(args, 'The timeout is not '
+                                               'specified.'))
+        elif arg == '--summary':
+            summary_filename = pop_argument(args, 'The summary filename '
+                                                  'is not specified.')
+        else:
+            filenames.append(arg)
+
+    # Boot once, so forked workers inherit the post-reset state.
+    with Emulator(speed_factor=None) as app:
+        app.reset()
+
+    tasks = [(filename, timeout) for filename in filenames]
+    timestamp = get_timestamp()
+    results = []
+
+    pool = None
+    if num_of_jobs > 1 and len(tasks) > 1:
+        pool = multiprocessing.Pool(num_of_jobs)
+        run_results = pool.imap_unordered(_run_test_file, tasks)
+    else:
+        run_results = map(_run_test_file, tasks)
+
+    try:
+        for result in run_results:
+            results.append(result)
+
+            filename = result['filename']
+            fps = result['frames_per_second']
+            print('%r: %s, %d frames, %s fps' % (
+                filename, result['result'], result['frames'],
+                '%.1f' % fps if fps is not None else '-'))
+
+            if result['result'] == 'exception':
+                print(result['message'], end='')
+            else:
+                _move_test_file(filename, result['result'])
+    finally:
+        if pool:
+            pool.terminate()
+            pool.join()
+
+    if summary_filename:
+        summary = {
+            'jobs': num_of_jobs,
+            'timeout': timeout,
+            'seconds': get_elapsed_time(timestamp),
+            'files': sorted(results, key=lambda r: r['filename']),
+        }
+        with open(summary_filename, 'wt') as f:
+            json.dump(summary, f, indent=2)
 
 
 def fastforward(args):
     for filename in args:
-        with Emulator(speed_factor=0) as app:
+        with FastEmulator(speed_factor=0) as app:
             app._run_file(filename)
 
 
@@ -161,8 +283,8 @@ def _convert_tape_to_snapshot(src, src_filename, src_format,
     assert issubclass(src_format, SoundFileFormat), src_format
     assert issubclass(dest_format, SnapshotFormat), dest_format
 
-    with Emulator(speed_factor=None) as app:
-        app.load_tape(src_filename)
+    with FastEmulator(speed_factor=None) as app:
+        app.load_tape(src_filename, flash_load=True)
         app._save_snapshot_file(dest_format, dest_filename)
 
 
@@ -179,7 +301,7 @@ def _convert_snapshot_to_snapshot(src, src_filename, src_format,
     assert issubclass(src_format, SnapshotFormat), src_format
     assert issubclass(dest_format, SnapshotFormat), dest_format
 
-    with Emulator(speed_factor=None) as app:
+    with FastEmulator(speed_factor=None) as app:
         app._load_file(src_filename)
         app._save_snapshot_file(dest_format, dest_filename)
 
@@ -8,10 +8,24 @@
 #
 #   Published under the MIT license.
 
+import array
 from ._data import MachineSnapshot
 from ._rzx import RZXFile
 
 
+# Packs frames of a 'port_samples' chunk the way the native
+# playback engine takes them.
+def pack_playback_frames(frames):
+    header = array.array('I')
+    for num_of_fetches, samples in frames:
+        header.append(num_of_fetches)
+        header.append(len(samples))
+    samples = b''.join(samples for num_of_fetches, samples in frames)
+    return header, samples
+
+
+# Input samples are served natively a chunk at a time; the player
+# only walks the chunks of the recording.
 # TODO: Rework to a time machine interface.
 class PlaybackPlayer(object):
     def __init__(self, machine, file):
@@ -20,7 +34,8 @@ class PlaybackPlayer(object):
         assert isinstance(file, RZXFile)
         self._recording = file
 
-        self.samples = self.__get_playback_samples()
+        self.__chunks = iter(self.get_chunks())
+        self.playback_chunk = None
 
     def find_recording_info_chunk(self):
         for chunk in self._recording['chunks']:
@@ -31,52 +46,23 @@ class PlaybackPlayer(object):
     def get_chunks(self):
         return self._recording['chunks']
 
-    def __get_playback_samples(self):
-        # TODO: Have a class describing playback state.
-        self.playback_frame_count = 0
-        self.playback_chunk = 0
-        self.playback_sample_values = []
-        self.playback_sample_i = 0
-
-        frame_count = 0
-        for chunk_i, chunk in enumerate(self.get_chunks()):
+    # Installs snapshots preceding the next chunk of input
+    # samples and loads the samples to the machine. Returns
+    # False at the end of the recording.
+    def load_next_chunk(self):
+        for chunk in self.__chunks:
             if isinstance(chunk, MachineSnapshot):
                 self.__machine.install_snapshot(chunk)
                 continue
 
-            if chunk['id'] != 'port_samples':
+            if chunk['id'] != 'port_samples' or not chunk['frames']:
                 continue
 
             self.__machine.ticks_since_int = chunk['first_tick']
+            self.__machine.set_playback_chunk(
+                *pack_playback_frames(chunk['frames']))
 
-            for frame_i, frame in enumerate(chunk['frames']):
-                num_of_fetches, samples = frame
-                # print(num_of_fetches, samples)
-
-                self.__machine.fetches_limit = num_of_fetches
-                # print(num_of_fetches, samples, flush=True)
-
-                # print('START_OF_FRAME', flush=True)
-                yield 'START_OF_FRAME'
-
-                for sample_i, sample in enumerate(samples):
-                    # print(self.fetches_limit)
-                    # fetch = num_of_fetches - self.fetches_limit
-                    # print('Input at fetch', fetch, 'of', num_of_fetches)
-                    # TODO: print('read_port 0x%04x 0x%02x' % (addr, n),
-                    #             flush=True)
-
-                    # TODO: Have a class describing playback state.
-                    self.playback_frame_count = frame_count
-                    self.playback_chunk = chunk
-                    self.playback_sample_values = samples
-                    self.playback_sample_i = sample_i
-                    # print(frame_count, chunk_i, frame_i, sample_i, sample,
-                    #       flush=True)
-
-                    yield sample
-
-                # print('END_OF_FRAME', flush=True)
-                yield 'END_OF_FRAME'
+            self.playback_chunk = chunk
+            return True
 
-                frame_count += 1
+        return False
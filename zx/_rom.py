@@ -17,7 +17,16 @@ def _get_resource_path(path):
     return pkg_resources.resource_filename('zx', path)
 
 
+# ROM images are only read once and then shared by all machines
+# of the process.
+_ROM_IMAGES = {}
+
+
 def load_rom_image(filename):
-    path = os.path.join('roms', filename)
-    with open(_get_resource_path(path), mode='rb') as f:
-        return f.read()
+    image = _ROM_IMAGES.get(filename)
+    if image is None:
+        path = os.path.join('roms', filename)
+        with open(_get_resource_path(path), mode='rb') as f:
+            image = f.read()
+        _ROM_IMAGES[filename] = image
+    return image
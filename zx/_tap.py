@@ -12,7 +12,7 @@
 from ._binary import BinaryParser
 from ._data import SoundFile
 from ._data import SoundFileFormat
-from ._tape import get_block_pulses, tag_last_pulse
+from ._tape import get_block_pulses, get_tape_pulses, tag_last_pulse
 
 
 class TAPFile(SoundFile):
@@ -21,21 +21,17 @@ class TAPFile(SoundFile):
     def __init__(self, fields):
         SoundFile.__init__(self, TAPFileFormat, fields)
 
-    def _generate_pulses(self):
-        level = False
-        blocks = self['blocks']
-        for data in blocks:
-            # The block itself.
-            for pulse, id in get_block_pulses(data):
-                yield level, pulse, id
-                level = not level
-
-            # Pause. Skip, if it's the last block.
-            if data is not blocks[-1]:
-                yield level, self._TICKS_FREQ, ('PAUSE',)  # 1s.
+    def get_blocks(self):
+        blocks = []
+        for data in self['blocks']:
+            # Pause for 1s. Skip, if it's the last block.
+            pause = (None if data is self['blocks'][-1] else
+                     self._TICKS_FREQ)
+            blocks.append((data, list(get_block_pulses(data)), pause))
+        return blocks
 
     def get_pulses(self):
-        return tag_last_pulse(self._generate_pulses())
+        return tag_last_pulse(get_tape_pulses(self.get_blocks()))
 
 
 class TAPFileFormat(SoundFileFormat):
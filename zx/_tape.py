@@ -9,16 +9,7 @@
 #   Published under the MIT license.
 
 
-from ._device import Device
-from ._device import EndOfFrame
-from ._device import GetTapeLevel
-from ._device import GetTapePlayerTime
-from ._device import IsTapePlayerPaused
-from ._device import IsTapePlayerStopped
-from ._device import LoadTape
-from ._device import PauseUnpauseTape
-from ._device import TapeStateUpdated
-from ._time import Time
+import array
 
 
 def _get_pilot_pulses(pilot_tone_len,
@@ -77,6 +68,35 @@ def get_block_pulses(data,
         yield pulse
 
 
+# Tape blocks are triples of the data the ROM loader can load
+# directly or None, the pulses of the block and the duration of
+# the pause after it, if any.
+def get_tape_pulses(blocks):
+    level = False
+    for data, pulses, pause in blocks:
+        for pulse, ids in pulses:
+            yield level, pulse, ids
+            level = not level
+
+        # Pauses of zero duration shall be ignored, and then
+        # the output level remains the same.
+        if pause:
+            yield level, pause, ('PAUSE',)
+
+
+# Returns the data of blocks along with the indexes of their first
+# pulses and the pulses following them.
+def get_tape_block_bounds(blocks):
+    bounds = []
+    pos = 0
+    for data, pulses, pause in blocks:
+        begin = pos
+        pos += len(pulses) + (1 if pause else 0)
+        if pos != begin:
+            bounds.append((data, begin, pos))
+    return bounds
+
+
 def tag_last_pulse(pulses):
     current_pulse = None
     for pulse in pulses:
@@ -91,108 +111,13 @@ def tag_last_pulse(pulses):
             yield level, pulse, ids
 
 
-class TapePlayer(Device):
-    def __init__(self):
-        self._is_paused = True
-        self._pulses = None
-        self._tick = 0
-        self._level = False
-        self._pulse = 0
-        self._ticks_per_frame = 69888  # TODO
-        self._time = Time()
-
-    def is_paused(self):
-        return self._is_paused
-
-    def pause(self, is_paused=True):
-        self._is_paused = is_paused
-
-    def unpause(self):
-        self.pause(is_paused=False)
-
-    def toggle_pause(self):
-        self.pause(not self.is_paused())
-
-    def is_end(self):
-        return self._pulses is None
-
-    def get_time(self):
-        return self._time
-
-    def load_parsed_file(self, file):
-        self._pulses = file.get_pulses()
-        self._level = False
-        self.pause()
-
-    def load_tape(self, file):
-        self.load_parsed_file(file)
-
-    def get_level_at_frame_tick(self, tick):
-        assert self._tick <= tick, (self._tick, tick)
-
-        while self._tick < tick:
-            if self._is_paused:
-                self._tick = tick
-                continue
-
-            # See if we already have a non-zero-length pulse.
-            if self._pulse:
-                ticks_to_skip = min(self._pulse, tick - self._tick)
-                self._pulse -= ticks_to_skip
-                self._tick += ticks_to_skip
-                self._time.advance(ticks_to_skip /
-                                   (self._ticks_per_frame * 50))
-                continue
-
-            # Get subsequent pulse, if any.
-            new_pulse = None
-            if self._pulses:
-                for new_pulse in self._pulses:
-                    break
-
-            if new_pulse:
-                # print(new_pulse)
-                self._level, self._pulse, ids = new_pulse
-
-                # The tape shall be considered stopped as soon as the last
-                # pulse is fetched, and not on the next attempt to fetch a
-                # pulse.
-                if 'END' in ids:
-                    self._pulses = None
-
-                continue
-
-            # Do nothing, if there are no more pulses available.
-            self._pulses = None
-            self._level = False
-            self._tick = tick
-
-        return self._level
-
-    def skip_rest_of_frame(self):
-        if self._tick < self._ticks_per_frame:
-            self.get_level_at_frame_tick(self._ticks_per_frame)
-
-        assert self._tick >= self._ticks_per_frame
-        self._tick -= self._ticks_per_frame
-
-    def on_event(self, event, devices, result):
-        if isinstance(event, EndOfFrame):
-            self.skip_rest_of_frame()
-        elif isinstance(event, GetTapePlayerTime):
-            return self.get_time()
-        elif isinstance(event, GetTapeLevel):
-            return self.get_level_at_frame_tick(event.frame_tick)
-        elif isinstance(event, IsTapePlayerPaused):
-            return self.is_paused()
-        elif isinstance(event, IsTapePlayerStopped):
-            return self.is_end()
-        elif isinstance(event, LoadTape):
-            self.load_tape(event.file)
-        elif isinstance(event, PauseUnpauseTape):
-            self.pause(event.pause)
-
-            # TODO: Only notify if the state is actually changed.
-            devices.notify(TapeStateUpdated())
-
-        return result
+# Packs pulses into the format the native tape engine consumes:
+# 32-bit values with the duration in the lower 31 bits and the
+# level in the most significant bit.
+def pack_tape_pulses(pulses):
+    image = array.array('I')
+    assert image.itemsize == 4
+    for level, pulse, ids in pulses:
+        assert 0 <= pulse < (1 << 31), pulse
+        image.append(pulse | (1 << 31) if level else pulse)
+    return image.tobytes()
@@ -0,0 +1,77 @@
+# -*- coding: utf-8 -*-
+
+#   ZX Spectrum Emulator.
+#   https://github.com/kosarev/zx
+#
+#   Copyright (C) 2017-2021 Ivan Kosarev.
+#   ivan@kosarev.info
+#
+#   Published under the MIT license.
+
+import struct
+from ._emulatorbase import disassemble
+
+
+# Record kinds.
+INSTR_RECORD = 0
+INPUT_RECORD = 1
+INT_ACCEPTED_RECORD = 2
+INT_IGNORED_RECORD = 3
+
+# Record flags.
+IFF1_FLAG = 1 << 0
+INT_DISABLED_FLAG = 1 << 1
+NEW_ROM_INSTR_FLAG = 1 << 2
+
+# Mirrors zx::trace_buffer_type and zx::trace_record.
+_HEADER = struct.Struct('<I')
+_RECORD = struct.Struct('<I11H3B4s3x')
+_RECORD_FIELDS = ('tick', 'pc', 'af', 'bc', 'de', 'hl', 'ix', 'iy',
+                  'sp', 'wz', 'ir', 'port_addr', 'kind', 'flags',
+                  'port_value', 'instr_bytes')
+_BUFFER_SIZE = 4096  # In records.
+
+
+# Returns trace records in the chronological order.
+def get_trace_records(view, last=None):
+    num_of_records, = _HEADER.unpack_from(view, 0)
+
+    n = min(num_of_records, _BUFFER_SIZE)
+    if last is not None:
+        n = min(n, last)
+
+    records = []
+    for i in range(num_of_records - n, num_of_records):
+        offset = _HEADER.size + (i % _BUFFER_SIZE) * _RECORD.size
+        values = _RECORD.unpack_from(view, offset)
+        records.append(dict(zip(_RECORD_FIELDS, values)))
+    return records
+
+
+def format_trace_record(record):
+    kind = record['kind']
+    flags = record['flags']
+    iff1 = int(bool(flags & IFF1_FLAG))
+
+    if kind == INPUT_RECORD:
+        return 'read_port %04x %02x' % (record['port_addr'],
+                                        record['port_value'])
+
+    if kind == INT_ACCEPTED_RECORD:
+        return 'INT accepted'
+
+    if kind == INT_IGNORED_RECORD:
+        int_disabled = int(bool(flags & INT_DISABLED_FLAG))
+        return 'INT ignored (int_disabled=%u, iff1=%u)' % (int_disabled, iff1)
+
+    assert kind == INSTR_RECORD, kind
+    instr_bytes = record['instr_bytes']
+    return ('%7u '
+            'PC:%04x AF:%04x BC:%04x DE:%04x HL:%04x IX:%04x IY:%04x '
+            'SP:%04x WZ:%04x IR:%04x iff1:%u '
+            '%s %s%s' % (
+                record['tick'], record['pc'], record['af'], record['bc'],
+                record['de'], record['hl'], record['ix'], record['iy'],
+                record['sp'], record['wz'], record['ir'], iff1,
+                instr_bytes.hex(), disassemble(instr_bytes, record['pc']),
+                ' [new]' if flags & NEW_ROM_INSTR_FLAG else ''))
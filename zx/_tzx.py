@@ -13,7 +13,8 @@ from ._binary import BinaryParser
 from ._data import SoundFile
 from ._data import SoundFileFormat
 from ._error import Error
-from ._tape import get_block_pulses, get_data_pulses, tag_last_pulse
+from ._tape import get_block_pulses, get_data_pulses
+from ._tape import get_tape_pulses, tag_last_pulse
 
 
 class TZXFile(SoundFile):
@@ -22,17 +23,20 @@ class TZXFile(SoundFile):
     def __init__(self, fields):
         SoundFile.__init__(self, TZXFileFormat, fields)
 
-    def _generate_pulses(self):
-        level = False
+    def get_blocks(self):
+        blocks = []
         for block in self['blocks']:
             id = block['id']
             if id in ['0x10 (Standard Speed Data Block)',
                       '0x11 (Turbo Speed Data Block)',
                       '0x14 (Pure Data Block)']:
-                # The block itself.
+                # The block itself. Only standard speed blocks are
+                # known to be loadable by the ROM.
                 data = block['data']
+                loadable_data = None
                 if id == '0x10 (Standard Speed Data Block)':
                     pulses = get_block_pulses(data)
+                    loadable_data = data
                 elif id == '0x11 (Turbo Speed Data Block)':
                     pulses = get_block_pulses(
                         data=data,
@@ -50,18 +54,9 @@ class TZXFile(SoundFile):
                 else:
                     assert 0, id
 
-                for pulse, ids in pulses:
-                    yield level, pulse, ids
-                    level = not level
-
                 # Pause.
                 pause_duration = block['pause_after_block_in_ms']
 
-                # Pause blocks of zero duration shall be ignored,
-                # and then the output level remains the same.
-                if pause_duration == 0:
-                    continue
-
                 # At the end of the non-zero-duration pause the
                 # output level shall be low.
                 ''' TODO: Despite the specification, this cases
@@ -75,9 +70,8 @@ class TZXFile(SoundFile):
                 assert not level
                 '''
 
-                if pause_duration:
-                    yield (level, pause_duration * self._TICKS_FREQ // 1000,
-                           ('PAUSE',))
+                blocks.append((loadable_data, list(pulses),
+                               pause_duration * self._TICKS_FREQ // 1000))
             elif id == '0x30 (Text Description)':
                 print(block['text'])
             elif id in ['0x32 (Archive Info)', '0x21 (Group Start)',
@@ -85,9 +79,10 @@ class TZXFile(SoundFile):
                 pass
             else:
                 assert 0, block  # TODO
+        return blocks
 
     def get_pulses(self):
-        return tag_last_pulse(self._generate_pulses())
+        return tag_last_pulse(get_tape_pulses(self.get_blocks()))
 
 
 class TZXFileFormat(SoundFileFormat):
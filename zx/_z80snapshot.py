@@ -15,6 +15,7 @@ from ._data import MachineSnapshot
 from ._data import ProcessorSnapshot
 from ._data import SnapshotFormat
 from ._data import UnifiedSnapshot
+from ._emulatorbase import uncompress_z80_block
 from ._error import Error
 from ._utils import make16
 
@@ -23,6 +24,8 @@ _V1_FORMAT = '1.45'
 _V2_FORMAT = '2.x'
 _V3_FORMAT = '3.x'
 
+_V1_TERMINATOR = b'\x00\xed\xed\x00'
+
 
 def _get_format_version(fields):
     if 'ticks_count_low' in fields:
@@ -149,23 +152,23 @@ class Z80SnapshotFormat(SnapshotFormat):
 
     _RAW_MEMORY_BLOCK_SIZE_VALUE = 0xffff
 
-    def _uncompress(self, compressed_image, uncompressed_size):
-        MARKER = 0xed
-        input = list(compressed_image)
-        output = []
-        while input:
-            if len(input) >= 4 and input[0] == MARKER and input[1] == MARKER:
-                count = input[2]
-                filler = input[3]
-                output.extend([filler] * count)
-                del input[0:4]
-            else:
-                output.append(input.pop(0))
+    # Blocks are validated before anything is installed, so
+    # corrupted snapshots are rejected at parse time.
+    def _uncompress(self, compressed_image, uncompressed_size,
+                    terminator=b''):
+        uncompressed = uncompress_z80_block(compressed_image,
+                                            uncompressed_size)
+        if uncompressed is None:
+            raise Error('Corrupted compressed memory block.')
 
-        if len(output) != uncompressed_size:
+        image, consumed = uncompressed
+        if compressed_image[consumed:] != terminator:
+            if terminator:
+                raise Error('The compressed memory block does not '
+                            'terminate properly.')
             raise Error('Corrupted compressed memory block.')
 
-        return bytes(output)
+        return image
 
     def _parse_memory_block(self, parser):
         BLOCK_SIZE = 16 * 1024
@@ -211,14 +214,8 @@ class Z80SnapshotFormat(SnapshotFormat):
                     raise Error('The snapshot is too large.')
                 image = parser.extract_rest()
             else:
-                image = self._uncompress(parser.extract_rest(),
-                                         48 * 1024 + 4)
-
-                # Remove the terminator.
-                if image[48 * 1024:] != b'\x00\xed\xed\x00':
-                    raise Error('The compressed memory block does not '
-                                'terminate properly.')
-                image = image[:48 * 1024]
+                image = self._uncompress(parser.extract_rest(), 48 * 1024,
+                                         terminator=_V1_TERMINATOR)
 
             fields['memory_snapshot'] = image
         else:
@@ -247,6 +244,9 @@ class Z80SnapshotFormat(SnapshotFormat):
         flags1 |= (r & 0x80) >> 7
         r &= 0x7f
 
+        # Memory is always stored compressed.
+        flags1 |= 0x20
+
         border_color = state.border_color
         assert 0 <= border_color <= 7
         flags1 |= border_color << 1
@@ -270,6 +270,7 @@ class Z80SnapshotFormat(SnapshotFormat):
             iff1=state.iff1, iff2=state.iff2, flags2=flags2)
 
         # Write memory snapshot.
-        writer.write_block(state.read(0x4000, size=48 * 1024))
+        writer.write_block(state.compress_z80_block(0x4000, 48 * 1024) +
+                           _V1_TERMINATOR)
 
         return writer.get_image()